@@ -0,0 +1,550 @@
+// Same as main.cpp, except `Manager` is a real growable container.
+//
+// In main.cpp, `Manager` allocates `new MyPair[capacity_]`, which default
+// constructs every `StorageImpl` up front, even the ones that are never used.
+// `emplace_back` takes a `StorageImpl` by value, copies it into the pair that
+// was already there, and throws once the capacity is reached.
+//
+// Here, `Manager<T>` allocates raw storage and only constructs elements with
+// placement new when they're added, like placement_new/main.cpp does by hand.
+// `emplace_back(args...)` forwards its arguments straight to the constructor
+// of the new element, so `emplace_back(10, "ten")` makes the `StorageImpl`
+// inside the pair, without any temporary `StorageImpl` to copy or move from.
+//
+// When it's full, `Manager` doubles its capacity and relocates the elements
+// into the new storage:
+//
+//  * If `is_trivially_relocatable<T>` is true, which by default it is for
+//    trivially copyable types, the elements are copied with one `memcpy`.
+//
+//  * Otherwise, if `T` has a noexcept move constructor, each element is
+//    moved and the old one destroyed.
+//
+//  * Otherwise, each element is copied, or moved if `T` can't be copied, and
+//    the old elements are only destroyed once they've all been relocated. So
+//    if a copy or move throws, the old storage is still intact.
+//
+// The new element is constructed in the new storage before anything is
+// relocated, so `emplace_back` has the strong exception guarantee unless `T`
+// is move-only with a move constructor that can throw: if it throws, the
+// `Manager` is left the way it was. For a move-only `T` whose move throws,
+// some elements may have been moved from, but they're all still there. That
+// the new element is made first is also what makes `emplace_back(m[0])` safe
+// when `m` is full.
+//
+// `StorageImpl` counts how many times it's constructed, copied, and moved, so
+// the examples can check that `emplace_back` doesn't make a temporary. The
+// benchmark inserts 10M pairs with `Manager` and with `std::vector`.
+//
+// `Manager` is not faster than `std::vector`, which does all of the same
+// things. On a 1 core VM, `Manager<MyPair>` took 720 to 1100 ms and
+// `std::vector<MyPair>::emplace_back` 720 to 1030 ms, with either one ahead
+// depending on the run, and another machine measured `Manager` at 1056 ms
+// against 915 ms for `std::vector`. Pushing a temporary `MyPair` into a
+// `std::vector` was 10 to 20% slower than either. For `IdPair`, both took
+// 250 to 350 ms. What `Manager` fixes is main.cpp's up front default
+// construction and fixed capacity, not `std::vector`'s speed.
+//
+// Build with:
+//   g++ -std=c++17 -O2 main1.cpp -o main1
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <string>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <iostream>
+
+class StorageImpl {
+ public:
+  StorageImpl() {
+    num_constructed++;
+  }
+
+  explicit StorageImpl(std::string name)
+    : name_(std::move(name))
+  {
+    num_constructed++;
+  }
+
+  StorageImpl(const StorageImpl& other)
+    : name_(other.name_)
+  {
+    num_copied++;
+  }
+
+  StorageImpl(StorageImpl&& other) noexcept
+    : name_(std::move(other.name_))
+  {
+    num_moved++;
+  }
+
+  StorageImpl& operator=(const StorageImpl& other) {
+    name_ = other.name_;
+    num_copied++;
+    return *this;
+  }
+
+  StorageImpl& operator=(StorageImpl&& other) noexcept {
+    name_ = std::move(other.name_);
+    num_moved++;
+    return *this;
+  }
+
+  const std::string& name() const {
+    return name_;
+  }
+
+  static void reset_counts() {
+    num_constructed = 0;
+    num_copied = 0;
+    num_moved = 0;
+  }
+
+  static inline size_t num_constructed = 0;
+  static inline size_t num_copied = 0;
+  static inline size_t num_moved = 0;
+
+ private:
+  std::string name_;
+};
+
+struct MyPair {
+  MyPair() {}
+
+  MyPair(size_t first, StorageImpl second)
+    : first(first),
+      second(std::move(second))
+  {}
+
+  // Constructs `second` in place from `args`
+  template <typename... Args,
+            typename = std::enable_if_t<std::is_constructible_v<StorageImpl, Args&&...>>>
+  MyPair(size_t first, Args&&... args)
+    : first(first),
+      second(std::forward<Args>(args)...)
+  {}
+
+  size_t first;
+  StorageImpl second;
+};
+
+// Whether a `T` can be moved to another address with `memcpy`, without
+// running its move constructor and destructor. Specialize this for types that
+// are safe to relocate but aren't trivially copyable. `MyPair` isn't one of
+// them, because libstdc++'s `std::string` points into itself when the string
+// is short.
+template <typename T>
+struct is_trivially_relocatable : std::is_trivially_copyable<T> {};
+
+// A pair of IDs, which is trivially copyable and so trivially relocatable
+struct IdPair {
+  size_t first;
+  size_t second;
+};
+
+template <typename T>
+class Manager {
+ public:
+  static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__,
+    "Manager doesn't support over-aligned types");
+
+  Manager() = default;
+
+  explicit Manager(size_t capacity) {
+    reserve(capacity);
+  }
+
+  Manager(const Manager&) = delete;
+  Manager& operator=(const Manager&) = delete;
+
+  Manager(Manager&& other) noexcept
+    : list_(std::exchange(other.list_, nullptr)),
+      size_(std::exchange(other.size_, 0)),
+      capacity_(std::exchange(other.capacity_, 0))
+  {}
+
+  Manager& operator=(Manager&& other) noexcept {
+    if (this != &other) {
+      clear();
+      deallocate(list_);
+      list_ = std::exchange(other.list_, nullptr);
+      size_ = std::exchange(other.size_, 0);
+      capacity_ = std::exchange(other.capacity_, 0);
+    }
+    return *this;
+  }
+
+  ~Manager() {
+    clear();
+    deallocate(list_);
+  }
+
+  // Constructs a new element at the end from `args`
+  template <typename... Args>
+  T& emplace_back(Args&&... args) {
+    if (size_ == capacity_) {
+      return grow_and_emplace_back(std::forward<Args>(args)...);
+    }
+    T* element = new (list_ + size_) T(std::forward<Args>(args)...);
+    size_++;
+    return *element;
+  }
+
+  void reserve(size_t capacity) {
+    if (capacity <= capacity_) {
+      return;
+    }
+    T* new_list = allocate(capacity);
+    try {
+      relocate(new_list);
+    } catch (...) {
+      deallocate(new_list);
+      throw;
+    }
+    list_ = new_list;
+    capacity_ = capacity;
+  }
+
+  void clear() noexcept {
+    for (size_t i = 0; i < size_; i++) {
+      list_[i].~T();
+    }
+    size_ = 0;
+  }
+
+  T& operator[](size_t i) {
+    return list_[i];
+  }
+
+  const T& operator[](size_t i) const {
+    return list_[i];
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  T* begin() {
+    return list_;
+  }
+
+  T* end() {
+    return list_ + size_;
+  }
+
+ private:
+  static T* allocate(size_t capacity) {
+    if (capacity > SIZE_MAX / sizeof(T)) {
+      throw std::length_error("Manager capacity is too large");
+    }
+    return static_cast<T*>(::operator new(capacity * sizeof(T)));
+  }
+
+  static void deallocate(T* list) {
+    ::operator delete(list);
+  }
+
+  template <typename... Args>
+  T& grow_and_emplace_back(Args&&... args) {
+    size_t new_capacity = std::max<size_t>(capacity_ * 2, 1);
+    T* new_list = allocate(new_capacity);
+    // Made before relocating, since `args` might refer to an element
+    T* element;
+    try {
+      element = new (new_list + size_) T(std::forward<Args>(args)...);
+    } catch (...) {
+      deallocate(new_list);
+      throw;
+    }
+    try {
+      relocate(new_list);
+    } catch (...) {
+      element->~T();
+      deallocate(new_list);
+      throw;
+    }
+    list_ = new_list;
+    capacity_ = new_capacity;
+    size_++;
+    return *element;
+  }
+
+  // Moves the elements into `new_list` and frees the old storage. If this
+  // throws, the elements are still in the old storage, and the caller still
+  // owns `new_list`.
+  void relocate(T* new_list) {
+    if constexpr (is_trivially_relocatable<T>::value) {
+      if (size_) {
+        std::memcpy(static_cast<void*>(new_list), static_cast<const void*>(list_), size_ * sizeof(T));
+      }
+    } else if constexpr (std::is_nothrow_move_constructible_v<T>) {
+      for (size_t i = 0; i < size_; i++) {
+        new (new_list + i) T(std::move(list_[i]));
+        list_[i].~T();
+      }
+    } else {
+      // Copies, or moves if `T` can't be copied. Nothing is destroyed until
+      // every element has been relocated, so if one throws, the old elements
+      // are all still there, although some may have been moved from.
+      size_t i = 0;
+      try {
+        for (; i < size_; i++) {
+          new (new_list + i) T(std::move_if_noexcept(list_[i]));
+        }
+      } catch (...) {
+        while (i > 0) {
+          new_list[--i].~T();
+        }
+        throw;
+      }
+      for (i = 0; i < size_; i++) {
+        list_[i].~T();
+      }
+    }
+    deallocate(list_);
+  }
+
+  T* list_ = nullptr;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+};
+
+// Throws from its `countdown`th construction or copy. Has no move
+// constructor, so `Manager` has to copy it when it grows.
+struct Flaky {
+  explicit Flaky(int value)
+    : value(value)
+  {
+    maybe_throw();
+    num_alive++;
+  }
+
+  Flaky(const Flaky& other)
+    : value(other.value)
+  {
+    maybe_throw();
+    num_alive++;
+  }
+
+  ~Flaky() {
+    num_alive--;
+  }
+
+  static void maybe_throw() {
+    if (countdown > 0 && --countdown == 0) {
+      throw std::runtime_error("Flaky");
+    }
+  }
+
+  int value;
+
+  static inline int countdown = 0;
+  static inline int num_alive = 0;
+};
+
+// Move-only, and its move constructor isn't noexcept and throws from its
+// `countdown`th move
+struct FlakyMoveOnly {
+  explicit FlakyMoveOnly(int value)
+    : value(value)
+  {
+    num_alive++;
+  }
+
+  FlakyMoveOnly(const FlakyMoveOnly&) = delete;
+
+  FlakyMoveOnly(FlakyMoveOnly&& other)
+    : value(other.value)
+  {
+    if (countdown > 0 && --countdown == 0) {
+      throw std::runtime_error("FlakyMoveOnly");
+    }
+    num_alive++;
+  }
+
+  ~FlakyMoveOnly() {
+    num_alive--;
+  }
+
+  int value;
+
+  static inline int countdown = 0;
+  static inline int num_alive = 0;
+};
+
+void check(bool cond, const char* msg) {
+  std::cout << (cond ? "yay. " : "BOO. ") << msg << std::endl;
+}
+
+bool flaky_values_are(Manager<Flaky>& m, int count) {
+  for (int i = 0; i < count; i++) {
+    if (m[i].value != i) {
+      return false;
+    }
+  }
+  return m.size() == size_t(count);
+}
+
+void examples() {
+  {
+    StorageImpl::reset_counts();
+    Manager<MyPair> m;
+    m.emplace_back(10, "ten");
+    m.emplace_back(20, "twenty");
+    check(m.size() == 2 && m[0].first == 10 && m[0].second.name() == "ten" &&
+          m[1].first == 20 && m[1].second.name() == "twenty",
+      "emplace_back grows from empty");
+    check(StorageImpl::num_constructed == 2 && StorageImpl::num_copied == 0,
+      "emplace_back constructs StorageImpl in place");
+    check(StorageImpl::num_moved == 1, "growing moves the existing element once");
+  }
+  {
+    Manager<MyPair> m(1000);
+    StorageImpl::reset_counts();
+    for (size_t i = 0; i < 1000; i++) {
+      m.emplace_back(i, "name");
+    }
+    check(StorageImpl::num_constructed == 1000 && StorageImpl::num_copied == 0 &&
+          StorageImpl::num_moved == 0,
+      "no copies or moves with enough capacity");
+    check(m.capacity() == 1000, "reserve doesn't default construct anything");
+  }
+  {
+    Manager<MyPair> m(1);
+    m.emplace_back(1, "a string that is too long to be stored inline");
+    m.emplace_back(m[0]);
+    check(m.size() == 2 && m[1].second.name() == m[0].second.name(),
+      "emplace_back of an element when full");
+  }
+  {
+    Manager<IdPair> m;
+    for (size_t i = 0; i < 100; i++) {
+      m.emplace_back(IdPair{i, i * 2});
+    }
+    bool ok = m.size() == 100 && m.capacity() == 128;
+    for (size_t i = 0; i < 100; i++) {
+      ok &= m[i].first == i && m[i].second == i * 2;
+    }
+    check(ok, "trivially relocatable elements survive growth");
+  }
+  {
+    Manager<Flaky> m(4);
+    for (int i = 0; i < 4; i++) {
+      m.emplace_back(i);
+    }
+    Flaky::countdown = 1;
+    bool threw = false;
+    try {
+      m.emplace_back(4);
+    } catch (const std::runtime_error&) {
+      threw = true;
+    }
+    check(threw && flaky_values_are(m, 4) && m.capacity() == 4 && Flaky::num_alive == 4,
+      "throwing constructor leaves Manager unchanged");
+
+    Flaky::countdown = 3;
+    threw = false;
+    try {
+      m.emplace_back(4);
+    } catch (const std::runtime_error&) {
+      threw = true;
+    }
+    check(threw && flaky_values_are(m, 4) && m.capacity() == 4 && Flaky::num_alive == 4,
+      "throwing copy while growing leaves Manager unchanged");
+
+    Flaky::countdown = 0;
+    m.emplace_back(4);
+    check(flaky_values_are(m, 5) && Flaky::num_alive == 5, "growing by copying");
+  }
+  check(Flaky::num_alive == 0, "all elements destroyed");
+  {
+    Manager<FlakyMoveOnly> m(4);
+    for (int i = 0; i < 4; i++) {
+      m.emplace_back(i);
+    }
+    FlakyMoveOnly::countdown = 3;
+    bool threw = false;
+    try {
+      m.emplace_back(4);
+    } catch (const std::runtime_error&) {
+      threw = true;
+    }
+    bool ok = threw && m.size() == 4 && m.capacity() == 4 && FlakyMoveOnly::num_alive == 4;
+    for (int i = 0; i < 4; i++) {
+      ok &= m[i].value == i;
+    }
+    check(ok, "throwing move while growing leaves every element in place");
+    FlakyMoveOnly::countdown = 0;
+    m.emplace_back(4);
+    check(m.size() == 5 && m[4].value == 4 && FlakyMoveOnly::num_alive == 5, "growing by moving");
+  }
+  check(FlakyMoveOnly::num_alive == 0, "all move-only elements destroyed");
+  std::cout << std::endl;
+}
+
+template <typename Func>
+double time_ms(Func func) {
+  auto start = std::chrono::steady_clock::now();
+  func();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+template <typename Func>
+double best_ms(Func func) {
+  double best = time_ms(func);
+  for (int i = 0; i < 2; i++) {
+    best = std::min(best, time_ms(func));
+  }
+  return best;
+}
+
+int main() {
+  examples();
+
+  const size_t num_entries = 10'000'000;
+  std::cout << "insert " << num_entries << " entries, best of 3, ms:" << std::endl;
+
+  std::cout << "  MyPair:" << std::endl;
+  std::cout << "    std::vector push_back(MyPair(i, StorageImpl(...))): " << best_ms([&] {
+    std::vector<MyPair> v;
+    for (size_t i = 0; i < num_entries; i++) {
+      v.push_back(MyPair(i, StorageImpl("name")));
+    }
+  }) << std::endl;
+  std::cout << "    std::vector emplace_back(i, ...):                  " << best_ms([&] {
+    std::vector<MyPair> v;
+    for (size_t i = 0; i < num_entries; i++) {
+      v.emplace_back(i, "name");
+    }
+  }) << std::endl;
+  std::cout << "    Manager emplace_back(i, ...):                      " << best_ms([&] {
+    Manager<MyPair> m;
+    for (size_t i = 0; i < num_entries; i++) {
+      m.emplace_back(i, "name");
+    }
+  }) << std::endl;
+
+  std::cout << "  IdPair, relocated with memcpy:" << std::endl;
+  std::cout << "    std::vector push_back:  " << best_ms([&] {
+    std::vector<IdPair> v;
+    for (size_t i = 0; i < num_entries; i++) {
+      v.push_back({i, i});
+    }
+  }) << std::endl;
+  std::cout << "    Manager emplace_back:   " << best_ms([&] {
+    Manager<IdPair> m;
+    for (size_t i = 0; i < num_entries; i++) {
+      m.emplace_back(IdPair{i, i});
+    }
+  }) << std::endl;
+}
@@ -0,0 +1,574 @@
+// Same as main4.cpp, except with a better `WarnCounter`.
+//
+// In main3.cpp, `get_warn_counter()` returns a function-local static with a
+// `uint8_t` count, so it wraps at 256, and concurrent increments race. main4.cpp
+// made it a single `std::atomic<uint64_t>`, which is correct, but every
+// warning from every thread then does a `fetch_add` on the same cache line.
+//
+// Here the counter is sharded. Each thread gets its own cache line sized slot
+// with one 64-bit count per kind of message (`cow_read_msg` and
+// `cow_write_msg`). Only the owning thread writes to a slot, so an increment
+// is a relaxed load and store instead of a locked read-modify-write, and no
+// other thread ever touches that cache line except to read it. Reading the
+// counter sums all the slots.
+//
+// Slots are never freed. When a thread exits, its slot goes back on a free
+// list and the next new thread reuses it, so the counts from exited threads
+// are still included in the totals. `reset()` doesn't write to the slots,
+// since that would race with the owning threads. It just remembers the
+// current totals and subtracts them from later reads.
+//
+// Build with:
+//   g++ -std=c++17 -O2 -pthread main10.cpp -o main10
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <ios>
+#include <memory>
+#include <mutex>
+#include <iostream>
+#include <optional>
+#include <thread>
+#include <tuple>
+#include <variant>
+#include <vector>
+
+namespace COWSim {
+static const char cow_read_msg[] = "WRITE THEN READ";
+static const char cow_write_msg[] = "WRITE THEN WRITE";
+
+enum class WarnKind : uint8_t { Read = 0, Write = 1 };
+static constexpr size_t kNumWarnKinds = 2;
+
+inline const char* warn_msg(WarnKind kind) {
+  return kind == WarnKind::Read ? cow_read_msg : cow_write_msg;
+}
+
+struct WarnCounts {
+  uint64_t counts[kNumWarnKinds] = {};
+
+  uint64_t operator[](WarnKind kind) const {
+    return counts[static_cast<size_t>(kind)];
+  }
+
+  uint64_t total() const {
+    uint64_t sum = 0;
+    for (uint64_t count : counts) {
+      sum += count;
+    }
+    return sum;
+  }
+};
+
+// There is only one of these, from `get_warn_counter()`, since each thread
+// finds its slot through a single thread_local
+class ShardedWarnCounter {
+ public:
+  static ShardedWarnCounter& get() {
+    // This has to outlive every thread that has incremented it, because of the
+    // thread_local `SlotHandle`s. So it's leaked on purpose.
+    static ShardedWarnCounter* warn_counter = new ShardedWarnCounter();
+    return *warn_counter;
+  }
+
+  // Lets the stress test run without printing thousands of warnings
+  std::atomic<bool> quiet{false};
+
+  void increment(WarnKind kind) {
+    std::atomic<uint64_t>& count = thread_slot().counts[static_cast<size_t>(kind)];
+    // Only this thread ever writes to its slot, so there's no need for a
+    // read-modify-write here
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  // Counts since the last `reset()`, summed over all threads
+  WarnCounts snapshot() {
+    WarnCounts totals = raw_totals();
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (size_t kind = 0; kind < kNumWarnKinds; kind++) {
+      totals.counts[kind] -= baseline_.counts[kind];
+    }
+    return totals;
+  }
+
+  uint64_t count(WarnKind kind) {
+    return snapshot()[kind];
+  }
+
+  uint64_t count() {
+    return snapshot().total();
+  }
+
+  void reset() {
+    WarnCounts totals = raw_totals();
+    std::lock_guard<std::mutex> guard(mutex_);
+    baseline_ = totals;
+  }
+
+ private:
+  ShardedWarnCounter() = default;
+
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> counts[kNumWarnKinds] = {};
+  };
+
+  // Gives the slot back when the thread exits
+  struct SlotHandle {
+    ShardedWarnCounter* counter;
+    Slot* slot;
+    ~SlotHandle() {
+      std::lock_guard<std::mutex> guard(counter->mutex_);
+      counter->free_slots_.push_back(slot);
+    }
+  };
+
+  Slot& thread_slot() {
+    thread_local SlotHandle handle{this, acquire_slot()};
+    return *handle.slot;
+  }
+
+  Slot* acquire_slot() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!free_slots_.empty()) {
+      Slot* slot = free_slots_.back();
+      free_slots_.pop_back();
+      return slot;
+    }
+    slots_.push_back(std::make_unique<Slot>());
+    return slots_.back().get();
+  }
+
+  WarnCounts raw_totals() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    WarnCounts totals;
+    for (auto& slot : slots_) {
+      for (size_t kind = 0; kind < kNumWarnKinds; kind++) {
+        totals.counts[kind] += slot->counts[kind].load(std::memory_order_relaxed);
+      }
+    }
+    return totals;
+  }
+
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Slot>> slots_;
+  std::vector<Slot*> free_slots_;
+  WarnCounts baseline_;
+};
+
+ShardedWarnCounter &get_warn_counter() {
+  return ShardedWarnCounter::get();
+}
+
+void reset_warn_counter() {
+  get_warn_counter().reset();
+}
+
+void check_warn_counter(uint64_t expected_reads, uint64_t expected_writes) {
+  WarnCounts counts = get_warn_counter().snapshot();
+  if (expected_reads == counts[WarnKind::Read] && expected_writes == counts[WarnKind::Write]) {
+    std::cout << "yay.\n";
+  } else {
+    std::cout << "BOO.\n";
+  }
+}
+
+using TokenType = std::uintptr_t;
+template <typename T> inline TokenType mint_token_for(T *addr) {
+  return reinterpret_cast<TokenType>(addr);
+}
+static constexpr TokenType NullToken{0};
+
+inline bool token_set(TokenType t) { return t != NullToken;}
+
+struct ConcurrentCOWChecker {
+  std::atomic<TokenType> creator_;
+  std::string note_;
+  std::atomic<TokenType> first_writer_;
+  ConcurrentCOWChecker() : creator_(NullToken), note_("<info>"), first_writer_(NullToken) {}
+  explicit ConcurrentCOWChecker(TokenType createdBy) : creator_(createdBy), note_("<info>"), first_writer_(NullToken) {}
+
+  void check_on_write(TokenType writer) {
+    // `first_writer_` can only be set after `creator_` is set, so if it is
+    // set, we can skip looking at `creator_` entirely
+    TokenType first_writer = first_writer_.load(std::memory_order_acquire);
+    if (!token_set(first_writer)) {
+      if (!token_set(creator_.load(std::memory_order_acquire))) {
+        return;
+      }
+      first_writer = maybe_set_first_writer(writer);
+    }
+    maybe_warn_on_mismatch(first_writer, writer, WarnKind::Write);
+  }
+
+  void check_on_read(TokenType reader) const {
+    // The tokens are just values, nothing else is published along with them,
+    // so we don't need anything stronger than acquire here. On x86 this is an
+    // ordinary load.
+    TokenType first_writer = first_writer_.load(std::memory_order_acquire);
+    if (token_set(first_writer)) {
+      maybe_warn_on_mismatch(first_writer, reader, WarnKind::Read);
+    }
+  }
+
+  void maybe_warn_on_mismatch(TokenType first_writer, TokenType other, WarnKind kind) const {
+    if (first_writer != other) {
+      get_warn_counter().increment(kind);
+      if (!get_warn_counter().quiet.load(std::memory_order_relaxed)) {
+        std::cout << "COW BEHAVIOR WARNING: " << warn_msg(kind) << std::endl;
+      }
+    }
+  }
+
+  // First writer wins. Returns whichever token ended up as the first writer,
+  // which is `other` if this call won the race.
+  TokenType maybe_set_first_writer(TokenType other) {
+    TokenType expected = NullToken;
+    if (first_writer_.compare_exchange_strong(
+          expected, other,
+          std::memory_order_acq_rel, std::memory_order_acquire)) {
+      return other;
+    }
+    return expected;
+  }
+
+  void maybe_init(TokenType creator) {
+    TokenType expected = NullToken;
+    creator_.compare_exchange_strong(
+      expected, creator,
+      std::memory_order_acq_rel, std::memory_order_acquire);
+  }
+
+};
+
+} // namespace COWSim
+
+static int64_t next_data_ptr_value_ = 1;
+
+class DataPtr {
+ public:
+  DataPtr() : ptr_(reinterpret_cast<void*>(next_data_ptr_value_++)) {}
+
+  void* get() const {
+    return ptr_;
+  }
+
+  void* mutable_get() {
+    return ptr_;
+  }
+
+ private:
+  void* ptr_;
+};
+
+class StorageImpl {
+ public:
+   const void *data(COWSim::TokenType token) const {
+    cow_checker_.check_on_read(token);
+    return data_ptr_.get();
+  }
+
+  void *mutable_data(COWSim::TokenType token) {
+    cow_checker_.check_on_write(token);
+    return data_ptr_.mutable_get();
+  }
+
+  void maybe_enable_cow_sim(COWSim::TokenType token) {
+    cow_checker_.maybe_init(token);
+  }
+
+ private:
+   DataPtr data_ptr_;
+   COWSim::ConcurrentCOWChecker cow_checker_;
+};
+
+
+class Storage {
+ public:
+   Storage() : storage_impl_(std::make_shared<StorageImpl>()), group_number_(1) {}
+   Storage(Storage& other) : storage_impl_(other.storage_impl_), group_number_(other.group_number_) {}
+
+  const void *data() const {
+    return storage_impl_->data(reinterpret_cast<std::uintptr_t>(group_number_));
+  }
+
+  void *mutable_data() const {
+    return storage_impl_->mutable_data(reinterpret_cast<std::uintptr_t>(group_number_));
+  }
+
+  // Adds an extra layer of indirection between `Storage` and `StorageImpl` to
+  // simulate COW behavior. No-op if the layer has already been added.
+  void maybe_enable_cow_sim_() {
+    storage_impl_->maybe_enable_cow_sim(group_number_);
+  }
+
+  void increment_group_number_() {
+    group_number_++;
+  }
+
+ private:
+  std::shared_ptr<StorageImpl> storage_impl_;
+  COWSim::TokenType group_number_;
+};
+
+class TensorImpl {
+public:
+  TensorImpl() = default;
+  TensorImpl(Storage storage) : storage_(storage) {}
+  Storage& storage() {
+    return storage_;
+  }
+
+  inline const void* const_data() const {
+    return data_impl<const void>(
+      [this] { return static_cast<const char*>(storage_.data()); });
+  }
+
+  inline void* mutable_data() {
+    return data_impl<void>(
+      [this] { return static_cast<char*>(storage_.mutable_data()); });
+  }
+
+ private:
+  template <typename Void, typename Func>
+  Void* data_impl(const Func& get_data) const {
+    // Note: PyTorch does some checks in here
+    auto* data = get_data();
+    return data;
+  }
+
+  Storage storage_;
+};
+
+namespace torch {
+TensorImpl clone(TensorImpl self) { return TensorImpl(); }
+TensorImpl view(TensorImpl self) { return TensorImpl(self.storage());}
+
+enum ReshapeArgs { View, Copy };
+TensorImpl reshape(TensorImpl self, ReshapeArgs args) {
+  if (args == ReshapeArgs::View) {
+    self.storage().maybe_enable_cow_sim_();
+    TensorImpl res = view(self);
+    res.storage().increment_group_number_();
+    return res;
+  } else {
+    return clone(self);
+  }
+}
+}
+
+// for easy to read examples
+auto tensor() { return TensorImpl(); }
+using torch::view;
+using torch::reshape;
+auto mutates_input(TensorImpl& t) { return t.mutable_data(); }
+auto reads_from_input(TensorImpl& t) {return t.const_data();}
+using torch::ReshapeArgs;
+
+auto example_1() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  mutates_input(a);
+  reads_from_input(b);
+}
+
+auto example_2() {
+  auto a = tensor();
+  auto c = tensor();
+  c.storage() = a.storage();
+  auto b = reshape(a, ReshapeArgs::View);
+  mutates_input(b);
+  reads_from_input(c);
+}
+
+auto example_3() {
+    TensorImpl a;
+    TensorImpl b = view(a);
+    mutates_input(a);
+    mutates_input(b);
+    reads_from_input(a);
+    reads_from_input(b);
+}
+
+auto example_4() {
+  auto a = tensor();
+  auto b = view(a);
+  auto c = reshape(b, ReshapeArgs::View);
+  mutates_input(b);
+  reads_from_input(a);
+}
+
+auto example_5() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  auto c = view(b);
+  mutates_input(b);
+  reads_from_input(c);
+}
+
+auto example_6() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  auto c = view(b);
+  mutates_input(c);
+  reads_from_input(b);
+}
+
+auto example_7() {
+  auto a = tensor();
+  auto b = view(a);
+  auto c = reshape(b, ReshapeArgs::View);
+  mutates_input(a);
+  reads_from_input(b);
+}
+
+
+// Both views write, so the second write warns
+auto example_8() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  mutates_input(a);
+  mutates_input(b);
+  reads_from_input(b);
+}
+
+using func_t = decltype(&example_1);
+// (function, expected read warnings, expected write warnings)
+static std::tuple<func_t, uint64_t, uint64_t> test_cases[] = {
+    {&example_1, 1, 0},
+    {&example_2, 1, 0},
+    {&example_3, 0, 0},
+    {&example_4, 0, 0},
+    {&example_5, 0, 0},
+    {&example_6, 0, 0},
+    {&example_7, 0, 0},
+    {&example_8, 1, 1},
+};
+
+// The counter from main3.cpp
+struct LegacyWarnCounter {
+  uint8_t count = 0;
+  void increment() { ++count; }
+};
+
+// The counter from main4.cpp
+struct AtomicWarnCounter {
+  std::atomic<uint64_t> count{0};
+  void increment() { count.fetch_add(1, std::memory_order_relaxed); }
+};
+
+size_t num_bench_threads() {
+  size_t n = std::thread::hardware_concurrency();
+  return n < 4 ? 4 : n;
+}
+
+// Runs `func(thread_idx, iters)` on each thread and returns the average
+// ns per iteration that each thread saw
+template <typename Func>
+double run_threads(size_t num_threads, size_t iters, Func func) {
+  std::vector<std::thread> threads;
+  std::vector<double> ns(num_threads);
+  std::atomic<bool> go{false};
+  for (size_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+    threads.emplace_back([&, thread_idx] {
+      while (!go.load(std::memory_order_acquire)) {}
+      auto start = std::chrono::steady_clock::now();
+      func(thread_idx, iters);
+      auto end = std::chrono::steady_clock::now();
+      ns[thread_idx] = std::chrono::duration<double, std::nano>(end - start).count() / iters;
+    });
+  }
+  go = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  double avg = 0;
+  for (double x : ns) {
+    avg += x;
+  }
+  return avg / num_threads;
+}
+
+void bench_counters() {
+  const size_t num_threads = num_bench_threads();
+  const size_t iters = 10'000'000;
+
+  LegacyWarnCounter legacy;
+  for (size_t i = 0; i < iters; i++) {
+    legacy.increment();
+  }
+  std::cout << "legacy uint8_t counter after " << iters
+    << " increments on one thread: " << int(legacy.count) << std::endl;
+
+  AtomicWarnCounter atomic_counter;
+  double atomic_ns = run_threads(num_threads, iters, [&](size_t, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      atomic_counter.increment();
+    }
+  });
+
+  COWSim::ShardedWarnCounter& sharded = COWSim::get_warn_counter();
+  sharded.reset();
+  double sharded_ns = run_threads(num_threads, iters, [&](size_t thread_idx, size_t n) {
+    auto kind = thread_idx % 2 ? COWSim::WarnKind::Write : COWSim::WarnKind::Read;
+    for (size_t i = 0; i < n; i++) {
+      sharded.increment(kind);
+    }
+  });
+  COWSim::WarnCounts counts = sharded.snapshot();
+
+  std::cout << num_threads << " threads x " << iters << " increments:" << std::endl;
+  std::cout << "  single atomic  ns/increment: " << atomic_ns
+    << "  total: " << atomic_counter.count.load() << std::endl;
+  std::cout << "  sharded        ns/increment: " << sharded_ns
+    << "  total: " << counts.total()
+    << "  (read: " << counts[COWSim::WarnKind::Read]
+    << ", write: " << counts[COWSim::WarnKind::Write] << ")" << std::endl;
+  std::cout << "  sharded total correct-->"
+    << (counts.total() == num_threads * iters ? "yay.\n" : "BOO.\n");
+}
+
+// Millions of violating accesses from many threads, counted through the real
+// checker
+void stress_violations() {
+  const size_t num_threads = num_bench_threads();
+  const size_t iters = 1'000'000;
+
+  TensorImpl a;
+  TensorImpl b = reshape(a, ReshapeArgs::View);
+  a.mutable_data();
+
+  COWSim::reset_warn_counter();
+  COWSim::get_warn_counter().quiet = true;
+  double ns = run_threads(num_threads, iters, [&](size_t, size_t n) {
+    TensorImpl t = view(b);
+    for (size_t i = 0; i < n; i++) {
+      if (i % 4 == 0) {
+        t.mutable_data();
+      } else {
+        t.const_data();
+      }
+    }
+  });
+  COWSim::get_warn_counter().quiet = false;
+
+  std::cout << "violating accesses (" << num_threads << " threads x " << iters
+    << ", ns/access: " << ns << ")-->";
+  COWSim::check_warn_counter(num_threads * iters * 3 / 4, num_threads * iters / 4);
+}
+
+int main() {
+  auto i = 0;
+  for (auto [func, expected_reads, expected_writes] : test_cases) {
+    ++i;
+    COWSim::reset_warn_counter();
+    func();
+    std::cout << "Example " << i << "-->";
+    COWSim::check_warn_counter(expected_reads, expected_writes);
+  }
+
+  std::cout << std::endl;
+  stress_violations();
+  std::cout << std::endl;
+  bench_counters();
+}
@@ -0,0 +1,431 @@
+// Same as main3.cpp, except the `COWChecker` is only allocated when COW
+// simulation is actually enabled on a storage.
+//
+// In main3.cpp, every `StorageImpl` has a `COWChecker` member, which holds two
+// `uintptr_t` tokens and a `std::string note_`. That's 48 bytes added to every
+// `StorageImpl`, even though most storages never have COW simulation enabled.
+// And any note longer than the small string buffer would be a heap
+// allocation per storage.
+//
+// Here `StorageImpl` just has a `std::unique_ptr<COWChecker>`, which is null
+// until `maybe_enable_cow_sim` is called. The accessors only check whether the
+// pointer is null. The note is an ID into a global table of interned strings,
+// so many checkers with the same note share one copy of it, and the string
+// is only looked up when a message is built.
+//
+// The benchmark counts heap allocations while constructing a million tensors
+// with each layout.
+//
+// Build with:
+//   g++ -std=c++17 -O2 main11.cpp -o main11
+
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <iostream>
+#include <new>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Counts calls to `operator new`, so the benchmark can report allocations
+static size_t num_allocated_bytes = 0;
+static size_t num_allocations = 0;
+
+void* operator new(size_t size) {
+  num_allocated_bytes += size;
+  num_allocations++;
+  if (void* ptr = std::malloc(size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept {
+  std::free(ptr);
+}
+
+namespace COWSim {
+struct WarnCounter {
+  uint8_t count = 0;
+  void increment() { ++count; }
+  void reset() { count =0; }
+};
+
+WarnCounter &get_warn_counter() {
+  static WarnCounter warn_counter;
+  return warn_counter;
+}
+
+void reset_warn_counter() {
+  get_warn_counter().reset();
+}
+
+void check_warn_counter(uint8_t expected_count) {
+  if (expected_count == get_warn_counter().count) {
+    std::cout << "yay.\n";
+  } else {
+    std::cout << "BOO.\n";
+  }
+}
+
+using TokenType = std::uintptr_t;
+template <typename T> inline TokenType mint_token_for(T *addr) {
+  return reinterpret_cast<TokenType>(addr);
+}
+static constexpr TokenType NullToken{0};
+static const char cow_read_msg[] = "WRITE THEN READ";
+static const char cow_write_msg[] = "WRITE THEN WRITE";
+
+inline bool token_set(TokenType t) { return t != NullToken;}
+
+using NoteId = uint32_t;
+
+// Global table of note strings. Each distinct string is stored once, and
+// checkers just hold its ID.
+class NoteTable {
+ public:
+  static NoteTable& get() {
+    static NoteTable table;
+    return table;
+  }
+
+  NoteId intern(std::string_view note) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = ids_.find(note);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+    NoteId id = notes_.size();
+    // `std::deque` would also work. The strings are heap allocated so that the
+    // `string_view` keys stay valid when `notes_` grows.
+    notes_.push_back(std::make_unique<std::string>(note));
+    ids_.emplace(*notes_.back(), id);
+    return id;
+  }
+
+  std::string_view lookup(NoteId id) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return *notes_[id];
+  }
+
+ private:
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<std::string>> notes_;
+  std::unordered_map<std::string_view, NoteId> ids_;
+};
+
+inline NoteId default_note() {
+  static NoteId id = NoteTable::get().intern("<info>");
+  return id;
+}
+
+// The `COWChecker` from main3.cpp, used for comparison
+struct LegacyCOWChecker {
+  TokenType creator_;
+  std::string note_;
+  TokenType first_writer_;
+  LegacyCOWChecker() : creator_(NullToken), note_("<info>"), first_writer_(NullToken) {}
+};
+
+struct COWChecker {
+  TokenType creator_;
+  TokenType first_writer_;
+  NoteId note_;
+  explicit COWChecker(TokenType createdBy, NoteId note = default_note())
+    : creator_(createdBy), first_writer_(NullToken), note_(note) {}
+
+  void check_on_write(TokenType writer) {
+    maybe_warn_on_mismatch(writer, cow_write_msg);
+    maybe_set_first_writer(writer);
+  }
+  void check_on_read(TokenType reader) const {
+    maybe_warn_on_mismatch(reader, cow_read_msg);
+  }
+
+  // A checker only exists once COW simulation is enabled, so `creator_` is
+  // always set and doesn't need to be checked here
+  void maybe_warn_on_mismatch(TokenType other, const char *msg) const {
+    if (token_set(first_writer_))
+      if (first_writer_ != other) {
+        get_warn_counter().increment();
+        std::cout << "COW BEHAVIOR WARNING: " << msg
+          << " " << NoteTable::get().lookup(note_) << std::endl;
+      }
+  }
+
+  void maybe_set_first_writer(TokenType other) {
+    if (!token_set(first_writer_)) {
+      first_writer_ = other;
+    }
+  }
+
+};
+
+} // namespace COWSim
+
+static int64_t next_data_ptr_value_ = 1;
+
+class DataPtr {
+ public:
+  DataPtr() : ptr_(reinterpret_cast<void*>(next_data_ptr_value_++)) {}
+
+  void* get() const {
+    return ptr_;
+  }
+
+  void* mutable_get() {
+    return ptr_;
+  }
+
+ private:
+  void* ptr_;
+};
+
+// Same layout as the `StorageImpl` in main3.cpp. Only used to compare sizes
+// and allocation counts, so it doesn't need any COW logic.
+class LegacyStorageImpl {
+ public:
+  const void *data(COWSim::TokenType) const {
+    return data_ptr_.get();
+  }
+
+  void maybe_enable_cow_sim(COWSim::TokenType token) {
+    cow_checker_.creator_ = token;
+  }
+
+ private:
+  DataPtr data_ptr_;
+  COWSim::LegacyCOWChecker cow_checker_;
+};
+
+class StorageImpl {
+ public:
+  const void *data(COWSim::TokenType token) const {
+    if (cow_checker_) {
+      cow_checker_->check_on_read(token);
+    }
+    return data_ptr_.get();
+  }
+
+  void *mutable_data(COWSim::TokenType token) {
+    if (cow_checker_) {
+      cow_checker_->check_on_write(token);
+    }
+    return data_ptr_.mutable_get();
+  }
+
+  void maybe_enable_cow_sim(COWSim::TokenType token) {
+    if (!cow_checker_) {
+      cow_checker_ = std::make_unique<COWSim::COWChecker>(token);
+    }
+  }
+
+ private:
+  DataPtr data_ptr_;
+  std::unique_ptr<COWSim::COWChecker> cow_checker_;
+};
+
+template <typename StorageImplT>
+class Storage {
+ public:
+  Storage() : storage_impl_(std::make_shared<StorageImplT>()), group_number_(1) {}
+  Storage(Storage& other) : storage_impl_(other.storage_impl_), group_number_(other.group_number_) {}
+
+  const void *data() const {
+    return storage_impl_->data(reinterpret_cast<std::uintptr_t>(group_number_));
+  }
+
+  void *mutable_data() const {
+    return storage_impl_->mutable_data(reinterpret_cast<std::uintptr_t>(group_number_));
+  }
+
+  void maybe_enable_cow_sim_() {
+    storage_impl_->maybe_enable_cow_sim(group_number_);
+  }
+
+  void increment_group_number_() {
+    group_number_++;
+  }
+
+ private:
+  std::shared_ptr<StorageImplT> storage_impl_;
+  COWSim::TokenType group_number_;
+};
+
+template <typename StorageImplT = StorageImpl>
+class TensorImpl {
+public:
+  TensorImpl() = default;
+  TensorImpl(Storage<StorageImplT> storage) : storage_(storage) {}
+  Storage<StorageImplT>& storage() {
+    return storage_;
+  }
+
+  inline const void* const_data() const {
+    return data_impl<const void>(
+      [this] { return static_cast<const char*>(storage_.data()); });
+  }
+
+  inline void* mutable_data() {
+    return data_impl<void>(
+      [this] { return static_cast<char*>(storage_.mutable_data()); });
+  }
+
+ private:
+  template <typename Void, typename Func>
+  Void* data_impl(const Func& get_data) const {
+    // Note: PyTorch does some checks in here
+    auto* data = get_data();
+    return data;
+  }
+
+  Storage<StorageImplT> storage_;
+};
+
+namespace torch {
+TensorImpl<> clone(TensorImpl<> self) { return TensorImpl<>(); }
+TensorImpl<> view(TensorImpl<> self) { return TensorImpl<>(self.storage());}
+
+enum ReshapeArgs { View, Copy };
+TensorImpl<> reshape(TensorImpl<> self, ReshapeArgs args) {
+  if (args == ReshapeArgs::View) {
+    self.storage().maybe_enable_cow_sim_();
+    TensorImpl<> res = view(self);
+    res.storage().increment_group_number_();
+    return res;
+  } else {
+    return clone(self);
+  }
+}
+}
+
+// for easy to read examples
+auto tensor() { return TensorImpl<>(); }
+using torch::view;
+using torch::reshape;
+auto mutates_input(TensorImpl<>& t) { return t.mutable_data(); }
+auto reads_from_input(TensorImpl<>& t) {return t.const_data();}
+using torch::ReshapeArgs;
+
+auto example_1() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  mutates_input(a);
+  reads_from_input(b);
+}
+
+auto example_2() {
+  auto a = tensor();
+  auto c = tensor();
+  c.storage() = a.storage();
+  auto b = reshape(a, ReshapeArgs::View);
+  mutates_input(b);
+  reads_from_input(c);
+}
+
+auto example_3() {
+    TensorImpl<> a;
+    TensorImpl<> b = view(a);
+    mutates_input(a);
+    mutates_input(b);
+    reads_from_input(a);
+    reads_from_input(b);
+}
+
+auto example_4() {
+  auto a = tensor();
+  auto b = view(a);
+  auto c = reshape(b, ReshapeArgs::View);
+  mutates_input(b);
+  reads_from_input(a);
+}
+
+auto example_5() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  auto c = view(b);
+  mutates_input(b);
+  reads_from_input(c);
+}
+
+auto example_6() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  auto c = view(b);
+  mutates_input(c);
+  reads_from_input(b);
+}
+
+auto example_7() {
+  auto a = tensor();
+  auto b = view(a);
+  auto c = reshape(b, ReshapeArgs::View);
+  mutates_input(a);
+  reads_from_input(b);
+}
+
+using func_t = decltype(&example_1);
+static std::pair<func_t, uint8_t> test_cases[] = {
+    {&example_1, 1},
+    {&example_2, 1},
+    {&example_3, 0},
+    {&example_4, 0},
+    {&example_5, 0},
+    {&example_6, 0},
+    {&example_7, 0},
+};
+
+// Constructs a million tensors, and enables COW simulation on
+// `cow_fraction_pct` percent of them
+template <typename StorageImplT>
+void bench_layout(const char* name, size_t cow_fraction_pct) {
+  const size_t num_tensors = 1'000'000;
+
+  size_t allocs_before = num_allocations;
+  size_t bytes_before = num_allocated_bytes;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<TensorImpl<StorageImplT>> tensors(num_tensors);
+  for (size_t i = 0; i < num_tensors; i++) {
+    if (i % 100 < cow_fraction_pct) {
+      tensors[i].storage().maybe_enable_cow_sim_();
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  std::cout << "  " << name
+    << "  COW enabled on " << cow_fraction_pct << "%"
+    << "  allocations: " << num_allocations - allocs_before
+    << "  heap bytes: " << num_allocated_bytes - bytes_before
+    << "  ms: " << std::chrono::duration<double, std::milli>(end - start).count()
+    << std::endl;
+}
+
+int main() {
+  auto i = 0;
+  for (auto [func, expected_warns] : test_cases) {
+    ++i;
+    COWSim::get_warn_counter().reset();
+    func();
+    std::cout << "Example " << i << "-->";
+    COWSim::check_warn_counter(expected_warns);
+  }
+
+  std::cout << std::endl;
+  std::cout << "sizeof(LegacyStorageImpl): " << sizeof(LegacyStorageImpl) << std::endl;
+  std::cout << "sizeof(StorageImpl):       " << sizeof(StorageImpl) << std::endl;
+  std::cout << "sizeof(COWChecker):        " << sizeof(COWSim::COWChecker) << std::endl;
+  std::cout << std::endl;
+
+  std::cout << "constructing 1M tensors:" << std::endl;
+  bench_layout<LegacyStorageImpl>("legacy ", 0);
+  bench_layout<StorageImpl>("compact", 0);
+  bench_layout<LegacyStorageImpl>("legacy ", 10);
+  bench_layout<StorageImpl>("compact", 10);
+}
@@ -0,0 +1,682 @@
+// Same as main3.cpp, except the view group numbers are globally unique and
+// their lineage is recorded.
+//
+// In main3.cpp, a reshape view gets the group number of the tensor it was made
+// from plus one. So two reshape views of the same tensor end up in the same
+// group, and the checker can't tell them apart (see `example_8` below). And
+// nothing records which group a group was made from.
+//
+// Here, new group numbers come from `GroupIdAllocator`. Each thread takes a
+// block of IDs from a global atomic counter at a time, and hands them out
+// without any synchronization until the block runs out. So the global counter
+// is only touched once every `kBlockSize` IDs.
+//
+// `LineageTable` records the parent group and the root group of every group.
+// It's a two level array indexed by group ID, where the second level chunks
+// are allocated on demand with a compare-exchange, so recording and looking up
+// a group is lock-free and O(1). Because every group knows its root, asking
+// whether two storages come from the same original tensor is O(1) too. Asking
+// whether two storages are in the same view group is just comparing their
+// group IDs.
+//
+// Each group in the table is refcounted. Every `Storage` in the group holds a
+// reference, and so does every child group, so a group's parent and root stay
+// in the table as long as the group does. A `COWChecker` holds a reference to
+// its first writer's group too, so that group's ID isn't reused while the
+// checker still compares against it. When the last reference goes away,
+// the group's entry is cleared and its ID goes back to the allocator. Freed
+// IDs go to a per-thread free list first, and whole blocks of them overflow to
+// a global list that other threads take from before they take new IDs from
+// the counter. So the table only grows with the number of groups alive at
+// once, not with the number of groups ever made.
+//
+// Build with:
+//   g++ -std=c++17 -O2 -pthread main12.cpp -o main12
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace COWSim {
+struct WarnCounter {
+  uint8_t count = 0;
+  void increment() { ++count; }
+  void reset() { count =0; }
+};
+
+WarnCounter &get_warn_counter() {
+  static WarnCounter warn_counter;
+  return warn_counter;
+}
+
+void reset_warn_counter() {
+  get_warn_counter().reset();
+}
+
+void check_warn_counter(uint8_t expected_count) {
+  if (expected_count == get_warn_counter().count) {
+    std::cout << "yay.\n";
+  } else {
+    std::cout << "BOO.\n";
+  }
+}
+
+using TokenType = std::uintptr_t;
+static constexpr TokenType NullToken{0};
+static const char cow_read_msg[] = "WRITE THEN READ";
+static const char cow_write_msg[] = "WRITE THEN WRITE";
+
+inline bool token_set(TokenType t) { return t != NullToken;}
+
+class GroupIdAllocator {
+ public:
+  static constexpr TokenType kBlockSize = 1024;
+
+  static TokenType allocate() {
+    ThreadCache& cache = thread_cache();
+    if (cache.free.empty() && cache.next == cache.end && !take_free_block(cache.free)) {
+      cache.next = next_block_.fetch_add(kBlockSize, std::memory_order_relaxed);
+      cache.end = cache.next + kBlockSize;
+    }
+    if (!cache.free.empty()) {
+      TokenType id = cache.free.back();
+      cache.free.pop_back();
+      return id;
+    }
+    return cache.next++;
+  }
+
+  // `id` must not be used by anything anymore
+  static void release(TokenType id) {
+    ThreadCache& cache = thread_cache();
+    cache.free.push_back(id);
+    if (cache.free.size() >= 2 * kBlockSize) {
+      std::vector<TokenType> block(cache.free.end() - kBlockSize, cache.free.end());
+      cache.free.resize(cache.free.size() - kBlockSize);
+      give_free_block(std::move(block));
+    }
+  }
+
+ private:
+  struct ThreadCache {
+    // IDs [next, end) have never been handed out
+    TokenType next = NullToken;
+    TokenType end = NullToken;
+    std::vector<TokenType> free;
+
+    // So the IDs of a thread that exits aren't lost
+    ~ThreadCache() {
+      for (; next != end; next++) {
+        free.push_back(next);
+      }
+      if (!free.empty()) {
+        give_free_block(std::move(free));
+      }
+    }
+  };
+
+  static ThreadCache& thread_cache() {
+    thread_local ThreadCache cache;
+    return cache;
+  }
+
+  static bool take_free_block(std::vector<TokenType>& free) {
+    std::lock_guard<std::mutex> guard(free_blocks_mutex());
+    auto& blocks = free_blocks();
+    if (blocks.empty()) {
+      return false;
+    }
+    free = std::move(blocks.back());
+    blocks.pop_back();
+    return true;
+  }
+
+  static void give_free_block(std::vector<TokenType> block) {
+    std::lock_guard<std::mutex> guard(free_blocks_mutex());
+    free_blocks().push_back(std::move(block));
+  }
+
+  static std::mutex& free_blocks_mutex() {
+    static auto* mutex = new std::mutex();
+    return *mutex;
+  }
+
+  static std::vector<std::vector<TokenType>>& free_blocks() {
+    static auto* blocks = new std::vector<std::vector<TokenType>>();
+    return *blocks;
+  }
+
+  // Starts at 1 so that `NullToken` is never handed out
+  static inline std::atomic<TokenType> next_block_{1};
+};
+
+class LineageTable {
+ public:
+  static LineageTable& get() {
+    static LineageTable table;
+    return table;
+  }
+
+  // Each group is recorded exactly once, right after its ID is allocated,
+  // with one reference, which belongs to the caller. The caller must hold a
+  // reference to `parent`.
+  void record(TokenType group, TokenType parent) {
+    TokenType root = group;
+    if (token_set(parent)) {
+      Entry& parent_entry = entry(parent);
+      parent_entry.refcount.fetch_add(1, std::memory_order_relaxed);
+      root = parent_entry.root.load(std::memory_order_relaxed);
+    }
+    Entry& e = entry(group);
+    e.refcount.store(1, std::memory_order_relaxed);
+    e.parent.store(parent, std::memory_order_relaxed);
+    e.root.store(root, std::memory_order_release);
+  }
+
+  // Only call this while holding a reference to `group`
+  void incref(TokenType group) {
+    entry(group).refcount.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Drops a reference to `group`. If it was the last one, clears the group's
+  // entry, gives its ID back to `GroupIdAllocator`, and drops its reference
+  // to its parent.
+  void decref(TokenType group) {
+    while (token_set(group)) {
+      Entry& e = entry(group);
+      if (e.refcount.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+      }
+      TokenType parent = e.parent.load(std::memory_order_relaxed);
+      e.parent.store(NullToken, std::memory_order_relaxed);
+      e.root.store(NullToken, std::memory_order_relaxed);
+      GroupIdAllocator::release(group);
+      group = parent;
+    }
+  }
+
+  TokenType parent(TokenType group) {
+    return entry(group).parent.load(std::memory_order_relaxed);
+  }
+
+  TokenType root(TokenType group) {
+    return entry(group).root.load(std::memory_order_acquire);
+  }
+
+  size_t num_chunks() const {
+    size_t count = 0;
+    for (auto& chunk : chunks_) {
+      count += chunk.load(std::memory_order_relaxed) != nullptr;
+    }
+    return count;
+  }
+
+  static constexpr size_t kChunkBits = 16;
+  static constexpr size_t kChunkSize = size_t(1) << kChunkBits;
+
+ private:
+  static constexpr size_t kMaxChunks = size_t(1) << 16;
+
+  struct Entry {
+    std::atomic<TokenType> parent{NullToken};
+    std::atomic<TokenType> root{NullToken};
+    std::atomic<size_t> refcount{0};
+  };
+
+  using Chunk = std::array<Entry, kChunkSize>;
+
+  LineageTable() = default;
+
+  Entry& entry(TokenType group) {
+    size_t chunk_idx = group >> kChunkBits;
+    if (chunk_idx >= kMaxChunks) {
+      // IDs are reused, so this needs 2^32 groups alive at once, which is far
+      // more `Storage`s than fit in memory
+      throw std::length_error("LineageTable is full");
+    }
+    Chunk* chunk = chunks_[chunk_idx].load(std::memory_order_acquire);
+    if (!chunk) {
+      // Racing threads may both allocate a chunk. Only one wins, and the
+      // other frees its own.
+      Chunk* new_chunk = new Chunk();
+      if (chunks_[chunk_idx].compare_exchange_strong(
+            chunk, new_chunk,
+            std::memory_order_acq_rel, std::memory_order_acquire)) {
+        chunk = new_chunk;
+      } else {
+        delete new_chunk;
+      }
+    }
+    return (*chunk)[group & (kChunkSize - 1)];
+  }
+
+  // Chunks are never freed, but there are only as many as the largest number
+  // of group IDs that were in use at once needs
+  std::array<std::atomic<Chunk*>, kMaxChunks> chunks_{};
+};
+
+inline TokenType new_group(TokenType parent = NullToken) {
+  TokenType group = GroupIdAllocator::allocate();
+  LineageTable::get().record(group, parent);
+  return group;
+}
+
+struct COWChecker {
+  TokenType creator_;
+  std::string note_;
+  TokenType first_writer_;
+  COWChecker() : creator_(NullToken), note_("<info>"), first_writer_(NullToken) {}
+  explicit COWChecker(TokenType createdBy) : creator_(createdBy), note_("<info>"), first_writer_(NullToken) {}
+
+  // Holds a reference to the first writer's group, so its ID can't be reused
+  // by another group that would then pass as the first writer
+  ~COWChecker() {
+    if (token_set(first_writer_)) {
+      LineageTable::get().decref(first_writer_);
+    }
+  }
+
+  COWChecker(const COWChecker&) = delete;
+  COWChecker& operator=(const COWChecker&) = delete;
+
+  void check_on_write(TokenType writer) {
+    maybe_warn_on_mismatch(writer, cow_write_msg);
+    maybe_set_first_writer(writer);
+  }
+  void check_on_read(TokenType reader) const {
+    maybe_warn_on_mismatch(reader, cow_read_msg);
+  }
+
+  void maybe_warn_on_mismatch(TokenType other, const char *msg) const {
+    if (token_set(creator_)) {
+      if (token_set(first_writer_))
+        if (first_writer_ != other) {
+          get_warn_counter().increment();
+          std::cout << "COW BEHAVIOR WARNING: " << msg << std::endl;
+        }
+    }
+  }
+
+  void maybe_set_first_writer(TokenType other) {
+    if (token_set(creator_)) {
+      if (!token_set(first_writer_)) {
+        LineageTable::get().incref(other);
+        first_writer_ = other;
+      }
+    }
+  }
+
+  void maybe_init(TokenType creator) {
+    if(!token_set(creator_)) creator_ = creator;
+  }
+
+};
+
+} // namespace COWSim
+
+static int64_t next_data_ptr_value_ = 1;
+
+class DataPtr {
+ public:
+  DataPtr() : ptr_(reinterpret_cast<void*>(next_data_ptr_value_++)) {}
+
+  void* get() const {
+    return ptr_;
+  }
+
+  void* mutable_get() {
+    return ptr_;
+  }
+
+ private:
+  void* ptr_;
+};
+
+class StorageImpl {
+ public:
+   const void *data(COWSim::TokenType token) const {
+    cow_checker_.check_on_read(token);
+    return data_ptr_.get();
+  }
+
+  void *mutable_data(COWSim::TokenType token) {
+    cow_checker_.check_on_write(token);
+    return data_ptr_.mutable_get();
+  }
+
+  void maybe_enable_cow_sim(COWSim::TokenType token) {
+    cow_checker_.maybe_init(token);
+  }
+
+ private:
+   DataPtr data_ptr_;
+   COWSim::COWChecker cow_checker_;
+};
+
+
+class Storage {
+ public:
+  Storage() : storage_impl_(std::make_shared<StorageImpl>()), group_number_(COWSim::new_group()) {}
+
+  Storage(const Storage& other) : storage_impl_(other.storage_impl_), group_number_(other.group_number_) {
+    COWSim::LineageTable::get().incref(group_number_);
+  }
+
+  Storage& operator=(const Storage& other) {
+    if (this != &other) {
+      COWSim::LineageTable::get().incref(other.group_number_);
+      COWSim::LineageTable::get().decref(group_number_);
+      storage_impl_ = other.storage_impl_;
+      group_number_ = other.group_number_;
+    }
+    return *this;
+  }
+
+  ~Storage() {
+    COWSim::LineageTable::get().decref(group_number_);
+  }
+
+  const void *data() const {
+    return storage_impl_->data(group_number_);
+  }
+
+  void *mutable_data() const {
+    return storage_impl_->mutable_data(group_number_);
+  }
+
+  void maybe_enable_cow_sim_() {
+    storage_impl_->maybe_enable_cow_sim(group_number_);
+  }
+
+  // Moves this `Storage` into a new view group that is a child of its current
+  // one. Replaces main3.cpp's `increment_group_number_()`.
+  void start_new_view_group_() {
+    COWSim::TokenType old_group = group_number_;
+    group_number_ = COWSim::new_group(old_group);
+    COWSim::LineageTable::get().decref(old_group);
+  }
+
+  COWSim::TokenType group_number() const {
+    return group_number_;
+  }
+
+  bool same_view_group(const Storage& other) const {
+    return group_number_ == other.group_number_;
+  }
+
+  // Whether both storages come from the same original tensor, through any
+  // chain of views and reshape views
+  bool same_lineage(const Storage& other) const {
+    auto& table = COWSim::LineageTable::get();
+    return table.root(group_number_) == table.root(other.group_number_);
+  }
+
+ private:
+  std::shared_ptr<StorageImpl> storage_impl_;
+  COWSim::TokenType group_number_;
+};
+
+class TensorImpl {
+public:
+  TensorImpl() = default;
+  TensorImpl(Storage storage) : storage_(storage) {}
+  Storage& storage() {
+    return storage_;
+  }
+
+  inline const void* const_data() const {
+    return data_impl<const void>(
+      [this] { return static_cast<const char*>(storage_.data()); });
+  }
+
+  inline void* mutable_data() {
+    return data_impl<void>(
+      [this] { return static_cast<char*>(storage_.mutable_data()); });
+  }
+
+ private:
+  template <typename Void, typename Func>
+  Void* data_impl(const Func& get_data) const {
+    // Note: PyTorch does some checks in here
+    auto* data = get_data();
+    return data;
+  }
+
+  Storage storage_;
+};
+
+namespace torch {
+TensorImpl clone(TensorImpl self) { return TensorImpl(); }
+TensorImpl view(TensorImpl self) { return TensorImpl(self.storage());}
+
+enum ReshapeArgs { View, Copy };
+TensorImpl reshape(TensorImpl self, ReshapeArgs args) {
+  if (args == ReshapeArgs::View) {
+    self.storage().maybe_enable_cow_sim_();
+    TensorImpl res = view(self);
+    res.storage().start_new_view_group_();
+    return res;
+  } else {
+    return clone(self);
+  }
+}
+}
+
+// for easy to read examples
+auto tensor() { return TensorImpl(); }
+using torch::view;
+using torch::reshape;
+auto mutates_input(TensorImpl& t) { return t.mutable_data(); }
+auto reads_from_input(TensorImpl& t) {return t.const_data();}
+using torch::ReshapeArgs;
+
+auto example_1() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  mutates_input(a);
+  reads_from_input(b);
+}
+
+auto example_2() {
+  auto a = tensor();
+  auto c = tensor();
+  c.storage() = a.storage();
+  auto b = reshape(a, ReshapeArgs::View);
+  mutates_input(b);
+  reads_from_input(c);
+}
+
+auto example_3() {
+    TensorImpl a;
+    TensorImpl b = view(a);
+    mutates_input(a);
+    mutates_input(b);
+    reads_from_input(a);
+    reads_from_input(b);
+}
+
+auto example_4() {
+  auto a = tensor();
+  auto b = view(a);
+  auto c = reshape(b, ReshapeArgs::View);
+  mutates_input(b);
+  reads_from_input(a);
+}
+
+auto example_5() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  auto c = view(b);
+  mutates_input(b);
+  reads_from_input(c);
+}
+
+auto example_6() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  auto c = view(b);
+  mutates_input(c);
+  reads_from_input(b);
+}
+
+auto example_7() {
+  auto a = tensor();
+  auto b = view(a);
+  auto c = reshape(b, ReshapeArgs::View);
+  mutates_input(a);
+  reads_from_input(b);
+}
+
+// Two reshape views of the same tensor. In main3.cpp, both get group number 2,
+// so this doesn't warn.
+auto example_8() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  auto c = reshape(a, ReshapeArgs::View);
+  mutates_input(b);
+  reads_from_input(c);
+}
+
+// The first writer's view group goes away before another reshape view is
+// made. The new group must not get the first writer's ID, or it would pass as
+// the first writer and neither access would warn.
+auto example_9() {
+  auto a = tensor();
+  {
+    auto b = reshape(a, ReshapeArgs::View);
+    mutates_input(b);
+  }
+  auto c = reshape(a, ReshapeArgs::View);
+  mutates_input(c);
+  reads_from_input(c);
+}
+
+using func_t = decltype(&example_1);
+static std::pair<func_t, uint8_t> test_cases[] = {
+    {&example_1, 1},
+    {&example_2, 1},
+    {&example_3, 0},
+    {&example_4, 0},
+    {&example_5, 0},
+    {&example_6, 0},
+    {&example_7, 0},
+    {&example_8, 1},
+    {&example_9, 2},
+};
+
+void check(bool cond, const char* msg) {
+  std::cout << (cond ? "yay. " : "BOO. ") << msg << std::endl;
+}
+
+void lineage_examples() {
+  TensorImpl a;
+  TensorImpl b = view(a);
+  TensorImpl c = reshape(a, ReshapeArgs::View);
+  TensorImpl d = reshape(c, ReshapeArgs::View);
+  TensorImpl x;
+
+  auto& table = COWSim::LineageTable::get();
+  check(a.storage().same_view_group(b.storage()), "view is in the same group");
+  check(!a.storage().same_view_group(c.storage()), "reshape view is in a new group");
+  check(table.parent(d.storage().group_number()) == c.storage().group_number(), "parent is recorded");
+  check(a.storage().same_lineage(d.storage()), "reshape of reshape has the same root");
+  check(!a.storage().same_lineage(x.storage()), "unrelated tensor has a different root");
+
+  COWSim::TokenType released;
+  {
+    TensorImpl e = reshape(a, ReshapeArgs::View);
+    released = e.storage().group_number();
+  }
+  TensorImpl f = reshape(x, ReshapeArgs::View);
+  check(f.storage().group_number() == released &&
+        table.parent(released) == x.storage().group_number() &&
+        f.storage().same_lineage(x.storage()) && !f.storage().same_lineage(a.storage()),
+    "released group ID is reused with its new lineage");
+}
+
+// Every thread makes reshape views as fast as it can, keeping the last
+// `kWindow` of them alive, so group IDs are released and reused all the time.
+// The IDs of the views that are still alive at the end are checked for
+// uniqueness, and the lineage table must not have grown with the total number
+// of views.
+void bench_group_allocation() {
+  const size_t num_threads = std::max(4u, std::thread::hardware_concurrency());
+  const size_t views_per_thread = 1'000'000;
+  const size_t kWindow = 1024;
+
+  auto& table = COWSim::LineageTable::get();
+  // Made up front, since `DataPtr`'s counter isn't thread safe
+  std::vector<TensorImpl> bases(num_threads);
+  std::vector<std::vector<Storage>> windows;
+  for (size_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+    windows.emplace_back(kWindow, bases[thread_idx].storage());
+  }
+  std::vector<std::thread> threads;
+  std::atomic<bool> go{false};
+
+  for (size_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+    threads.emplace_back([&, thread_idx] {
+      auto& window = windows[thread_idx];
+      TensorImpl& base = bases[thread_idx];
+      while (!go.load(std::memory_order_acquire)) {}
+      for (size_t i = 0; i < views_per_thread; i++) {
+        Storage storage(base.storage());
+        storage.start_new_view_group_();
+        window[i % kWindow] = storage;
+      }
+    });
+  }
+  auto start = std::chrono::steady_clock::now();
+  go = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(end - start).count();
+
+  std::vector<COWSim::TokenType> live;
+  for (auto& window : windows) {
+    for (auto& storage : window) {
+      live.push_back(storage.group_number());
+    }
+  }
+  std::sort(live.begin(), live.end());
+  bool unique = std::adjacent_find(live.begin(), live.end()) == live.end();
+
+  // Every thread can hold up to 3 blocks of IDs that aren't in use
+  size_t max_ids = num_threads * (kWindow + 1 + 3 * COWSim::GroupIdAllocator::kBlockSize);
+  size_t max_chunks = max_ids / COWSim::LineageTable::kChunkSize + 1;
+  size_t chunks = table.num_chunks();
+  size_t chunks_without_reuse = num_threads * views_per_thread / COWSim::LineageTable::kChunkSize + 1;
+
+  std::cout << num_threads << " threads x " << views_per_thread << " reshape views: "
+    << num_threads * views_per_thread / seconds / 1e6 << " M views/sec" << std::endl;
+  std::cout << "lineage table chunks: " << chunks
+    << " (" << chunks_without_reuse << " without reusing IDs)" << std::endl;
+  check(unique, "live group IDs are unique");
+  check(chunks <= max_chunks, "lineage table is bounded by the number of live groups");
+}
+
+int main() {
+  auto i = 0;
+  for (auto [func, expected_warns] : test_cases) {
+    ++i;
+    COWSim::get_warn_counter().reset();
+    func();
+    std::cout << "Example " << i << "-->";
+    COWSim::check_warn_counter(expected_warns);
+  }
+
+  std::cout << std::endl;
+  lineage_examples();
+  std::cout << std::endl;
+  bench_group_allocation();
+}
@@ -0,0 +1,612 @@
+// A data driven version of the examples in main3.cpp.
+//
+// In main3.cpp, the examples are hard coded lambdas in the `test_cases` array,
+// and each one just prints yay or BOO. Here, examples are sequences of ops
+// that are read from a text file (see scenarios.txt for the format) and
+// replayed against `TensorImpl`/`Storage`.
+//
+// On top of that, a fuzzer generates lots of random op sequences, replays each
+// one against both the real classes and a much simpler reference model of
+// what the COW simulation is supposed to do, and checks that both produce the
+// same number of warnings. Any sequence where they disagree is printed in the
+// scenario file format, so it can be pasted into scenarios.txt.
+//
+// Both the replay and the fuzzer report throughput in ops/sec, with the COW
+// simulation turned on and off, so the overhead of the checker can be measured
+// at the same time as its correctness. The fuzzer generates and replays
+// scenarios in fixed size batches, so it can run millions of them in constant
+// memory, and only the replays are timed.
+//
+// The `Storage` here uses a unique group number for every reshape view, since
+// the fuzzer quickly finds the group number collision in main3.cpp (two
+// reshape views of the same tensor getting the same number). main12.cpp has a
+// version of that which scales to many threads.
+//
+// Build and run with:
+//   g++ -std=c++17 -O2 main13.cpp -o main13
+//   ./main13 [scenario_file] [num_fuzz_sequences]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace COWSim {
+struct WarnCounter {
+  uint64_t count = 0;
+  // The fuzzer produces millions of warnings, so it turns off printing
+  bool quiet = false;
+  void increment() { ++count; }
+  void reset() { count =0; }
+};
+
+WarnCounter &get_warn_counter() {
+  static WarnCounter warn_counter;
+  return warn_counter;
+}
+
+void reset_warn_counter() {
+  get_warn_counter().reset();
+}
+
+// Lets the benchmark measure the same ops without any COW simulation
+static bool cow_sim_enabled = true;
+
+using TokenType = std::uintptr_t;
+static constexpr TokenType NullToken{0};
+static const char cow_read_msg[] = "WRITE THEN READ";
+static const char cow_write_msg[] = "WRITE THEN WRITE";
+
+inline bool token_set(TokenType t) { return t != NullToken;}
+
+struct COWChecker {
+  TokenType creator_;
+  std::string note_;
+  TokenType first_writer_;
+  COWChecker() : creator_(NullToken), note_("<info>"), first_writer_(NullToken) {}
+  explicit COWChecker(TokenType createdBy) : creator_(createdBy), note_("<info>"), first_writer_(NullToken) {}
+
+  void check_on_write(TokenType writer) {
+    maybe_warn_on_mismatch(writer, cow_write_msg);
+    maybe_set_first_writer(writer);
+  }
+  void check_on_read(TokenType reader) const {
+    maybe_warn_on_mismatch(reader, cow_read_msg);
+  }
+
+  void maybe_warn_on_mismatch(TokenType other, const char *msg) const {
+    if (token_set(creator_)) {
+      if (token_set(first_writer_))
+        if (first_writer_ != other) {
+          get_warn_counter().increment();
+          if (!get_warn_counter().quiet) {
+            std::cout << "COW BEHAVIOR WARNING: " << msg << std::endl;
+          }
+        }
+    }
+  }
+
+  void maybe_set_first_writer(TokenType other) {
+    if (token_set(creator_)) {
+      if (!token_set(first_writer_)) {
+        first_writer_ = other;
+      }
+    }
+  }
+
+  void maybe_init(TokenType creator) {
+    if(!token_set(creator_)) creator_ = creator;
+  }
+
+};
+
+} // namespace COWSim
+
+static int64_t next_data_ptr_value_ = 1;
+
+class DataPtr {
+ public:
+  DataPtr() : ptr_(reinterpret_cast<void*>(next_data_ptr_value_++)) {}
+
+  void* get() const {
+    return ptr_;
+  }
+
+  void* mutable_get() {
+    return ptr_;
+  }
+
+ private:
+  void* ptr_;
+};
+
+class StorageImpl {
+ public:
+   const void *data(COWSim::TokenType token) const {
+    cow_checker_.check_on_read(token);
+    return data_ptr_.get();
+  }
+
+  void *mutable_data(COWSim::TokenType token) {
+    cow_checker_.check_on_write(token);
+    return data_ptr_.mutable_get();
+  }
+
+  void maybe_enable_cow_sim(COWSim::TokenType token) {
+    cow_checker_.maybe_init(token);
+  }
+
+ private:
+   DataPtr data_ptr_;
+   COWSim::COWChecker cow_checker_;
+};
+
+static COWSim::TokenType next_group_number_ = 1;
+
+class Storage {
+ public:
+  Storage() : storage_impl_(std::make_shared<StorageImpl>()), group_number_(next_group_number_++) {}
+  Storage(const Storage& other) : storage_impl_(other.storage_impl_), group_number_(other.group_number_) {}
+
+  const void *data() const {
+    return storage_impl_->data(group_number_);
+  }
+
+  void *mutable_data() const {
+    return storage_impl_->mutable_data(group_number_);
+  }
+
+  void maybe_enable_cow_sim_() {
+    storage_impl_->maybe_enable_cow_sim(group_number_);
+  }
+
+  void start_new_view_group_() {
+    group_number_ = next_group_number_++;
+  }
+
+ private:
+  std::shared_ptr<StorageImpl> storage_impl_;
+  COWSim::TokenType group_number_;
+};
+
+class TensorImpl {
+public:
+  TensorImpl() = default;
+  TensorImpl(Storage storage) : storage_(storage) {}
+  Storage& storage() {
+    return storage_;
+  }
+
+  inline const void* const_data() const {
+    return data_impl<const void>(
+      [this] { return static_cast<const char*>(storage_.data()); });
+  }
+
+  inline void* mutable_data() {
+    return data_impl<void>(
+      [this] { return static_cast<char*>(storage_.mutable_data()); });
+  }
+
+ private:
+  template <typename Void, typename Func>
+  Void* data_impl(const Func& get_data) const {
+    // Note: PyTorch does some checks in here
+    auto* data = get_data();
+    return data;
+  }
+
+  Storage storage_;
+};
+
+namespace torch {
+TensorImpl clone(TensorImpl self) { return TensorImpl(); }
+TensorImpl view(TensorImpl self) { return TensorImpl(self.storage());}
+
+enum ReshapeArgs { View, Copy };
+TensorImpl reshape(TensorImpl self, ReshapeArgs args) {
+  if (args == ReshapeArgs::View) {
+    if (COWSim::cow_sim_enabled) {
+      self.storage().maybe_enable_cow_sim_();
+    }
+    TensorImpl res = view(self);
+    res.storage().start_new_view_group_();
+    return res;
+  } else {
+    return clone(self);
+  }
+}
+}
+
+namespace scenario {
+
+enum class OpKind { Tensor, View, ReshapeView, ReshapeCopy, Set, Mutate, Read };
+
+static const std::pair<const char*, OpKind> op_names[] = {
+  {"tensor", OpKind::Tensor},
+  {"view", OpKind::View},
+  {"reshape_view", OpKind::ReshapeView},
+  {"reshape_copy", OpKind::ReshapeCopy},
+  {"set", OpKind::Set},
+  {"mutate", OpKind::Mutate},
+  {"read", OpKind::Read},
+};
+
+// Number of tensor arguments each op takes
+int num_args(OpKind kind) {
+  switch (kind) {
+    case OpKind::Tensor:
+    case OpKind::Mutate:
+    case OpKind::Read:
+      return 1;
+    default:
+      return 2;
+  }
+}
+
+const char* op_name(OpKind kind) {
+  for (auto& [name, op_kind] : op_names) {
+    if (op_kind == kind) {
+      return name;
+    }
+  }
+  return "?";
+}
+
+// Tensors are referred to by index, so replaying doesn't need any string
+// lookups
+struct Op {
+  OpKind kind;
+  uint32_t dst;
+  uint32_t src;
+};
+
+struct Scenario {
+  std::string name;
+  std::vector<Op> ops;
+  std::vector<std::string> tensor_names;
+  // -1 if the scenario doesn't say
+  int64_t expected_warns = -1;
+};
+
+std::vector<Scenario> parse(std::istream& in, const std::string& filename) {
+  std::vector<Scenario> scenarios;
+  std::unordered_map<std::string, uint32_t> tensor_ids;
+  Scenario* current = nullptr;
+  std::string line;
+  size_t line_num = 0;
+
+  auto error = [&](const std::string& msg) {
+    std::ostringstream ss;
+    ss << filename << ":" << line_num << ": " << msg;
+    throw std::runtime_error(ss.str());
+  };
+
+  auto tensor_id = [&](const std::string& name, bool define) {
+    auto it = tensor_ids.find(name);
+    if (it != tensor_ids.end()) {
+      return it->second;
+    }
+    if (!define) {
+      error("unknown tensor '" + name + "'");
+    }
+    uint32_t id = current->tensor_names.size();
+    current->tensor_names.push_back(name);
+    tensor_ids.emplace(name, id);
+    return id;
+  };
+
+  while (std::getline(in, line)) {
+    line_num++;
+    line = line.substr(0, line.find('#'));
+    std::istringstream words(line);
+    std::string word;
+    if (!(words >> word)) {
+      continue;
+    }
+
+    if (word == "scenario") {
+      if (current) {
+        error("missing 'end' before new scenario");
+      }
+      scenarios.emplace_back();
+      current = &scenarios.back();
+      if (!(words >> current->name)) {
+        error("scenario needs a name");
+      }
+      tensor_ids.clear();
+      continue;
+    }
+    if (!current) {
+      error("'" + word + "' outside of a scenario");
+    }
+    if (word == "end") {
+      current = nullptr;
+      continue;
+    }
+    if (word == "expect") {
+      if (!(words >> current->expected_warns)) {
+        error("expect needs a number");
+      }
+      continue;
+    }
+
+    bool found = false;
+    for (auto& [name, kind] : op_names) {
+      if (word != name) {
+        continue;
+      }
+      found = true;
+      std::string dst_name, src_name;
+      if (!(words >> dst_name) || (num_args(kind) == 2 && !(words >> src_name))) {
+        error(word + " needs " + std::to_string(num_args(kind)) + " argument(s)");
+      }
+      Op op{kind, 0, 0};
+      // `set` and the ops that read a tensor need it to exist already
+      bool defines = kind != OpKind::Set && kind != OpKind::Mutate && kind != OpKind::Read;
+      // Look up the source first, so `view a a` is an error instead of
+      // silently defining `a`
+      if (num_args(kind) == 2) {
+        op.src = tensor_id(src_name, false);
+      }
+      op.dst = tensor_id(dst_name, defines);
+      current->ops.push_back(op);
+    }
+    if (!found) {
+      error("unknown op '" + word + "'");
+    }
+  }
+  if (current) {
+    error("missing 'end' at end of file");
+  }
+  return scenarios;
+}
+
+void print(std::ostream& out, const Scenario& s) {
+  out << "scenario " << s.name << "\n";
+  if (s.expected_warns >= 0) {
+    out << "expect " << s.expected_warns << "\n";
+  }
+  for (const Op& op : s.ops) {
+    out << op_name(op.kind) << " " << s.tensor_names[op.dst];
+    if (num_args(op.kind) == 2) {
+      out << " " << s.tensor_names[op.src];
+    }
+    out << "\n";
+  }
+  out << "end\n";
+}
+
+// Replays the ops against the real classes, and returns how many warnings
+// they produced. `tensors` is passed in so it can be reused between scenarios.
+uint64_t replay(const Scenario& s, std::vector<TensorImpl>& tensors) {
+  tensors.clear();
+  tensors.resize(s.tensor_names.size());
+  uint64_t warns_before = COWSim::get_warn_counter().count;
+  for (const Op& op : s.ops) {
+    switch (op.kind) {
+      case OpKind::Tensor:
+        tensors[op.dst] = TensorImpl();
+        break;
+      case OpKind::View:
+        tensors[op.dst] = torch::view(tensors[op.src]);
+        break;
+      case OpKind::ReshapeView:
+        tensors[op.dst] = torch::reshape(tensors[op.src], torch::ReshapeArgs::View);
+        break;
+      case OpKind::ReshapeCopy:
+        tensors[op.dst] = torch::reshape(tensors[op.src], torch::ReshapeArgs::Copy);
+        break;
+      case OpKind::Set:
+        tensors[op.dst].storage() = tensors[op.src].storage();
+        break;
+      case OpKind::Mutate:
+        tensors[op.dst].mutable_data();
+        break;
+      case OpKind::Read:
+        tensors[op.dst].const_data();
+        break;
+    }
+  }
+  return COWSim::get_warn_counter().count - warns_before;
+}
+
+// The reference model, written to be obviously correct rather than fast.
+// A tensor is just a buffer number and a group number. A buffer becomes a COW
+// buffer when a reshape view is made from it. After that, the first group to
+// write to it owns it, and any access from another group is a warning.
+uint64_t reference(const Scenario& s) {
+  struct Tensor { size_t buffer; size_t group; };
+  struct Buffer { bool cow = false; size_t first_writer = 0; };
+
+  std::vector<Tensor> tensors(s.tensor_names.size());
+  std::vector<Buffer> buffers;
+  size_t next_group = 1;
+  uint64_t warns = 0;
+
+  auto new_tensor = [&]() {
+    buffers.emplace_back();
+    return Tensor{buffers.size() - 1, next_group++};
+  };
+
+  auto check = [&](const Tensor& t) {
+    Buffer& b = buffers[t.buffer];
+    if (b.cow && b.first_writer != 0 && b.first_writer != t.group) {
+      warns++;
+    }
+  };
+
+  for (const Op& op : s.ops) {
+    switch (op.kind) {
+      case OpKind::Tensor:
+      case OpKind::ReshapeCopy:
+        tensors[op.dst] = new_tensor();
+        break;
+      case OpKind::View:
+        tensors[op.dst] = tensors[op.src];
+        break;
+      case OpKind::ReshapeView:
+        buffers[tensors[op.src].buffer].cow = true;
+        tensors[op.dst] = Tensor{tensors[op.src].buffer, next_group++};
+        break;
+      case OpKind::Set:
+        tensors[op.dst] = tensors[op.src];
+        break;
+      case OpKind::Mutate: {
+        const Tensor& t = tensors[op.dst];
+        check(t);
+        Buffer& b = buffers[t.buffer];
+        if (b.cow && b.first_writer == 0) {
+          b.first_writer = t.group;
+        }
+        break;
+      }
+      case OpKind::Read:
+        check(tensors[op.dst]);
+        break;
+    }
+  }
+  return warns;
+}
+
+// Makes a random scenario. Every tensor is defined with `tensor` before any
+// other op can use it.
+Scenario random_scenario(std::mt19937_64& rng, size_t num_ops, size_t max_tensors) {
+  Scenario s;
+  s.name = "fuzz";
+  for (size_t i = 0; i < max_tensors; i++) {
+    s.tensor_names.push_back(std::string(1, 'a' + i));
+  }
+  size_t num_defined = 0;
+  std::uniform_int_distribution<int> op_dist(0, std::size(op_names) - 1);
+  while (s.ops.size() < num_ops) {
+    OpKind kind = num_defined == 0 ? OpKind::Tensor : op_names[op_dist(rng)].second;
+    Op op{kind, 0, 0};
+    // Pick the source before a new tensor might get defined, so the source is
+    // always a tensor that already exists
+    if (kind != OpKind::Tensor) {
+      op.src = rng() % num_defined;
+    }
+    bool defines = kind == OpKind::Tensor || kind == OpKind::View
+      || kind == OpKind::ReshapeView || kind == OpKind::ReshapeCopy;
+    // Ops that define a tensor either define a new one or overwrite an
+    // existing one
+    if (defines && num_defined < max_tensors && (num_defined == 0 || (rng() & 1))) {
+      op.dst = num_defined++;
+    } else {
+      op.dst = rng() % num_defined;
+    }
+    s.ops.push_back(op);
+  }
+  s.tensor_names.resize(num_defined);
+  return s;
+}
+
+} // namespace scenario
+
+int main(int argc, char** argv) {
+  std::string filename = argc > 1 ? argv[1] : "scenarios.txt";
+  size_t num_fuzz = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1'000'000;
+
+  std::ifstream file(filename);
+  if (!file) {
+    std::cerr << "could not open " << filename << std::endl;
+    return 1;
+  }
+  std::vector<scenario::Scenario> scenarios;
+  try {
+    scenarios = scenario::parse(file, filename);
+  } catch (const std::runtime_error& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  std::vector<TensorImpl> tensors;
+  for (auto& s : scenarios) {
+    COWSim::reset_warn_counter();
+    uint64_t warns = scenario::replay(s, tensors);
+    uint64_t ref_warns = scenario::reference(s);
+    bool ok = warns == ref_warns && (s.expected_warns < 0 || int64_t(warns) == s.expected_warns);
+    std::cout << s.name << "-->" << (ok ? "yay." : "BOO.") << std::endl;
+  }
+
+  // Fuzz
+  COWSim::get_warn_counter().quiet = true;
+  std::mt19937_64 rng(0);
+  const size_t ops_per_scenario = 16;
+  const size_t max_tensors = 5;
+  // Scenarios are generated and replayed a batch at a time, so memory doesn't
+  // grow with `num_fuzz`. Only the replays are timed.
+  const size_t kBatchSize = 10'000;
+  size_t num_mismatches = 0;
+  uint64_t total_warns = 0;
+  double checked_s = 0;
+  double unchecked_s = 0;
+  double replay_s = 0;
+  std::vector<scenario::Scenario> batch;
+  batch.reserve(kBatchSize);
+  auto time_s = [](auto func) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+  };
+
+  for (size_t batch_start = 0; batch_start < num_fuzz; batch_start += kBatchSize) {
+    batch.clear();
+    for (size_t i = batch_start; i < std::min(num_fuzz, batch_start + kBatchSize); i++) {
+      batch.push_back(scenario::random_scenario(rng, ops_per_scenario, max_tensors));
+    }
+
+    checked_s += time_s([&] {
+      for (auto& s : batch) {
+        uint64_t warns = scenario::replay(s, tensors);
+        total_warns += warns;
+        uint64_t ref_warns = scenario::reference(s);
+        if (warns != ref_warns) {
+          if (num_mismatches++ < 5) {
+            std::cout << "\nmismatch: got " << warns << " warnings, reference model expects "
+              << ref_warns << std::endl;
+            s.expected_warns = ref_warns;
+            scenario::print(std::cout, s);
+          }
+        }
+      }
+    });
+
+    // Same scenarios again, without COW simulation or the reference model, to
+    // see what the checker costs
+    COWSim::cow_sim_enabled = false;
+    unchecked_s += time_s([&] {
+      for (auto& s : batch) {
+        scenario::replay(s, tensors);
+      }
+    });
+
+    // And just the replay with COW simulation, without the reference model
+    COWSim::cow_sim_enabled = true;
+    replay_s += time_s([&] {
+      for (auto& s : batch) {
+        scenario::replay(s, tensors);
+      }
+    });
+  }
+
+  double num_ops = double(num_fuzz) * ops_per_scenario;
+  std::cout << "\nfuzzed " << num_fuzz << " scenarios of " << ops_per_scenario << " ops ("
+    << total_warns << " warnings), mismatches with reference model: " << num_mismatches
+    << "-->" << (num_mismatches == 0 ? "yay." : "BOO.") << std::endl;
+  std::cout << "  replay + reference model:   " << num_ops / checked_s / 1e6 << " M ops/sec" << std::endl;
+  std::cout << "  replay, COW sim enabled:    " << num_ops / replay_s / 1e6 << " M ops/sec" << std::endl;
+  std::cout << "  replay, COW sim disabled:   " << num_ops / unchecked_s / 1e6 << " M ops/sec" << std::endl;
+
+  return num_mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,421 @@
+// In the other examples, `DataPtr` doesn't allocate anything. It just takes the
+// next value of a global counter. Here `DataPtr` is closer to `c10::DataPtr`:
+// it holds the data pointer, a context pointer, and a deleter function that
+// gets called with the context. Data comes from an `Allocator`, like
+// `c10::Allocator`.
+//
+// `PoolingAllocator` rounds each request up to a power of 2 size class between
+// 64 bytes and 64 KiB. Each thread has its own free list for each size class,
+// so allocating and freeing doesn't need any locks. Frees go on the free list
+// of whichever thread does the free, so the next `StorageImpl` of a similar
+// size made on that thread reuses the block. When a thread's free list gets
+// too long, half of it is moved to a global free list (behind a mutex), and a
+// thread with an empty free list takes a batch from the global list before
+// it carves new blocks. New blocks are carved out of 1 MiB arenas, which are
+// never given back to the OS. Anything bigger than the largest size class
+// just goes to `malloc`.
+//
+// Each size class has its own deleter function, so the deleter knows which
+// free list the block goes on without needing a header in front of the block.
+//
+// The benchmark allocates and frees lots of short lived storages with random
+// sizes, and compares the pooling allocator with `malloc` and `new`. Each
+// benchmark runs in a forked child process, so the peak RSS it reports
+// doesn't include memory from the other benchmarks.
+//
+// Build with:
+//   g++ -std=c++17 -O2 -pthread main14.cpp -o main14
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+using DeleterFnPtr = void (*)(void*);
+
+class DataPtr {
+ public:
+  DataPtr() : data_(nullptr), ctx_(nullptr, &noop_deleter) {}
+
+  DataPtr(void* data, void* ctx, DeleterFnPtr ctx_deleter)
+    : data_(data), ctx_(ctx, ctx_deleter) {}
+
+  void* get() const {
+    return data_;
+  }
+
+  void* mutable_get() {
+    return data_;
+  }
+
+  void* get_context() const {
+    return ctx_.get();
+  }
+
+ private:
+  static void noop_deleter(void*) {}
+
+  void* data_;
+  std::unique_ptr<void, DeleterFnPtr> ctx_;
+};
+
+class Allocator {
+ public:
+  virtual ~Allocator() = default;
+  virtual DataPtr allocate(size_t nbytes) = 0;
+};
+
+// Allocates with `malloc`. The data pointer is also the context.
+class MallocAllocator : public Allocator {
+ public:
+  DataPtr allocate(size_t nbytes) override {
+    void* data = std::malloc(nbytes);
+    return DataPtr(data, data, &std::free);
+  }
+};
+
+// Allocates with `new`
+class NewAllocator : public Allocator {
+ public:
+  DataPtr allocate(size_t nbytes) override {
+    char* data = new char[nbytes];
+    return DataPtr(data, data, &deleter);
+  }
+
+ private:
+  static void deleter(void* ctx) {
+    delete [] static_cast<char*>(ctx);
+  }
+};
+
+class PoolingAllocator : public Allocator {
+ public:
+  static constexpr size_t kMinClassBits = 6;
+  static constexpr size_t kMaxClassBits = 16;
+  static constexpr size_t kNumClasses = kMaxClassBits - kMinClassBits + 1;
+  static constexpr size_t kArenaSize = size_t(1) << 20;
+  // A thread's free list for a size class can hold up to this many bytes
+  // before half of it is moved to the global free list
+  static constexpr size_t kMaxThreadCacheBytes = size_t(1) << 20;
+
+  static PoolingAllocator& get() {
+    // Leaked, since thread caches may still give blocks back to it while
+    // other static objects are being destroyed
+    static PoolingAllocator* allocator = new PoolingAllocator();
+    return *allocator;
+  }
+
+  DataPtr allocate(size_t nbytes) override {
+    if (nbytes > (size_t(1) << kMaxClassBits)) {
+      void* data = std::malloc(nbytes);
+      return DataPtr(data, data, &std::free);
+    }
+    size_t size_class = size_class_for(nbytes);
+    void* data = allocate_block(size_class);
+    return DataPtr(data, data, class_deleters()[size_class]);
+  }
+
+  static size_t size_class_for(size_t nbytes) {
+    size_t bits = kMinClassBits;
+    while ((size_t(1) << bits) < nbytes) {
+      bits++;
+    }
+    return bits - kMinClassBits;
+  }
+
+  static size_t class_size(size_t size_class) {
+    return size_t(1) << (size_class + kMinClassBits);
+  }
+
+ private:
+  // Free blocks are linked through their first word
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  struct FreeList {
+    FreeBlock* head = nullptr;
+    size_t count = 0;
+
+    void push(void* ptr) {
+      auto* block = static_cast<FreeBlock*>(ptr);
+      block->next = head;
+      head = block;
+      count++;
+    }
+
+    void* pop() {
+      FreeBlock* block = head;
+      head = block->next;
+      count--;
+      return block;
+    }
+  };
+
+  struct ThreadCache {
+    std::array<FreeList, kNumClasses> free_lists;
+    // Current arena that new blocks are carved from
+    char* arena_pos = nullptr;
+    char* arena_end = nullptr;
+
+    ~ThreadCache() {
+      // Give everything back to the global lists, so other threads can reuse
+      // it. The arena remainder is just abandoned.
+      for (size_t size_class = 0; size_class < kNumClasses; size_class++) {
+        FreeList& list = free_lists[size_class];
+        if (list.count) {
+          PoolingAllocator::get().give_to_global(size_class, list, list.count);
+        }
+      }
+    }
+  };
+
+  PoolingAllocator() = default;
+
+  static ThreadCache& thread_cache() {
+    thread_local ThreadCache cache;
+    return cache;
+  }
+
+  void* allocate_block(size_t size_class) {
+    ThreadCache& cache = thread_cache();
+    FreeList& list = cache.free_lists[size_class];
+    if (!list.head) {
+      take_from_global(size_class, list);
+    }
+    if (list.head) {
+      return list.pop();
+    }
+    size_t size = class_size(size_class);
+    if (cache.arena_pos + size > cache.arena_end) {
+      new_arena(cache);
+    }
+    void* block = cache.arena_pos;
+    cache.arena_pos += size;
+    return block;
+  }
+
+  template <size_t kSizeClass>
+  static void class_deleter(void* ctx) {
+    FreeList& list = thread_cache().free_lists[kSizeClass];
+    list.push(ctx);
+    if (list.count * class_size(kSizeClass) > kMaxThreadCacheBytes) {
+      get().give_to_global(kSizeClass, list, list.count / 2);
+    }
+  }
+
+  template <size_t... Is>
+  static constexpr std::array<DeleterFnPtr, kNumClasses> make_class_deleters(std::index_sequence<Is...>) {
+    return {&class_deleter<Is>...};
+  }
+
+  static const std::array<DeleterFnPtr, kNumClasses>& class_deleters() {
+    static constexpr std::array<DeleterFnPtr, kNumClasses> deleters =
+      make_class_deleters(std::make_index_sequence<kNumClasses>());
+    return deleters;
+  }
+
+  void new_arena(ThreadCache& cache) {
+    char* arena = static_cast<char*>(std::aligned_alloc(64, kArenaSize));
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      arenas_.push_back(arena);
+    }
+    cache.arena_pos = arena;
+    cache.arena_end = arena + kArenaSize;
+  }
+
+  void give_to_global(size_t size_class, FreeList& list, size_t count) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    FreeList& global = global_free_lists_[size_class];
+    for (size_t i = 0; i < count; i++) {
+      global.push(list.pop());
+    }
+  }
+
+  void take_from_global(size_t size_class, FreeList& list) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    FreeList& global = global_free_lists_[size_class];
+    size_t count = std::min(global.count, kMaxThreadCacheBytes / class_size(size_class) / 2);
+    for (size_t i = 0; i < count; i++) {
+      list.push(global.pop());
+    }
+  }
+
+  std::mutex mutex_;
+  std::array<FreeList, kNumClasses> global_free_lists_;
+  std::vector<char*> arenas_;
+};
+
+class StorageImpl {
+ public:
+  StorageImpl(size_t nbytes, Allocator& allocator)
+    : nbytes_(nbytes), data_ptr_(allocator.allocate(nbytes)) {}
+
+  const void* data() const {
+    return data_ptr_.get();
+  }
+
+  void* mutable_data() {
+    return data_ptr_.mutable_get();
+  }
+
+  size_t nbytes() const {
+    return nbytes_;
+  }
+
+ private:
+  size_t nbytes_;
+  DataPtr data_ptr_;
+};
+
+void check(bool cond, const char* msg) {
+  std::cout << (cond ? "yay. " : "BOO. ") << msg << std::endl;
+}
+
+void examples() {
+  auto& allocator = PoolingAllocator::get();
+  void* first;
+  {
+    StorageImpl a(1000, allocator);
+    first = a.mutable_data();
+    std::memset(a.mutable_data(), 1, a.nbytes());
+  }
+  StorageImpl b(900, allocator);
+  check(b.data() == first, "freed block is reused for a similar size");
+  StorageImpl c(100, allocator);
+  check(c.data() != first, "different size class gets a different block");
+  StorageImpl d(1 << 20, allocator);
+  std::memset(d.mutable_data(), 1, d.nbytes());
+  check(d.data() != nullptr, "large size falls back to malloc");
+  std::cout << std::endl;
+}
+
+size_t peak_rss_kb() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.rfind("VmHWM:", 0) == 0) {
+      return std::strtoull(line.c_str() + 6, nullptr, 10);
+    }
+  }
+  return 0;
+}
+
+// Each thread keeps a window of live storages with random sizes, and replaces
+// a random one each iteration, so every iteration is one free and one
+// allocation. Sizes are mostly small, with the occasional large one.
+void bench_allocator(Allocator& allocator, const char* name, size_t num_threads) {
+  const size_t iters = 2'000'000;
+  const size_t window = 1024;
+
+  std::vector<std::thread> threads;
+  std::vector<double> ns(num_threads);
+  std::vector<std::vector<uint32_t>> latencies(num_threads);
+  for (size_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+    threads.emplace_back([&, thread_idx] {
+      std::mt19937 rng(thread_idx);
+      std::uniform_int_distribution<int> bits_dist(4, 15);
+      auto random_size = [&] {
+        if (rng() % 1000 == 0) {
+          return size_t(256) << 10;
+        }
+        return (size_t(1) << bits_dist(rng)) + rng() % 64;
+      };
+      std::vector<std::unique_ptr<StorageImpl>> live(window);
+      for (auto& storage : live) {
+        storage = std::make_unique<StorageImpl>(random_size(), allocator);
+      }
+      auto& thread_latencies = latencies[thread_idx];
+      thread_latencies.reserve(iters / 64);
+      auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < iters; i++) {
+        size_t idx = rng() % window;
+        size_t nbytes = random_size();
+        // Only time a sample of the iterations, since reading the clock costs
+        // about as much as what we're measuring
+        if (i % 64 == 0) {
+          auto t0 = std::chrono::steady_clock::now();
+          live[idx].reset();
+          live[idx] = std::make_unique<StorageImpl>(nbytes, allocator);
+          auto t1 = std::chrono::steady_clock::now();
+          thread_latencies.push_back(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+        } else {
+          live[idx].reset();
+          live[idx] = std::make_unique<StorageImpl>(nbytes, allocator);
+        }
+        // Touch the data, like a real tensor would
+        static_cast<char*>(live[idx]->mutable_data())[0] = 1;
+      }
+      auto end = std::chrono::steady_clock::now();
+      ns[thread_idx] = std::chrono::duration<double, std::nano>(end - start).count() / iters;
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::vector<uint32_t> all;
+  for (auto& thread_latencies : latencies) {
+    all.insert(all.end(), thread_latencies.begin(), thread_latencies.end());
+  }
+  std::sort(all.begin(), all.end());
+  double avg_ns = 0;
+  for (double x : ns) {
+    avg_ns += x;
+  }
+  avg_ns /= num_threads;
+
+  std::cout << "  " << name << "  threads: " << num_threads
+    << "  ns/iter: " << avg_ns
+    << "  p50 ns: " << all[all.size() / 2]
+    << "  p99 ns: " << all[all.size() * 99 / 100]
+    << "  peak RSS MiB: " << peak_rss_kb() / 1024
+    << std::endl;
+}
+
+// Runs `func` in a child process so its peak RSS is measured on its own
+template <typename Func>
+void in_child_process(Func func) {
+  std::cout.flush();
+  pid_t pid = fork();
+  if (pid == 0) {
+    func();
+    std::cout.flush();
+    std::_Exit(0);
+  }
+  waitpid(pid, nullptr, 0);
+}
+
+int main() {
+  examples();
+
+  std::cout << "free + allocate one storage per iteration:" << std::endl;
+  for (size_t num_threads : {size_t(1), size_t(4)}) {
+    in_child_process([&] {
+      MallocAllocator allocator;
+      bench_allocator(allocator, "malloc ", num_threads);
+    });
+    in_child_process([&] {
+      NewAllocator allocator;
+      bench_allocator(allocator, "new    ", num_threads);
+    });
+    in_child_process([&] {
+      bench_allocator(PoolingAllocator::get(), "pooling", num_threads);
+    });
+  }
+}
@@ -0,0 +1,546 @@
+// Same as main15.cpp, except `view`, `reshape`, and `clone` take their input
+// by reference, with overloads that take an rvalue and move from it.
+//
+// In main3.cpp, these ops take `TensorImpl self` by value. So every call
+// copies the input's `Storage`, which is an atomic increment of the
+// `shared_ptr` refcount, and then destroys the copy, which is an atomic
+// decrement. The result is made by copying `self.storage()` again. So a chain
+// like `view(reshape(view(a)))` does several increments and decrements even
+// though the end result only holds one more reference to the `StorageImpl`
+// than `a` did.
+//
+// Here, the `const TensorImpl&` overloads copy the storage exactly once, into
+// the result. The `TensorImpl&&` overloads move the storage out of the input,
+// so a chain of them only copies the storage for the first op, and every
+// temporary after that is moved from. The old by-value versions are kept in
+// `torch::by_value` so the benchmark can compare them.
+//
+// `Storage` counts its copies, moves, and destructions of non-empty storages,
+// which are the refcount increments and decrements. `operator new` counts
+// heap allocations. The `data_impl` accessor takes its lambda by reference,
+// so `const_data()` and `mutable_data()` don't allocate either, which the
+// benchmark checks too.
+//
+// Build with:
+//   g++ -std=c++17 -O2 -pthread main16.cpp -o main16
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <ios>
+#include <new>
+#include <memory>
+#include <iostream>
+#include <optional>
+#include <thread>
+#include <variant>
+#include <vector>
+
+
+// Counts heap allocations. Only read from the main thread.
+static size_t num_allocations = 0;
+
+void* operator new(size_t size) {
+  num_allocations++;
+  if (void* ptr = std::malloc(size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept {
+  std::free(ptr);
+}
+
+// Counts what `Storage` does to the `StorageImpl` refcount
+struct RefcountStats {
+  size_t increments = 0;
+  size_t decrements = 0;
+  size_t moves = 0;
+};
+
+static RefcountStats refcount_stats;
+
+// Note: This example doesn't yet include the StorageImpl side
+// of the COW simulation. That will likely be implemented in either
+// of the following ways:
+//
+//  * Somehow add an optional layer of indirection for the StorageImpl
+//    if it needs to simulate COW.
+//
+//  * Add a COW simulation state machine as a member of StorageImpl,
+//    like https://github.com/pytorch/pytorch/pull/97175
+namespace COWSim {
+struct WarnCounter {
+  uint8_t count = 0;
+  void increment() { ++count; }
+  void reset() { count =0; }
+};
+
+WarnCounter &get_warn_counter() {
+  static WarnCounter warn_counter;
+  return warn_counter;
+}
+
+void reset_warn_counter() {
+  get_warn_counter().reset();
+}
+
+void check_warn_counter(uint8_t expected_count) {
+  if (expected_count == get_warn_counter().count) {
+    std::cout << "yay.\n";
+  } else {
+    std::cout << "BOO.\n";
+  }
+}
+
+using TokenType = std::uintptr_t;
+//This could also populate a shared registry with extra info about "who" this
+//token is associated with that can be recalled at message construction time.
+//That would introduce some thread safety issues, but is an option if the
+//additional context is needed
+template <typename T> inline TokenType mint_token_for(T *addr) {
+  // In this simple example I have used a type alias for the token type and
+  // chosen as sentinel value the token created for NULL. In practice a stronger
+  // token type and singleton sentinel value would be safer
+  //TORCH_INTERNAL_ASSERT(addr != nullptr) 
+  return reinterpret_cast<TokenType>(addr);
+}
+//Note that mint_token_for(nullptr) can't be constexpr if that is important.
+static constexpr TokenType NullToken{0};
+static const char cow_read_msg[] = "WRITE THEN READ";
+static const char cow_write_msg[] = "WRITE THEN WRITE";
+
+inline bool token_set(TokenType t) { return t != NullToken;}
+
+struct COWChecker {
+  //Might be useful,
+  TokenType creator_;
+  //Probably more than one field, not a string until msg generation
+  std::string note_;
+  //The only piece of data critical to the logic
+  TokenType first_writer_;
+  COWChecker() : creator_(NullToken), note_("<info>"), first_writer_(NullToken) {}
+  explicit COWChecker(TokenType createdBy) : creator_(createdBy), note_("<info>"), first_writer_(NullToken) {}
+
+  // In practice these methods would craft a real message using note_ to hint at
+  // where the COW behavior would kick in. Some boilerplate tacked on for docs
+  // links, or how to opt in to COW ahead of time for testing
+  void check_on_write(TokenType writer) {
+    maybe_warn_on_mismatch(writer, cow_write_msg);
+    maybe_set_first_writer(writer);
+  }
+  void check_on_read(TokenType reader) const {
+    maybe_warn_on_mismatch(reader, cow_read_msg);
+  }
+
+  void maybe_warn_on_mismatch(TokenType other, const char *msg) const {
+    // check if the cow state has been initalized
+    if (token_set(creator_)) {
+      //Check that we have been subsequently hit with a reason to materialize
+      if (token_set(first_writer_))
+        // issue warning
+        if (first_writer_ != other) {
+          get_warn_counter().increment();
+          std::cout << "COW BEHAVIOR WARNING: " << msg << std::endl;
+        }
+    }
+  }
+
+  void maybe_set_first_writer(TokenType other) {
+    //We if cow has been initalized
+    if (token_set(creator_)) {
+      //We are setting the first writer
+      if (!token_set(first_writer_)) {
+        first_writer_ = other;
+      }
+    }
+  }
+
+  void maybe_init(TokenType creator) {
+    if(!token_set(creator_)) creator_ = creator;
+  }
+
+};
+
+} // namespace COWSim
+
+class DataPtrIdAllocator {
+ public:
+  static constexpr uintptr_t kRangeSize = 4096;
+
+  static uintptr_t allocate() {
+    thread_local uintptr_t next = 0;
+    thread_local uintptr_t end = 0;
+    if (next == end) {
+      next = next_range_.fetch_add(kRangeSize, std::memory_order_relaxed);
+      end = next + kRangeSize;
+    }
+    return next++;
+  }
+
+ private:
+  // Starts at 1 so that a `DataPtr` is never null
+  static inline std::atomic<uintptr_t> next_range_{1};
+};
+
+class DataPtr {
+ public:
+  DataPtr() : ptr_(reinterpret_cast<void*>(DataPtrIdAllocator::allocate())) {}
+
+  void* get() const {
+    return ptr_;
+  }
+
+  void* mutable_get() {
+    return ptr_;
+  }
+
+ private:
+  void* ptr_;
+};
+
+class StorageImpl {
+ public:
+   const void *data(COWSim::TokenType token) const {
+    cow_checker_.check_on_read(token);
+    return data_ptr_.get();
+  }
+
+  void *mutable_data(COWSim::TokenType token) {
+    cow_checker_.check_on_write(token);
+    return data_ptr_.mutable_get();
+  }
+
+  void maybe_enable_cow_sim(COWSim::TokenType token) {
+    // Note tracking the creator may be useful for generating informative
+    // messages. here I am using to signal cow initialization, but that can be
+    // done other ways without expanding the scope of impact. Optionals for
+    // example would work.
+    // Here I have purposely pushed as much logic down into the checker as I
+    // can, so that the diff footprint on Storage/StorageImpl is as small as
+    // possible.
+    cow_checker_.maybe_init(token);
+  }
+
+ private:
+   DataPtr data_ptr_;
+   COWSim::COWChecker cow_checker_;
+};
+
+
+class Storage {
+ public:
+   Storage() : storage_impl_(std::make_shared<StorageImpl>()), group_number_(1) {}
+
+   Storage(const Storage& other) : storage_impl_(other.storage_impl_), group_number_(other.group_number_) {
+     refcount_stats.increments++;
+   }
+
+   Storage(Storage&& other) noexcept : storage_impl_(std::move(other.storage_impl_)), group_number_(other.group_number_) {
+     refcount_stats.moves++;
+   }
+
+   Storage& operator=(const Storage& other) {
+     Storage(other).swap(*this);
+     return *this;
+   }
+
+   Storage& operator=(Storage&& other) noexcept {
+     Storage(std::move(other)).swap(*this);
+     return *this;
+   }
+
+   ~Storage() {
+     if (storage_impl_) {
+       refcount_stats.decrements++;
+     }
+   }
+
+   void swap(Storage& other) noexcept {
+     std::swap(storage_impl_, other.storage_impl_);
+     std::swap(group_number_, other.group_number_);
+   }
+
+  const void *data() const {
+    return storage_impl_->data(reinterpret_cast<std::uintptr_t>(group_number_));
+  }
+
+  void *mutable_data() const {
+    return storage_impl_->mutable_data(reinterpret_cast<std::uintptr_t>(group_number_));
+  }
+
+  // Adds an extra layer of indirection between `Storage` and `StorageImpl` to
+  // simulate COW behavior. No-op if the layer has already been added.
+  //
+  // This only changes the `StorageImpl`, so it's const, which lets `reshape`
+  // call it on a `const TensorImpl&`.
+  void maybe_enable_cow_sim_() const {
+    // Note if we want to hoist the creator token (it will be unique to the
+    // tensorimpl rather than the Storage) This API would need to accept it as
+    // an arg.  Since storages are uniquely owned wrappers sharing StorageImpl s
+    // This is probably okay
+    storage_impl_->maybe_enable_cow_sim(group_number_);
+  }
+
+  void increment_group_number_() {
+    group_number_++;
+  }
+
+ private:
+  std::shared_ptr<StorageImpl> storage_impl_;
+  COWSim::TokenType group_number_;
+};
+
+//Except for differences used to minify the example there are no COWSim details leaking into TensorImpl
+class TensorImpl {
+public:
+  TensorImpl() = default;
+  explicit TensorImpl(const Storage& storage) : storage_(storage) {}
+  explicit TensorImpl(Storage&& storage) : storage_(std::move(storage)) {}
+  Storage& storage() {
+    return storage_;
+  }
+  const Storage& storage() const {
+    return storage_;
+  }
+
+  inline const void* const_data() const {
+    return data_impl<const void>(
+      [this] { return static_cast<const char*>(storage_.data()); });
+  }
+
+  inline void* mutable_data() {
+    return data_impl<void>(
+      [this] { return static_cast<char*>(storage_.mutable_data()); });
+  }
+
+  // void maybe_enable_cow_sim_() {
+  //   storage_.maybe_enable_cow_sim_();
+  // }
+
+
+ private:
+  template <typename Void, typename Func>
+  Void* data_impl(const Func& get_data) const {
+    // Note: PyTorch does some checks in here
+    auto* data = get_data();
+    return data;
+  }
+
+  Storage storage_;
+};
+
+namespace torch {
+// Clone/View defined to refer to them, they are not modified
+TensorImpl clone(const TensorImpl& self) { return TensorImpl(); }
+TensorImpl view(const TensorImpl& self) { return TensorImpl(self.storage()); }
+TensorImpl view(TensorImpl&& self) { return TensorImpl(std::move(self.storage())); }
+
+enum ReshapeArgs { View, Copy };
+// Simulating changes to the impl of an op w/ conditional view behavior
+TensorImpl reshape(const TensorImpl& self, ReshapeArgs args) {
+  if (args == ReshapeArgs::View) {
+    // this would be added inside the branch where we are creating a view e.g
+    // https://github.com/pytorch/pytorch/blob/12a69afa6d4c4e9720d1b7644291eadb49792e8a/aten/src/ATen/native/TensorShape.cpp#L1670
+    self.storage().maybe_enable_cow_sim_();
+    TensorImpl res = view(self);
+    res.storage().increment_group_number_();
+    return res;
+  } else {
+    return clone(self);
+  }
+}
+
+// Nothing else refers to `self`, so its storage can be moved into the result
+TensorImpl reshape(TensorImpl&& self, ReshapeArgs args) {
+  if (args == ReshapeArgs::View) {
+    self.storage().maybe_enable_cow_sim_();
+    TensorImpl res = view(std::move(self));
+    res.storage().increment_group_number_();
+    return res;
+  } else {
+    return clone(self);
+  }
+}
+
+// The ops from main3.cpp, which take their input by value
+namespace by_value {
+TensorImpl clone(TensorImpl self) { return TensorImpl(); }
+TensorImpl view(TensorImpl self) { return TensorImpl(self.storage()); }
+
+TensorImpl reshape(TensorImpl self, ReshapeArgs args) {
+  if (args == ReshapeArgs::View) {
+    self.storage().maybe_enable_cow_sim_();
+    TensorImpl res = by_value::view(self);
+    res.storage().increment_group_number_();
+    return res;
+  } else {
+    return by_value::clone(self);
+  }
+}
+} // namespace by_value
+}
+
+// for easy to read examples
+auto tensor() { return TensorImpl(); }
+using torch::view;
+using torch::reshape;
+auto mutates_input(TensorImpl& t) { return t.mutable_data(); }
+auto reads_from_input(TensorImpl& t) {return t.const_data();}
+using torch::ReshapeArgs;
+
+auto example_1() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  mutates_input(a);
+  reads_from_input(b);
+}
+
+auto example_2() {
+  auto a = tensor();
+  auto c = tensor();
+  c.storage() = a.storage();
+  auto b = reshape(a, ReshapeArgs::View);
+  mutates_input(b);
+  reads_from_input(c);
+}
+
+auto example_3() {
+    TensorImpl a;
+    TensorImpl b = view(a);
+    mutates_input(a);
+    mutates_input(b);
+    reads_from_input(a);
+    reads_from_input(b);
+}
+
+auto example_4() {
+  auto a = tensor();
+  auto b = view(a);
+  auto c = reshape(b, ReshapeArgs::View);
+  mutates_input(b);
+  reads_from_input(a);
+}
+
+auto example_5() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  auto c = view(b);
+  mutates_input(b);
+  reads_from_input(c);
+}
+
+auto example_6() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  auto c = view(b);
+  mutates_input(c);
+  reads_from_input(b);
+}
+
+auto example_7() {
+  auto a = tensor();
+  auto b = view(a);
+  auto c = reshape(b, ReshapeArgs::View);
+  mutates_input(a);
+  reads_from_input(b);
+}
+
+using func_t = decltype(&example_1);
+static std::pair<func_t, uint8_t> test_cases[] = {
+    {&example_1, 1},
+    {&example_2, 1},
+    {&example_3, 0},
+    {&example_4, 0},
+    {&example_5, 0},
+    {&example_6, 0},
+    {&example_7, 0},
+};
+
+
+
+template <typename T>
+inline void do_not_optimize(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct ChainCounts {
+  double allocations;
+  double increments;
+  double decrements;
+  double moves;
+  double ns;
+};
+
+// Runs `chain` on the same base tensor `iters` times, and reports the average
+// counts per run
+template <typename Func>
+ChainCounts measure_chain(Func chain) {
+  const size_t iters = 1'000'000;
+  TensorImpl a;
+  refcount_stats = RefcountStats();
+  num_allocations = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iters; i++) {
+    TensorImpl result = chain(a);
+    do_not_optimize(result.const_data());
+    do_not_optimize(result.mutable_data());
+  }
+  auto end = std::chrono::steady_clock::now();
+  // Don't count the final decrement of `result`, which every version has to do
+  return {
+    double(num_allocations) / iters,
+    double(refcount_stats.increments) / iters,
+    double(refcount_stats.decrements) / iters - 1,
+    double(refcount_stats.moves) / iters,
+    std::chrono::duration<double, std::nano>(end - start).count() / iters,
+  };
+}
+
+void print_chain(const char* name, const ChainCounts& counts) {
+  std::cout << "  " << name
+    << "  allocations: " << counts.allocations
+    << "  incs: " << counts.increments
+    << "  decs: " << counts.decrements
+    << "  moves: " << counts.moves
+    << "  ns: " << counts.ns
+    << std::endl;
+}
+
+int main() {
+  auto i = 0;
+  for (auto [func, expected_warns] : test_cases) {
+    ++i;
+    COWSim::get_warn_counter().reset();
+    func();
+    std::cout << "Example " << i << "-->";
+    COWSim::check_warn_counter(expected_warns);
+  }
+
+  std::cout << std::endl
+    << "view(reshape(view(a))), per chain, not counting the result's own decrement:"
+    << std::endl;
+
+  ChainCounts by_value = measure_chain([](const TensorImpl& a) {
+    return torch::by_value::view(
+      torch::by_value::reshape(torch::by_value::view(a), ReshapeArgs::View));
+  });
+  print_chain("by value    ", by_value);
+
+  ChainCounts by_reference = measure_chain([](const TensorImpl& a) {
+    return view(reshape(view(a), ReshapeArgs::View));
+  });
+  print_chain("by reference", by_reference);
+
+  if (by_reference.allocations == 0 && by_reference.increments == 1 && by_reference.decrements == 0) {
+    std::cout << "yay. one refcount increment and no allocations" << std::endl;
+  } else {
+    std::cout << "BOO. expected one refcount increment and no allocations" << std::endl;
+  }
+}
@@ -0,0 +1,446 @@
+// Same as main3.cpp, except the `COWChecker` is safe to use from many threads
+// at once. In main3.cpp, `maybe_set_first_writer` does a plain load and store
+// of `first_writer_`, so two threads calling `StorageImpl::mutable_data(token)`
+// on a shared storage is a data race.
+//
+// Here `creator_` and `first_writer_` are atomics, and the first writer is
+// chosen with a compare-exchange, so exactly one writer wins. Any writer that
+// loses the race is treated just like a second writer in the single threaded
+// case, so it gets a warning.
+//
+// Once the first writer is set, `check_on_read` and `check_on_write` are only
+// a single atomic load and a compare. They never do a read-modify-write on the
+// checker, so readers never wait on each other and never bounce the cache line
+// that holds the checker.
+//
+// Build with:
+//   g++ -std=c++17 -O2 -pthread main4.cpp -o main4
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <ios>
+#include <memory>
+#include <iostream>
+#include <optional>
+#include <thread>
+#include <variant>
+#include <vector>
+
+namespace COWSim {
+struct WarnCounter {
+  // This is atomic now, since the stress test below has many threads warning
+  // at the same time
+  std::atomic<uint64_t> count{0};
+  // Lets the stress test run without printing thousands of warnings
+  std::atomic<bool> quiet{false};
+  void increment() { count.fetch_add(1, std::memory_order_relaxed); }
+  void reset() { count = 0; }
+};
+
+WarnCounter &get_warn_counter() {
+  static WarnCounter warn_counter;
+  return warn_counter;
+}
+
+void reset_warn_counter() {
+  get_warn_counter().reset();
+}
+
+void check_warn_counter(uint64_t expected_count) {
+  if (expected_count == get_warn_counter().count) {
+    std::cout << "yay.\n";
+  } else {
+    std::cout << "BOO.\n";
+  }
+}
+
+using TokenType = std::uintptr_t;
+template <typename T> inline TokenType mint_token_for(T *addr) {
+  return reinterpret_cast<TokenType>(addr);
+}
+static constexpr TokenType NullToken{0};
+static const char cow_read_msg[] = "WRITE THEN READ";
+static const char cow_write_msg[] = "WRITE THEN WRITE";
+
+inline bool token_set(TokenType t) { return t != NullToken;}
+
+// Only used by the benchmark to show that the compare-exchange slow path is
+// not taken once the first writer is known. It is only touched on the slow
+// path, so it doesn't add any contention to the fast path.
+static std::atomic<uint64_t> first_writer_cas_attempts{0};
+
+struct ConcurrentCOWChecker {
+  std::atomic<TokenType> creator_;
+  std::string note_;
+  std::atomic<TokenType> first_writer_;
+  ConcurrentCOWChecker() : creator_(NullToken), note_("<info>"), first_writer_(NullToken) {}
+  explicit ConcurrentCOWChecker(TokenType createdBy) : creator_(createdBy), note_("<info>"), first_writer_(NullToken) {}
+
+  void check_on_write(TokenType writer) {
+    // `first_writer_` can only be set after `creator_` is set, so if it is
+    // set, we can skip looking at `creator_` entirely
+    TokenType first_writer = first_writer_.load(std::memory_order_acquire);
+    if (!token_set(first_writer)) {
+      if (!token_set(creator_.load(std::memory_order_acquire))) {
+        return;
+      }
+      first_writer = maybe_set_first_writer(writer);
+    }
+    maybe_warn_on_mismatch(first_writer, writer, cow_write_msg);
+  }
+
+  void check_on_read(TokenType reader) const {
+    // The tokens are just values, nothing else is published along with them,
+    // so we don't need anything stronger than acquire here. On x86 this is an
+    // ordinary load.
+    TokenType first_writer = first_writer_.load(std::memory_order_acquire);
+    if (token_set(first_writer)) {
+      maybe_warn_on_mismatch(first_writer, reader, cow_read_msg);
+    }
+  }
+
+  void maybe_warn_on_mismatch(TokenType first_writer, TokenType other, const char *msg) const {
+    if (first_writer != other) {
+      get_warn_counter().increment();
+      if (!get_warn_counter().quiet.load(std::memory_order_relaxed)) {
+        std::cout << "COW BEHAVIOR WARNING: " << msg << std::endl;
+      }
+    }
+  }
+
+  // First writer wins. Returns whichever token ended up as the first writer,
+  // which is `other` if this call won the race.
+  TokenType maybe_set_first_writer(TokenType other) {
+    first_writer_cas_attempts.fetch_add(1, std::memory_order_relaxed);
+    TokenType expected = NullToken;
+    if (first_writer_.compare_exchange_strong(
+          expected, other,
+          std::memory_order_acq_rel, std::memory_order_acquire)) {
+      return other;
+    }
+    return expected;
+  }
+
+  void maybe_init(TokenType creator) {
+    TokenType expected = NullToken;
+    creator_.compare_exchange_strong(
+      expected, creator,
+      std::memory_order_acq_rel, std::memory_order_acquire);
+  }
+
+};
+
+} // namespace COWSim
+
+static int64_t next_data_ptr_value_ = 1;
+
+class DataPtr {
+ public:
+  DataPtr() : ptr_(reinterpret_cast<void*>(next_data_ptr_value_++)) {}
+
+  void* get() const {
+    return ptr_;
+  }
+
+  void* mutable_get() {
+    return ptr_;
+  }
+
+ private:
+  void* ptr_;
+};
+
+class StorageImpl {
+ public:
+   const void *data(COWSim::TokenType token) const {
+    cow_checker_.check_on_read(token);
+    return data_ptr_.get();
+  }
+
+  void *mutable_data(COWSim::TokenType token) {
+    cow_checker_.check_on_write(token);
+    return data_ptr_.mutable_get();
+  }
+
+  void maybe_enable_cow_sim(COWSim::TokenType token) {
+    cow_checker_.maybe_init(token);
+  }
+
+ private:
+   DataPtr data_ptr_;
+   COWSim::ConcurrentCOWChecker cow_checker_;
+};
+
+
+class Storage {
+ public:
+   Storage() : storage_impl_(std::make_shared<StorageImpl>()), group_number_(1) {}
+   Storage(Storage& other) : storage_impl_(other.storage_impl_), group_number_(other.group_number_) {}
+
+  const void *data() const {
+    return storage_impl_->data(reinterpret_cast<std::uintptr_t>(group_number_));
+  }
+
+  void *mutable_data() const {
+    return storage_impl_->mutable_data(reinterpret_cast<std::uintptr_t>(group_number_));
+  }
+
+  // Adds an extra layer of indirection between `Storage` and `StorageImpl` to
+  // simulate COW behavior. No-op if the layer has already been added.
+  void maybe_enable_cow_sim_() {
+    storage_impl_->maybe_enable_cow_sim(group_number_);
+  }
+
+  void increment_group_number_() {
+    group_number_++;
+  }
+
+ private:
+  std::shared_ptr<StorageImpl> storage_impl_;
+  COWSim::TokenType group_number_;
+};
+
+class TensorImpl {
+public:
+  TensorImpl() = default;
+  TensorImpl(Storage storage) : storage_(storage) {}
+  Storage& storage() {
+    return storage_;
+  }
+
+  inline const void* const_data() const {
+    return data_impl<const void>(
+      [this] { return static_cast<const char*>(storage_.data()); });
+  }
+
+  inline void* mutable_data() {
+    return data_impl<void>(
+      [this] { return static_cast<char*>(storage_.mutable_data()); });
+  }
+
+ private:
+  template <typename Void, typename Func>
+  Void* data_impl(const Func& get_data) const {
+    // Note: PyTorch does some checks in here
+    auto* data = get_data();
+    return data;
+  }
+
+  Storage storage_;
+};
+
+namespace torch {
+TensorImpl clone(TensorImpl self) { return TensorImpl(); }
+TensorImpl view(TensorImpl self) { return TensorImpl(self.storage());}
+
+enum ReshapeArgs { View, Copy };
+TensorImpl reshape(TensorImpl self, ReshapeArgs args) {
+  if (args == ReshapeArgs::View) {
+    self.storage().maybe_enable_cow_sim_();
+    TensorImpl res = view(self);
+    res.storage().increment_group_number_();
+    return res;
+  } else {
+    return clone(self);
+  }
+}
+}
+
+// for easy to read examples
+auto tensor() { return TensorImpl(); }
+using torch::view;
+using torch::reshape;
+auto mutates_input(TensorImpl& t) { return t.mutable_data(); }
+auto reads_from_input(TensorImpl& t) {return t.const_data();}
+using torch::ReshapeArgs;
+
+auto example_1() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  mutates_input(a);
+  reads_from_input(b);
+}
+
+auto example_2() {
+  auto a = tensor();
+  auto c = tensor();
+  c.storage() = a.storage();
+  auto b = reshape(a, ReshapeArgs::View);
+  mutates_input(b);
+  reads_from_input(c);
+}
+
+auto example_3() {
+    TensorImpl a;
+    TensorImpl b = view(a);
+    mutates_input(a);
+    mutates_input(b);
+    reads_from_input(a);
+    reads_from_input(b);
+}
+
+auto example_4() {
+  auto a = tensor();
+  auto b = view(a);
+  auto c = reshape(b, ReshapeArgs::View);
+  mutates_input(b);
+  reads_from_input(a);
+}
+
+auto example_5() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  auto c = view(b);
+  mutates_input(b);
+  reads_from_input(c);
+}
+
+auto example_6() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  auto c = view(b);
+  mutates_input(c);
+  reads_from_input(b);
+}
+
+auto example_7() {
+  auto a = tensor();
+  auto b = view(a);
+  auto c = reshape(b, ReshapeArgs::View);
+  mutates_input(a);
+  reads_from_input(b);
+}
+
+using func_t = decltype(&example_1);
+static std::pair<func_t, uint64_t> test_cases[] = {
+    {&example_1, 1},
+    {&example_2, 1},
+    {&example_3, 0},
+    {&example_4, 0},
+    {&example_5, 0},
+    {&example_6, 0},
+    {&example_7, 0},
+};
+
+size_t num_bench_threads() {
+  size_t n = std::thread::hardware_concurrency();
+  return n < 4 ? 4 : n;
+}
+
+// Many threads, each with its own token, all try to be the first writer of
+// the same storage. Exactly one of them should win each round, and every
+// other thread should get exactly one warning.
+void stress_first_writer_wins() {
+  const size_t num_threads = num_bench_threads();
+  const size_t num_rounds = 10000;
+
+  std::vector<StorageImpl> storages(num_rounds);
+  for (auto& storage : storages) {
+    storage.maybe_enable_cow_sim(1);
+  }
+
+  COWSim::reset_warn_counter();
+  COWSim::get_warn_counter().quiet = true;
+  std::atomic<bool> go{false};
+  std::vector<std::thread> threads;
+
+  for (size_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+    threads.emplace_back([&, thread_idx] {
+      COWSim::TokenType token = 100 + thread_idx;
+      while (!go.load(std::memory_order_acquire)) {}
+      for (auto& storage : storages) {
+        storage.mutable_data(token);
+      }
+    });
+  }
+  go = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  COWSim::get_warn_counter().quiet = false;
+
+  uint64_t expected_warns = num_rounds * (num_threads - 1);
+  std::cout << "first writer wins stress test (" << num_threads
+    << " threads, " << num_rounds << " storages)-->";
+  COWSim::check_warn_counter(expected_warns);
+}
+
+// Once the first writer is set, reads and writes from the first writer's
+// group should never take the compare-exchange path. If the fast path has no
+// contention, ns/access should stay about the same as the thread count goes
+// up. Only thread counts up to the number of cores are measured, since
+// otherwise the threads would just be taking turns on the same core.
+void bench_shared_storage_access() {
+  const size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+  const size_t iters = 20'000'000;
+
+  TensorImpl a;
+  a.storage().maybe_enable_cow_sim_();
+  a.mutable_data();
+
+  uint64_t cas_attempts_before = COWSim::first_writer_cas_attempts.load();
+  COWSim::reset_warn_counter();
+
+  std::cout << "\nshared storage access after first write:" << std::endl;
+  for (size_t num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+    std::vector<std::thread> threads;
+    std::vector<double> ns_per_access(num_threads);
+    std::atomic<bool> go{false};
+    std::atomic<uintptr_t> sink_all{0};
+
+    for (size_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+      threads.emplace_back([&, thread_idx] {
+        TensorImpl t = view(a);
+        uintptr_t sink = 0;
+        while (!go.load(std::memory_order_acquire)) {}
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iters; i++) {
+          if ((i & 15) == 0) {
+            sink ^= reinterpret_cast<uintptr_t>(t.mutable_data());
+          } else {
+            sink ^= reinterpret_cast<uintptr_t>(t.const_data());
+          }
+        }
+        auto end = std::chrono::steady_clock::now();
+        ns_per_access[thread_idx] =
+          std::chrono::duration<double, std::nano>(end - start).count() / iters;
+        sink_all.fetch_xor(sink, std::memory_order_relaxed);
+      });
+    }
+    go = true;
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    double avg = 0;
+    for (double ns : ns_per_access) {
+      avg += ns;
+    }
+    avg /= num_threads;
+    std::cout << "  threads: " << num_threads
+      << "  ns/access per thread: " << avg << std::endl;
+  }
+
+  std::cout << "  CAS attempts during benchmark: "
+    << COWSim::first_writer_cas_attempts.load() - cas_attempts_before
+    << std::endl;
+  std::cout << "  warnings during benchmark: "
+    << COWSim::get_warn_counter().count.load() << std::endl;
+}
+
+int main() {
+  auto i = 0;
+  for (auto [func, expected_warns] : test_cases) {
+    ++i;
+    COWSim::get_warn_counter().reset();
+    func();
+    std::cout << "Example " << i << "-->";
+    COWSim::check_warn_counter(expected_warns);
+  }
+
+  std::cout << std::endl;
+  stress_first_writer_wins();
+  bench_shared_storage_access();
+}
@@ -0,0 +1,441 @@
+// Same as main3.cpp, except `StorageImpl`, `Storage`, and `TensorImpl` take a
+// COW simulation policy as a template parameter. In main3.cpp, every call to
+// `StorageImpl::data(token)` and `StorageImpl::mutable_data(token)` goes
+// through `COWChecker::check_on_read`/`check_on_write`, even if
+// `maybe_enable_cow_sim` was never called on that storage.
+//
+// There are three policies:
+//
+//  * `COWSimAlwaysCheck` - the behavior of main3.cpp. The checker runs on
+//    every access.
+//
+//  * `COWSimCheckIfEnabled` - the checker is still there, but the accessors
+//    first check an inline flag, so storages that never had COW simulation
+//    enabled only pay for one predictable branch.
+//
+//  * `COWSimDisabled` - the checker is compiled out. `StorageImpl` doesn't
+//    even have a checker member, and the accessors are just the `DataPtr`
+//    getters, so `TensorImpl::const_data()` is the same pointer chase it would
+//    be without any COW simulation at all.
+//
+// In PyTorch, a build flag would pick the policy, similar to how
+// `DefaultCOWSimPolicy` is chosen below with `-DCOW_SIM_DISABLED`.
+//
+// Build with:
+//   g++ -std=c++17 -O2 main5.cpp -o main5
+
+#include <chrono>
+#include <functional>
+#include <ios>
+#include <memory>
+#include <iostream>
+#include <optional>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+namespace COWSim {
+struct WarnCounter {
+  uint8_t count = 0;
+  void increment() { ++count; }
+  void reset() { count =0; }
+};
+
+WarnCounter &get_warn_counter() {
+  static WarnCounter warn_counter;
+  return warn_counter;
+}
+
+void reset_warn_counter() {
+  get_warn_counter().reset();
+}
+
+void check_warn_counter(uint8_t expected_count) {
+  if (expected_count == get_warn_counter().count) {
+    std::cout << "yay.\n";
+  } else {
+    std::cout << "BOO.\n";
+  }
+}
+
+using TokenType = std::uintptr_t;
+template <typename T> inline TokenType mint_token_for(T *addr) {
+  return reinterpret_cast<TokenType>(addr);
+}
+static constexpr TokenType NullToken{0};
+static const char cow_read_msg[] = "WRITE THEN READ";
+static const char cow_write_msg[] = "WRITE THEN WRITE";
+
+inline bool token_set(TokenType t) { return t != NullToken;}
+
+struct COWChecker {
+  TokenType creator_;
+  std::string note_;
+  TokenType first_writer_;
+  COWChecker() : creator_(NullToken), note_("<info>"), first_writer_(NullToken) {}
+  explicit COWChecker(TokenType createdBy) : creator_(createdBy), note_("<info>"), first_writer_(NullToken) {}
+
+  void check_on_write(TokenType writer) {
+    maybe_warn_on_mismatch(writer, cow_write_msg);
+    maybe_set_first_writer(writer);
+  }
+  void check_on_read(TokenType reader) const {
+    maybe_warn_on_mismatch(reader, cow_read_msg);
+  }
+
+  bool enabled() const {
+    return token_set(creator_);
+  }
+
+  void maybe_warn_on_mismatch(TokenType other, const char *msg) const {
+    if (token_set(creator_)) {
+      if (token_set(first_writer_))
+        if (first_writer_ != other) {
+          get_warn_counter().increment();
+          std::cout << "COW BEHAVIOR WARNING: " << msg << std::endl;
+        }
+    }
+  }
+
+  void maybe_set_first_writer(TokenType other) {
+    if (token_set(creator_)) {
+      if (!token_set(first_writer_)) {
+        first_writer_ = other;
+      }
+    }
+  }
+
+  void maybe_init(TokenType creator) {
+    if(!token_set(creator_)) creator_ = creator;
+  }
+
+};
+
+// Takes the place of `COWChecker` when the simulation is compiled out. It has
+// no members, and `StorageImpl` inherits its checker privately, so the empty
+// base optimization makes it take up no space. With C++20, it could be a
+// `[[no_unique_address]]` member instead.
+struct NoCOWChecker {};
+
+struct COWSimAlwaysCheck {
+  static constexpr bool compiled_in = true;
+  static constexpr bool check_if_enabled = false;
+  using Checker = COWChecker;
+  static constexpr const char* name = "always check";
+};
+
+struct COWSimCheckIfEnabled {
+  static constexpr bool compiled_in = true;
+  static constexpr bool check_if_enabled = true;
+  using Checker = COWChecker;
+  static constexpr const char* name = "check if enabled";
+};
+
+struct COWSimDisabled {
+  static constexpr bool compiled_in = false;
+  static constexpr bool check_if_enabled = false;
+  using Checker = NoCOWChecker;
+  static constexpr const char* name = "compiled out";
+};
+
+#ifdef COW_SIM_DISABLED
+using DefaultCOWSimPolicy = COWSimDisabled;
+#else
+using DefaultCOWSimPolicy = COWSimAlwaysCheck;
+#endif
+
+} // namespace COWSim
+
+static int64_t next_data_ptr_value_ = 1;
+
+class DataPtr {
+ public:
+  DataPtr() : ptr_(reinterpret_cast<void*>(next_data_ptr_value_++)) {}
+
+  void* get() const {
+    return ptr_;
+  }
+
+  void* mutable_get() {
+    return ptr_;
+  }
+
+ private:
+  void* ptr_;
+};
+
+template <typename COWSimPolicy = COWSim::DefaultCOWSimPolicy>
+class StorageImpl : private COWSimPolicy::Checker {
+ public:
+  const void *data(COWSim::TokenType token) const {
+    if constexpr (COWSimPolicy::compiled_in) {
+      if (!COWSimPolicy::check_if_enabled || cow_checker().enabled()) {
+        cow_checker().check_on_read(token);
+      }
+    }
+    return data_ptr_.get();
+  }
+
+  void *mutable_data(COWSim::TokenType token) {
+    if constexpr (COWSimPolicy::compiled_in) {
+      if (!COWSimPolicy::check_if_enabled || cow_checker().enabled()) {
+        cow_checker().check_on_write(token);
+      }
+    }
+    return data_ptr_.mutable_get();
+  }
+
+  void maybe_enable_cow_sim(COWSim::TokenType token) {
+    if constexpr (COWSimPolicy::compiled_in) {
+      cow_checker().maybe_init(token);
+    }
+  }
+
+ private:
+  using Checker = typename COWSimPolicy::Checker;
+
+  Checker& cow_checker() {
+    return *this;
+  }
+
+  const Checker& cow_checker() const {
+    return *this;
+  }
+
+  DataPtr data_ptr_;
+};
+
+static_assert(sizeof(StorageImpl<COWSim::COWSimDisabled>) == sizeof(DataPtr),
+  "the compiled out checker must take no space");
+
+
+template <typename COWSimPolicy = COWSim::DefaultCOWSimPolicy>
+class Storage {
+ public:
+  Storage() : storage_impl_(std::make_shared<StorageImpl<COWSimPolicy>>()), group_number_(1) {}
+  Storage(Storage& other) : storage_impl_(other.storage_impl_), group_number_(other.group_number_) {}
+
+  const void *data() const {
+    return storage_impl_->data(reinterpret_cast<std::uintptr_t>(group_number_));
+  }
+
+  void *mutable_data() const {
+    return storage_impl_->mutable_data(reinterpret_cast<std::uintptr_t>(group_number_));
+  }
+
+  // Adds an extra layer of indirection between `Storage` and `StorageImpl` to
+  // simulate COW behavior. No-op if the layer has already been added, or if
+  // the simulation is compiled out.
+  void maybe_enable_cow_sim_() {
+    storage_impl_->maybe_enable_cow_sim(group_number_);
+  }
+
+  void increment_group_number_() {
+    if constexpr (COWSimPolicy::compiled_in) {
+      group_number_++;
+    }
+  }
+
+ private:
+  std::shared_ptr<StorageImpl<COWSimPolicy>> storage_impl_;
+  COWSim::TokenType group_number_;
+};
+
+template <typename COWSimPolicy = COWSim::DefaultCOWSimPolicy>
+class TensorImpl {
+public:
+  TensorImpl() = default;
+  TensorImpl(Storage<COWSimPolicy> storage) : storage_(storage) {}
+  Storage<COWSimPolicy>& storage() {
+    return storage_;
+  }
+
+  inline const void* const_data() const {
+    return data_impl<const void>(
+      [this] { return static_cast<const char*>(storage_.data()); });
+  }
+
+  inline void* mutable_data() {
+    return data_impl<void>(
+      [this] { return static_cast<char*>(storage_.mutable_data()); });
+  }
+
+ private:
+  template <typename Void, typename Func>
+  Void* data_impl(const Func& get_data) const {
+    // Note: PyTorch does some checks in here
+    auto* data = get_data();
+    return data;
+  }
+
+  Storage<COWSimPolicy> storage_;
+};
+
+namespace torch {
+template <typename P>
+TensorImpl<P> clone(TensorImpl<P> self) { return TensorImpl<P>(); }
+
+template <typename P>
+TensorImpl<P> view(TensorImpl<P> self) { return TensorImpl<P>(self.storage());}
+
+enum ReshapeArgs { View, Copy };
+template <typename P>
+TensorImpl<P> reshape(TensorImpl<P> self, ReshapeArgs args) {
+  if (args == ReshapeArgs::View) {
+    self.storage().maybe_enable_cow_sim_();
+    TensorImpl<P> res = view(self);
+    res.storage().increment_group_number_();
+    return res;
+  } else {
+    return clone(self);
+  }
+}
+}
+
+// for easy to read examples
+template <typename P>
+auto tensor() { return TensorImpl<P>(); }
+using torch::view;
+using torch::reshape;
+template <typename P>
+auto mutates_input(TensorImpl<P>& t) { return t.mutable_data(); }
+template <typename P>
+auto reads_from_input(TensorImpl<P>& t) {return t.const_data();}
+using torch::ReshapeArgs;
+
+template <typename P>
+void example_1() {
+  auto a = tensor<P>();
+  auto b = reshape(a, ReshapeArgs::View);
+  mutates_input(a);
+  reads_from_input(b);
+}
+
+template <typename P>
+void example_2() {
+  auto a = tensor<P>();
+  auto c = tensor<P>();
+  c.storage() = a.storage();
+  auto b = reshape(a, ReshapeArgs::View);
+  mutates_input(b);
+  reads_from_input(c);
+}
+
+template <typename P>
+void example_3() {
+    TensorImpl<P> a;
+    TensorImpl<P> b = view(a);
+    mutates_input(a);
+    mutates_input(b);
+    reads_from_input(a);
+    reads_from_input(b);
+}
+
+template <typename P>
+void example_4() {
+  auto a = tensor<P>();
+  auto b = view(a);
+  auto c = reshape(b, ReshapeArgs::View);
+  mutates_input(b);
+  reads_from_input(a);
+}
+
+template <typename P>
+void example_5() {
+  auto a = tensor<P>();
+  auto b = reshape(a, ReshapeArgs::View);
+  auto c = view(b);
+  mutates_input(b);
+  reads_from_input(c);
+}
+
+template <typename P>
+void example_6() {
+  auto a = tensor<P>();
+  auto b = reshape(a, ReshapeArgs::View);
+  auto c = view(b);
+  mutates_input(c);
+  reads_from_input(b);
+}
+
+template <typename P>
+void example_7() {
+  auto a = tensor<P>();
+  auto b = view(a);
+  auto c = reshape(b, ReshapeArgs::View);
+  mutates_input(a);
+  reads_from_input(b);
+}
+
+using func_t = void (*)();
+
+// `expected_warns` is for the policies that have the checker compiled in. If
+// the checker is compiled out, there should never be any warnings.
+template <typename P>
+void run_examples() {
+  std::pair<func_t, uint8_t> test_cases[] = {
+      {&example_1<P>, 1},
+      {&example_2<P>, 1},
+      {&example_3<P>, 0},
+      {&example_4<P>, 0},
+      {&example_5<P>, 0},
+      {&example_6<P>, 0},
+      {&example_7<P>, 0},
+  };
+  std::cout << "policy: " << P::name << std::endl;
+  auto i = 0;
+  for (auto [func, expected_warns] : test_cases) {
+    ++i;
+    COWSim::get_warn_counter().reset();
+    func();
+    std::cout << "Example " << i << "-->";
+    COWSim::check_warn_counter(P::compiled_in ? expected_warns : 0);
+  }
+  std::cout << std::endl;
+}
+
+// Stops the compiler from hoisting the data pointer out of the benchmark loop
+template <typename T>
+inline void do_not_optimize(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Reads from a tensor that never had COW simulation enabled, and from one
+// that is a reshape view of another tensor.
+template <typename P>
+void bench_policy() {
+  const size_t iters = 50'000'000;
+
+  TensorImpl<P> plain;
+  TensorImpl<P> base;
+  TensorImpl<P> cow_view = reshape(base, ReshapeArgs::View);
+  cow_view.mutable_data();
+
+  auto time_reads = [&](TensorImpl<P>& t) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iters; i++) {
+      do_not_optimize(t.const_data());
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / iters;
+  };
+
+  double plain_ns = time_reads(plain);
+  double cow_ns = time_reads(cow_view);
+
+  std::cout << "  " << P::name
+    << "\tsizeof(StorageImpl): " << sizeof(StorageImpl<P>)
+    << "\tns/access (no COW sim): " << plain_ns
+    << "\tns/access (COW sim enabled): " << cow_ns << std::endl;
+}
+
+int main() {
+  run_examples<COWSim::COWSimAlwaysCheck>();
+  run_examples<COWSim::COWSimCheckIfEnabled>();
+  run_examples<COWSim::COWSimDisabled>();
+
+  std::cout << "const_data() benchmark:" << std::endl;
+  bench_policy<COWSim::COWSimAlwaysCheck>();
+  bench_policy<COWSim::COWSimCheckIfEnabled>();
+  bench_policy<COWSim::COWSimDisabled>();
+}
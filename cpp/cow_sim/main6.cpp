@@ -0,0 +1,394 @@
+// Same idea as main1.cpp, but `StorageCOWSim` actually does copy-on-write
+// instead of just printing a line in `maybe_simulate_cow_materialize()`.
+//
+// `StorageImpl` now owns a real buffer. A lazy clone makes a new
+// `StorageCOWSim` that points at the same `StorageImpl` as the original, so no
+// data is copied. Every `Storage` that is part of the lazy clone goes through
+// a `StorageCOWSim`, and plain views share the `StorageCOWSim` of the tensor
+// they view, the same way they would share a `StorageImpl` normally.
+//
+// On the first `mutable_data()` call, a `StorageCOWSim` checks whether any
+// other `StorageCOWSim` still shares its `StorageImpl`. If so, it clones the
+// buffer into a new `StorageImpl` that only it owns. Since views share the
+// `StorageCOWSim`, they all see the new buffer. The last `StorageCOWSim`
+// left pointing at a buffer just writes to it in place.
+//
+// `torch::reshape(..., ReshapeArgs::View)` gives a lazy clone, so it has no
+// upfront copy. The `COWStats` counters keep track of how many bytes were
+// shared by lazy clones and how many of those ended up being copied anyway.
+//
+// Note that using `shared_ptr::use_count()` to decide whether to copy is only
+// correct if no other thread is creating or dropping references to the same
+// `StorageImpl` at the same time. PyTorch would need a real atomic protocol
+// for that.
+//
+// Build with:
+//   g++ -std=c++17 -O2 main6.cpp -o main6
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <iostream>
+#include <variant>
+#include <vector>
+
+namespace COWSim {
+struct COWStats {
+  // Bytes that lazy clones shared instead of copying up front
+  size_t bytes_shared = 0;
+  // Bytes that were copied later because someone wrote to a shared buffer
+  size_t bytes_materialized = 0;
+  size_t num_lazy_clones = 0;
+  size_t num_materializations = 0;
+
+  size_t bytes_avoided() const {
+    return bytes_shared - bytes_materialized;
+  }
+
+  void reset() {
+    *this = COWStats();
+  }
+};
+
+COWStats& get_cow_stats() {
+  static COWStats cow_stats;
+  return cow_stats;
+}
+} // namespace COWSim
+
+class DataPtr {
+ public:
+  DataPtr(size_t nbytes)
+    : ptr_(new char[nbytes]()) {}
+
+  DataPtr(const DataPtr& other, size_t nbytes)
+    : ptr_(new char[nbytes]) {
+    std::memcpy(ptr_.get(), other.ptr_.get(), nbytes);
+  }
+
+  void* get() const {
+    return ptr_.get();
+  }
+
+  void* mutable_get() {
+    return ptr_.get();
+  }
+
+ private:
+  std::unique_ptr<char[]> ptr_;
+};
+
+class StorageImpl {
+ public:
+  StorageImpl(size_t nbytes)
+    : nbytes_(nbytes), data_ptr_(nbytes) {}
+
+  // Deep copy of the buffer
+  StorageImpl(const StorageImpl& other)
+    : nbytes_(other.nbytes_), data_ptr_(other.data_ptr_, other.nbytes_) {}
+
+  const void* data() const {
+    return data_ptr_.get();
+  }
+
+  void* mutable_data() {
+    return data_ptr_.mutable_get();
+  }
+
+  size_t nbytes() const {
+    return nbytes_;
+  }
+
+ private:
+  size_t nbytes_;
+  DataPtr data_ptr_;
+};
+
+// This class is optionally inserted as an extra layer of indirection between a
+// `Storage` and the `StorageImpl` that it points to. Each `StorageCOWSim` is
+// one of the outputs of a lazy clone. Many `StorageCOWSim`s can point to the
+// same `StorageImpl` until one of them is written to.
+class StorageCOWSim {
+ public:
+  StorageCOWSim(std::shared_ptr<StorageImpl> storage_impl)
+    : storage_impl_(std::move(storage_impl)) {}
+
+  const void* data() const {
+    return storage_impl_->data();
+  }
+
+  void* mutable_data() {
+    maybe_materialize();
+    return storage_impl_->mutable_data();
+  }
+
+  size_t nbytes() const {
+    return storage_impl_->nbytes();
+  }
+
+  // Makes another `StorageCOWSim` that shares this one's buffer
+  std::shared_ptr<StorageCOWSim> lazy_clone() const {
+    auto& stats = COWSim::get_cow_stats();
+    stats.bytes_shared += storage_impl_->nbytes();
+    stats.num_lazy_clones++;
+    return std::make_shared<StorageCOWSim>(storage_impl_);
+  }
+
+ private:
+
+  // If any other `StorageCOWSim` still points at our `StorageImpl`, we have to
+  // copy the buffer before writing to it. Otherwise we own it and can write
+  // in place.
+  void maybe_materialize() {
+    if (storage_impl_.use_count() > 1) {
+      auto& stats = COWSim::get_cow_stats();
+      stats.bytes_materialized += storage_impl_->nbytes();
+      stats.num_materializations++;
+      storage_impl_ = std::make_shared<StorageImpl>(*storage_impl_);
+    }
+  }
+
+  // Note that PyTorch uses `intrusive_ptr`, but we're using `std::shared_ptr`
+  // in this example just to keep it lightweight.
+  std::shared_ptr<StorageImpl> storage_impl_;
+};
+
+template<class... Ts>
+struct overloaded : Ts... { using Ts::operator()...; };
+
+template<class... Ts>
+overloaded(Ts...) -> overloaded<Ts...>;
+
+// This function is taken from: https://gist.github.com/s3rvac/d1f30364ce1f732d75ef0c89a1c8c1ef
+template<typename Variant, typename... Alternatives>
+decltype(auto) visit_variant(Variant&& variant, Alternatives&&... alternatives) {
+  return std::visit(
+    overloaded{std::forward<Alternatives>(alternatives)...},
+    std::forward<Variant>(variant)
+  );
+}
+
+using storage_impl_ptr_variant_t = std::variant<
+  std::shared_ptr<StorageImpl>,
+  std::shared_ptr<StorageCOWSim>>;
+
+class Storage {
+ public:
+  Storage(size_t nbytes) : storage_impl_(std::make_shared<StorageImpl>(nbytes)) {}
+
+  const void* data() const {
+    return visit_variant(storage_impl_,
+      [](const std::shared_ptr<StorageImpl>& storage_impl) {
+        return storage_impl->data();
+      },
+      [](const std::shared_ptr<StorageCOWSim>& storage_impl) {
+        return storage_impl->data();
+      }
+    );
+  }
+
+  void* mutable_data() const {
+    return visit_variant(storage_impl_,
+      [](const std::shared_ptr<StorageImpl>& storage_impl) {
+        return storage_impl->mutable_data();
+      },
+      [](const std::shared_ptr<StorageCOWSim>& storage_impl) {
+        return storage_impl->mutable_data();
+      }
+    );
+  }
+
+  size_t nbytes() const {
+    return visit_variant(storage_impl_,
+      [](const std::shared_ptr<StorageImpl>& storage_impl) {
+        return storage_impl->nbytes();
+      },
+      [](const std::shared_ptr<StorageCOWSim>& storage_impl) {
+        return storage_impl->nbytes();
+      }
+    );
+  }
+
+  // Adds an extra layer of indirection between `Storage` and `StorageImpl` to
+  // simulate COW behavior. No-op if the layer has already been added.
+  //
+  // Note that this only changes this `Storage`. Any other `Storage` that is
+  // already sharing the `StorageImpl` without a `StorageCOWSim` would not be
+  // protected from writes. In PyTorch, the `Storage` is shared by all the
+  // views of a tensor, so that isn't a problem there.
+  void maybe_enable_cow_sim_() {
+    visit_variant(storage_impl_,
+      [&](const std::shared_ptr<StorageImpl>& storage_impl) {
+        storage_impl_ = std::make_shared<StorageCOWSim>(storage_impl);
+      },
+      [](const std::shared_ptr<StorageCOWSim>&) {}
+    );
+  }
+
+  // Returns a new `Storage` that shares this one's buffer until one of them is
+  // written to.
+  Storage lazy_clone() {
+    maybe_enable_cow_sim_();
+    return Storage(std::get<std::shared_ptr<StorageCOWSim>>(storage_impl_)->lazy_clone());
+  }
+
+ private:
+  Storage(std::shared_ptr<StorageCOWSim> storage_impl)
+    : storage_impl_(std::move(storage_impl)) {}
+
+  storage_impl_ptr_variant_t storage_impl_;
+};
+
+
+class TensorImpl {
+ public:
+  TensorImpl(size_t nbytes) : storage_(std::make_shared<Storage>(nbytes)) {}
+  TensorImpl(std::shared_ptr<Storage> storage) : storage_(std::move(storage)) {}
+
+  // Views share the same `Storage`, like they share the same
+  // `c10::Storage` in PyTorch
+  const std::shared_ptr<Storage>& storage() const {
+    return storage_;
+  }
+
+  inline const void* const_data() const {
+    return data_impl<const void>(
+      [this] { return static_cast<const char*>(storage_->data()); });
+  }
+
+  inline void* mutable_data() {
+    return data_impl<void>(
+      [this] { return static_cast<char*>(storage_->mutable_data()); });
+  }
+
+ private:
+  template <typename Void, typename Func>
+  Void* data_impl(const Func& get_data) const {
+    // Note: PyTorch does some checks in here
+    auto* data = get_data();
+    return data;
+  }
+
+  std::shared_ptr<Storage> storage_;
+};
+
+namespace torch {
+TensorImpl clone(const TensorImpl& self) {
+  size_t nbytes = self.storage()->nbytes();
+  TensorImpl res(nbytes);
+  std::memcpy(res.mutable_data(), self.const_data(), nbytes);
+  return res;
+}
+
+TensorImpl view(const TensorImpl& self) {
+  return TensorImpl(self.storage());
+}
+
+enum ReshapeArgs { View, Copy };
+// Instead of a view, the view branch of reshape gives a lazy clone
+TensorImpl reshape(const TensorImpl& self, ReshapeArgs args) {
+  if (args == ReshapeArgs::View) {
+    return TensorImpl(std::make_shared<Storage>(self.storage()->lazy_clone()));
+  } else {
+    return clone(self);
+  }
+}
+}
+
+using torch::ReshapeArgs;
+
+void check(bool cond, const char* msg) {
+  std::cout << (cond ? "yay. " : "BOO. ") << msg << std::endl;
+}
+
+int& first_int(TensorImpl& t) {
+  return *static_cast<int*>(t.mutable_data());
+}
+
+int first_int_const(const TensorImpl& t) {
+  return *static_cast<const int*>(t.const_data());
+}
+
+void examples() {
+  COWSim::get_cow_stats().reset();
+
+  TensorImpl a(1024);
+  first_int(a) = 1;
+  TensorImpl b = torch::reshape(a, ReshapeArgs::View);
+  TensorImpl c = torch::view(b);
+
+  check(a.const_data() == b.const_data(), "lazy clone shares the buffer");
+  check(COWSim::get_cow_stats().bytes_materialized == 0, "no upfront copy");
+
+  first_int(b) = 2;
+  check(a.const_data() != b.const_data(), "write to lazy clone materializes");
+  check(b.const_data() == c.const_data(), "view of lazy clone sees the new buffer");
+  check(first_int_const(a) == 1, "original is unchanged");
+  check(first_int_const(c) == 2, "view of lazy clone sees the write");
+
+  const void* a_data = a.const_data();
+  first_int(a) = 3;
+  check(a.const_data() == a_data, "last owner writes in place");
+  check(COWSim::get_cow_stats().num_materializations == 1, "only one materialization");
+  std::cout << std::endl;
+}
+
+// Simulates a workload that makes lots of reshape views of a big tensor but
+// only writes to a few of them
+void bench_reshape_workload() {
+  const size_t nbytes = 1 << 18;
+  const size_t num_reshapes = 500;
+  const size_t write_every = 10;
+
+  COWSim::get_cow_stats().reset();
+
+  auto start = std::chrono::steady_clock::now();
+  TensorImpl a(nbytes);
+  std::vector<TensorImpl> reshapes;
+  reshapes.reserve(num_reshapes);
+  for (size_t i = 0; i < num_reshapes; i++) {
+    reshapes.push_back(torch::reshape(a, ReshapeArgs::View));
+  }
+  size_t sum = 0;
+  for (size_t i = 0; i < num_reshapes; i++) {
+    sum += first_int_const(reshapes[i]);
+    if (i % write_every == 0) {
+      first_int(reshapes[i]) = i;
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  double lazy_ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+  // Same thing, but each reshape eagerly copies
+  start = std::chrono::steady_clock::now();
+  std::vector<TensorImpl> copies;
+  copies.reserve(num_reshapes);
+  for (size_t i = 0; i < num_reshapes; i++) {
+    copies.push_back(torch::reshape(a, ReshapeArgs::Copy));
+  }
+  for (size_t i = 0; i < num_reshapes; i++) {
+    sum += first_int_const(copies[i]);
+    if (i % write_every == 0) {
+      first_int(copies[i]) = i;
+    }
+  }
+  end = std::chrono::steady_clock::now();
+  double eager_ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+  auto& stats = COWSim::get_cow_stats();
+  std::cout << "reshape workload (" << num_reshapes << " reshapes of "
+    << nbytes << " bytes, write to 1 in " << write_every << "):" << std::endl;
+  std::cout << "  lazy clones:          " << stats.num_lazy_clones << std::endl;
+  std::cout << "  materializations:     " << stats.num_materializations << std::endl;
+  std::cout << "  bytes shared:         " << stats.bytes_shared << std::endl;
+  std::cout << "  bytes materialized:   " << stats.bytes_materialized << std::endl;
+  std::cout << "  bytes avoided:        " << stats.bytes_avoided() << std::endl;
+  std::cout << "  lazy clone time (ms): " << lazy_ms << std::endl;
+  std::cout << "  eager copy time (ms): " << eager_ms << std::endl;
+  std::cout << "  (checksum " << sum << ")" << std::endl;
+}
+
+int main() {
+  examples();
+  bench_reshape_workload();
+}
@@ -0,0 +1,353 @@
+// In main1.cpp, `Storage` holds a
+// `std::variant<shared_ptr<StorageImpl>, shared_ptr<StorageCOWSim>>`, and every
+// accessor goes through `visit_variant` with lambdas that take the
+// `shared_ptr` by value. So every `data()` call does an atomic refcount
+// increment and decrement, on top of the variant dispatch.
+//
+// This example compares that with a `Storage` that holds a single tagged
+// pointer instead. `StorageImpl` and `StorageCOWSim` are both at least 2 byte
+// aligned, so the lowest bit of the pointer is always 0, and we can use it to
+// flag whether the pointer is to a `StorageCOWSim`. The accessors just mask
+// off the tag and branch on it, without any virtual calls and without touching
+// any refcounts.
+//
+// To be able to own the object through a tagged pointer, the refcount has to
+// live inside the object, like it does with `intrusive_ptr` in PyTorch. So
+// both `StorageImpl` and `StorageCOWSim` have an embedded atomic refcount
+// here. The refcount is only touched when a `Storage` is copied or destroyed.
+//
+// Build with:
+//   g++ -std=c++17 -O2 -pthread main7.cpp -o main7
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <iostream>
+#include <utility>
+#include <variant>
+
+static int64_t next_data_ptr_value_ = 1;
+
+class DataPtr {
+ public:
+  DataPtr() : ptr_(reinterpret_cast<void*>(next_data_ptr_value_++)) {}
+
+  void* get() const {
+    return ptr_;
+  }
+
+  void* mutable_get() {
+    return ptr_;
+  }
+
+ private:
+  void* ptr_;
+};
+
+// Embedded refcount, so that an object can be owned through a raw (or tagged)
+// pointer. This is a stripped down version of `c10::intrusive_ptr_target`.
+class Refcounted {
+ public:
+  void incref() const {
+    refcount_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Returns true if this was the last reference
+  bool decref() const {
+    return refcount_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+  }
+
+ private:
+  mutable std::atomic<size_t> refcount_{1};
+};
+
+class StorageImpl : public Refcounted {
+ public:
+  const void* data() const {
+    return data_ptr_.get();
+  }
+
+  void* mutable_data() {
+    return data_ptr_.mutable_get();
+  }
+
+ private:
+  DataPtr data_ptr_;
+};
+
+// Used by the variant based `Storage`, same as main1.cpp but without the print
+class StorageCOWSim {
+ public:
+  StorageCOWSim(std::shared_ptr<StorageImpl> storage_impl)
+    : storage_impl_(storage_impl) {}
+
+  const void* data() const {
+    return storage_impl_->data();
+  }
+
+  void* mutable_data() {
+    maybe_simulate_cow_materialize();
+    return storage_impl_->mutable_data();
+  }
+
+  uint64_t num_writes() const {
+    return num_writes_;
+  }
+
+ private:
+
+  void maybe_simulate_cow_materialize() {
+    num_writes_++;
+  }
+
+  std::shared_ptr<StorageImpl> storage_impl_;
+  uint64_t num_writes_ = 0;
+};
+
+template<class... Ts>
+struct overloaded : Ts... { using Ts::operator()...; };
+
+template<class... Ts>
+overloaded(Ts...) -> overloaded<Ts...>;
+
+// This function is taken from: https://gist.github.com/s3rvac/d1f30364ce1f732d75ef0c89a1c8c1ef
+template<typename Variant, typename... Alternatives>
+decltype(auto) visit_variant(Variant&& variant, Alternatives&&... alternatives) {
+  return std::visit(
+    overloaded{std::forward<Alternatives>(alternatives)...},
+    std::forward<Variant>(variant)
+  );
+}
+
+using storage_impl_ptr_variant_t = std::variant<
+  std::shared_ptr<StorageImpl>,
+  std::shared_ptr<StorageCOWSim>>;
+
+// The `Storage` from main1.cpp, without the prints
+class VariantStorage {
+ public:
+  VariantStorage() : storage_impl_(std::make_shared<StorageImpl>()) {}
+
+  const void* data() const {
+    return visit_variant(storage_impl_,
+      [](std::shared_ptr<StorageImpl> storage_impl) {
+        return storage_impl->data();
+      },
+      [](std::shared_ptr<StorageCOWSim> storage_impl) {
+        return storage_impl->data();
+      }
+    );
+  }
+
+  void* mutable_data() const {
+    return visit_variant(storage_impl_,
+      [](std::shared_ptr<StorageImpl> storage_impl) {
+        return storage_impl->mutable_data();
+      },
+      [](std::shared_ptr<StorageCOWSim> storage_impl) {
+        return storage_impl->mutable_data();
+      }
+    );
+  }
+
+  void maybe_enable_cow_sim_() {
+    visit_variant(storage_impl_,
+      [&](std::shared_ptr<StorageImpl> storage_impl) {
+        storage_impl_ = std::make_shared<StorageCOWSim>(storage_impl);
+      },
+      [](std::shared_ptr<StorageCOWSim>) {}
+    );
+  }
+
+ private:
+  storage_impl_ptr_variant_t storage_impl_;
+};
+
+// Same as `StorageCOWSim`, but it owns its `StorageImpl` through the embedded
+// refcount instead of a `shared_ptr`
+class TaggedStorageCOWSim : public Refcounted {
+ public:
+  // Takes over one reference to `storage_impl`
+  TaggedStorageCOWSim(StorageImpl* storage_impl)
+    : storage_impl_(storage_impl) {}
+
+  ~TaggedStorageCOWSim() {
+    if (storage_impl_->decref()) {
+      delete storage_impl_;
+    }
+  }
+
+  const void* data() const {
+    return storage_impl_->data();
+  }
+
+  void* mutable_data() {
+    maybe_simulate_cow_materialize();
+    return storage_impl_->mutable_data();
+  }
+
+  uint64_t num_writes() const {
+    return num_writes_;
+  }
+
+ private:
+
+  void maybe_simulate_cow_materialize() {
+    num_writes_++;
+  }
+
+  StorageImpl* storage_impl_;
+  uint64_t num_writes_ = 0;
+};
+
+static_assert(alignof(StorageImpl) >= 2, "need a free low bit for the tag");
+static_assert(alignof(TaggedStorageCOWSim) >= 2, "need a free low bit for the tag");
+
+class TaggedStorage {
+ public:
+  TaggedStorage() : bits_(reinterpret_cast<uintptr_t>(new StorageImpl())) {}
+
+  TaggedStorage(const TaggedStorage& other) : bits_(other.bits_) {
+    incref();
+  }
+
+  TaggedStorage(TaggedStorage&& other) noexcept : bits_(std::exchange(other.bits_, 0)) {}
+
+  TaggedStorage& operator=(TaggedStorage other) noexcept {
+    std::swap(bits_, other.bits_);
+    return *this;
+  }
+
+  ~TaggedStorage() {
+    decref();
+  }
+
+  const void* data() const {
+    if (is_cow_sim()) {
+      return cow_sim()->data();
+    }
+    return storage_impl()->data();
+  }
+
+  void* mutable_data() const {
+    if (is_cow_sim()) {
+      return cow_sim()->mutable_data();
+    }
+    return storage_impl()->mutable_data();
+  }
+
+  // Adds an extra layer of indirection between `Storage` and `StorageImpl` to
+  // simulate COW behavior. No-op if the layer has already been added.
+  void maybe_enable_cow_sim_() {
+    if (!is_cow_sim()) {
+      // The new `TaggedStorageCOWSim` takes over our reference
+      auto* cow_sim = new TaggedStorageCOWSim(storage_impl());
+      bits_ = reinterpret_cast<uintptr_t>(cow_sim) | kCOWSimTag;
+    }
+  }
+
+  bool is_cow_sim() const {
+    return bits_ & kCOWSimTag;
+  }
+
+ private:
+  static constexpr uintptr_t kCOWSimTag = 1;
+
+  StorageImpl* storage_impl() const {
+    return reinterpret_cast<StorageImpl*>(bits_);
+  }
+
+  TaggedStorageCOWSim* cow_sim() const {
+    return reinterpret_cast<TaggedStorageCOWSim*>(bits_ & ~kCOWSimTag);
+  }
+
+  const Refcounted* target() const {
+    if (is_cow_sim()) {
+      return cow_sim();
+    }
+    return storage_impl();
+  }
+
+  void incref() const {
+    if (bits_) {
+      target()->incref();
+    }
+  }
+
+  void decref() {
+    if (!bits_) {
+      return;
+    }
+    if (is_cow_sim()) {
+      if (cow_sim()->decref()) {
+        delete cow_sim();
+      }
+    } else {
+      if (storage_impl()->decref()) {
+        delete storage_impl();
+      }
+    }
+    bits_ = 0;
+  }
+
+  uintptr_t bits_;
+};
+
+// Stops the compiler from hoisting the data pointer out of the benchmark loop
+template <typename T>
+inline void do_not_optimize(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+template <typename StorageT>
+double time_accesses(const StorageT& storage, size_t iters) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iters; i++) {
+    if ((i & 7) == 0) {
+      do_not_optimize(storage.mutable_data());
+    } else {
+      do_not_optimize(storage.data());
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / iters;
+}
+
+template <typename StorageT>
+void bench(const char* name) {
+  const size_t iters = 20'000'000;
+  StorageT plain;
+  StorageT cow;
+  cow.maybe_enable_cow_sim_();
+  // Copies mean the refcount is shared, like it would be with real views
+  StorageT cow_copy = cow;
+
+  std::cout << "  " << name << "\tsizeof: " << sizeof(StorageT)
+    << "\tns/access (StorageImpl): " << time_accesses(plain, iters)
+    << "\tns/access (StorageCOWSim): " << time_accesses(cow_copy, iters)
+    << std::endl;
+}
+
+void check(bool cond, const char* msg) {
+  std::cout << (cond ? "yay. " : "BOO. ") << msg << std::endl;
+}
+
+int main() {
+  TaggedStorage a;
+  const void* a_data = a.data();
+  check(!a.is_cow_sim(), "starts as a plain StorageImpl");
+  TaggedStorage b = a;
+  a.maybe_enable_cow_sim_();
+  a.maybe_enable_cow_sim_();
+  check(a.is_cow_sim(), "tag is set after enabling COW sim");
+  check(!b.is_cow_sim(), "copy made before enabling is untouched");
+  check(a.data() == a_data && b.data() == a_data, "both point at the same data");
+  TaggedStorage c = a;
+  check(c.is_cow_sim() && c.mutable_data() == a_data, "copy keeps the tag");
+  std::cout << std::endl;
+
+  std::cout << "Storage::data()/mutable_data() benchmark:" << std::endl;
+  bench<VariantStorage>("variant");
+  bench<TaggedStorage>("tagged");
+}
@@ -0,0 +1,394 @@
+// All the other examples use `std::shared_ptr<StorageImpl>` to keep things
+// lightweight, even though PyTorch uses `intrusive_ptr`. But that difference
+// matters for performance. `std::make_shared` puts the refcount and weak count
+// in a control block next to the object, and `std::shared_ptr<T>(new T)` puts
+// the control block in a separate allocation. In the second case, creating a
+// view touches the control block and then the `StorageImpl` itself, which can
+// be two cache misses instead of one.
+//
+// This example adds a minimal `intrusive_ptr`, where the refcount lives inside
+// `StorageImpl`. Like `c10::intrusive_ptr_target`, a target can optionally have
+// a weak count too. If it does, `weak_intrusive_ptr` can point at it.
+//
+// `Storage` from main3.cpp is templated on how it owns its `StorageImpl`, and
+// the benchmark compares view creation throughput and memory per storage for:
+//
+//  * `std::shared_ptr` made with `std::make_shared`
+//  * `std::shared_ptr` made with `new`
+//  * `intrusive_ptr` with only a strong refcount
+//  * `intrusive_ptr` with a strong and weak refcount
+//
+// Build with:
+//   g++ -std=c++17 -O2 -pthread main8.cpp -o main8
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <iostream>
+#include <new>
+#include <numeric>
+#include <random>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Counts how many bytes are requested from `operator new`, so we can measure
+// memory per storage
+static size_t num_allocated_bytes = 0;
+static size_t num_allocations = 0;
+
+void* operator new(size_t size) {
+  num_allocated_bytes += size;
+  num_allocations++;
+  if (void* ptr = std::malloc(size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept {
+  std::free(ptr);
+}
+
+namespace c10 {
+
+// Target that only has a strong refcount
+class intrusive_ptr_target {
+ protected:
+  intrusive_ptr_target() : refcount_(0) {}
+
+  // Called when the last strong reference goes away. For targets with a weak
+  // count, the object itself may still need to stay alive after this, so this
+  // is where resources like the data buffer would be freed.
+  virtual void release_resources() {}
+
+ public:
+  virtual ~intrusive_ptr_target() = default;
+
+ private:
+  template <typename T>
+  friend class intrusive_ptr;
+  template <typename T>
+  friend class weak_intrusive_ptr;
+
+  mutable std::atomic<uint32_t> refcount_;
+};
+
+// Target that has a strong refcount and a weak count. Like in c10, all the
+// strong references together hold one weak reference, so the object is only
+// deleted once the strong refcount is 0 and there are no weak references
+// left.
+class weak_intrusive_ptr_target : public intrusive_ptr_target {
+ protected:
+  weak_intrusive_ptr_target() : weakcount_(1) {}
+
+ private:
+  template <typename T>
+  friend class intrusive_ptr;
+  template <typename T>
+  friend class weak_intrusive_ptr;
+
+  mutable std::atomic<uint32_t> weakcount_;
+};
+
+template <typename T>
+class intrusive_ptr {
+  static_assert(std::is_base_of_v<intrusive_ptr_target, T>,
+    "intrusive_ptr can only point to an intrusive_ptr_target");
+  static constexpr bool has_weakcount = std::is_base_of_v<weak_intrusive_ptr_target, T>;
+
+ public:
+  intrusive_ptr() : target_(nullptr) {}
+
+  // Takes ownership of a newly created object
+  explicit intrusive_ptr(T* target) : target_(target) {
+    if (target_) {
+      target_->refcount_.store(1, std::memory_order_relaxed);
+    }
+  }
+
+  intrusive_ptr(const intrusive_ptr& other) : target_(other.target_) {
+    if (target_) {
+      target_->refcount_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  intrusive_ptr(intrusive_ptr&& other) noexcept
+    : target_(std::exchange(other.target_, nullptr)) {}
+
+  intrusive_ptr& operator=(intrusive_ptr other) noexcept {
+    std::swap(target_, other.target_);
+    return *this;
+  }
+
+  ~intrusive_ptr() {
+    reset();
+  }
+
+  void reset() {
+    if (target_ && target_->refcount_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      if constexpr (has_weakcount) {
+        static_cast<intrusive_ptr_target*>(target_)->release_resources();
+        if (target_->weakcount_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          delete target_;
+        }
+      } else {
+        delete target_;
+      }
+    }
+    target_ = nullptr;
+  }
+
+  T* get() const {
+    return target_;
+  }
+
+  T* operator->() const {
+    return target_;
+  }
+
+  T& operator*() const {
+    return *target_;
+  }
+
+  uint32_t use_count() const {
+    return target_ ? target_->refcount_.load(std::memory_order_relaxed) : 0;
+  }
+
+ private:
+  template <typename U>
+  friend class weak_intrusive_ptr;
+
+  // Used by `weak_intrusive_ptr::lock()`, which already did the incref
+  struct already_increfed_t {};
+  intrusive_ptr(T* target, already_increfed_t) : target_(target) {}
+
+  T* target_;
+};
+
+template <typename T>
+class weak_intrusive_ptr {
+  static_assert(std::is_base_of_v<weak_intrusive_ptr_target, T>,
+    "weak_intrusive_ptr can only point to a weak_intrusive_ptr_target");
+
+ public:
+  explicit weak_intrusive_ptr(const intrusive_ptr<T>& ptr) : target_(ptr.get()) {
+    if (target_) {
+      target_->weakcount_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  weak_intrusive_ptr(const weak_intrusive_ptr&) = delete;
+  weak_intrusive_ptr& operator=(const weak_intrusive_ptr&) = delete;
+
+  ~weak_intrusive_ptr() {
+    if (target_ && target_->weakcount_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete target_;
+    }
+  }
+
+  // Returns a strong reference if the object hasn't been released yet
+  intrusive_ptr<T> lock() const {
+    if (!target_) {
+      return intrusive_ptr<T>();
+    }
+    uint32_t refcount = target_->refcount_.load(std::memory_order_relaxed);
+    while (refcount != 0) {
+      if (target_->refcount_.compare_exchange_weak(
+            refcount, refcount + 1,
+            std::memory_order_acquire, std::memory_order_relaxed)) {
+        return intrusive_ptr<T>(target_, typename intrusive_ptr<T>::already_increfed_t());
+      }
+    }
+    return intrusive_ptr<T>();
+  }
+
+ private:
+  T* target_;
+};
+
+template <typename T, typename... Args>
+intrusive_ptr<T> make_intrusive(Args&&... args) {
+  return intrusive_ptr<T>(new T(std::forward<Args>(args)...));
+}
+
+} // namespace c10
+
+namespace COWSim {
+using TokenType = std::uintptr_t;
+static constexpr TokenType NullToken{0};
+
+inline bool token_set(TokenType t) { return t != NullToken;}
+
+// Same fields as the `COWChecker` in main3.cpp, so that the size of
+// `StorageImpl` is realistic. The warning logic isn't needed here.
+struct COWChecker {
+  TokenType creator_;
+  std::string note_;
+  TokenType first_writer_;
+  COWChecker() : creator_(NullToken), note_("<info>"), first_writer_(NullToken) {}
+
+  void check_on_read(TokenType) const {}
+};
+} // namespace COWSim
+
+static int64_t next_data_ptr_value_ = 1;
+
+class DataPtr {
+ public:
+  DataPtr() : ptr_(reinterpret_cast<void*>(next_data_ptr_value_++)) {}
+
+  void* get() const {
+    return ptr_;
+  }
+
+ private:
+  void* ptr_;
+};
+
+class StorageImpl {
+ public:
+  const void *data(COWSim::TokenType token) const {
+    cow_checker_.check_on_read(token);
+    return data_ptr_.get();
+  }
+
+ private:
+  DataPtr data_ptr_;
+  COWSim::COWChecker cow_checker_;
+};
+
+class IntrusiveStorageImpl : public c10::intrusive_ptr_target, public StorageImpl {};
+
+class WeakIntrusiveStorageImpl : public c10::weak_intrusive_ptr_target, public StorageImpl {
+ public:
+  bool resources_released() const {
+    return resources_released_;
+  }
+
+ private:
+  // In PyTorch, this is where the data buffer would be freed
+  void release_resources() override {
+    resources_released_ = true;
+  }
+
+  bool resources_released_ = false;
+};
+
+struct MakeSharedPolicy {
+  using ptr_t = std::shared_ptr<StorageImpl>;
+  static ptr_t make() { return std::make_shared<StorageImpl>(); }
+  static constexpr const char* name = "shared_ptr (make_shared)";
+};
+
+struct SharedNewPolicy {
+  using ptr_t = std::shared_ptr<StorageImpl>;
+  static ptr_t make() { return std::shared_ptr<StorageImpl>(new StorageImpl()); }
+  static constexpr const char* name = "shared_ptr (new)        ";
+};
+
+struct IntrusivePolicy {
+  using ptr_t = c10::intrusive_ptr<IntrusiveStorageImpl>;
+  static ptr_t make() { return c10::make_intrusive<IntrusiveStorageImpl>(); }
+  static constexpr const char* name = "intrusive_ptr           ";
+};
+
+struct WeakIntrusivePolicy {
+  using ptr_t = c10::intrusive_ptr<WeakIntrusiveStorageImpl>;
+  static ptr_t make() { return c10::make_intrusive<WeakIntrusiveStorageImpl>(); }
+  static constexpr const char* name = "intrusive_ptr (weak)    ";
+};
+
+template <typename PtrPolicy>
+class Storage {
+ public:
+  Storage() : storage_impl_(PtrPolicy::make()), group_number_(1) {}
+  Storage(const Storage& other) = default;
+
+  const void *data() const {
+    return storage_impl_->data(group_number_);
+  }
+
+ private:
+  typename PtrPolicy::ptr_t storage_impl_;
+  COWSim::TokenType group_number_;
+};
+
+void check(bool cond, const char* msg) {
+  std::cout << (cond ? "yay. " : "BOO. ") << msg << std::endl;
+}
+
+void examples() {
+  auto a = c10::make_intrusive<WeakIntrusiveStorageImpl>();
+  auto b = a;
+  check(a.use_count() == 2, "copy increfs");
+
+  c10::weak_intrusive_ptr<WeakIntrusiveStorageImpl> weak(a);
+  check(weak.lock().get() == a.get(), "lock works while strong refs exist");
+
+  WeakIntrusiveStorageImpl* raw = a.get();
+  a.reset();
+  b.reset();
+  // The weak reference keeps the object itself alive, so this is safe
+  check(raw->resources_released(), "resources released with last strong ref");
+  check(weak.lock().get() == nullptr, "lock fails after last strong ref");
+  std::cout << std::endl;
+}
+
+template <typename T>
+inline void do_not_optimize(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Makes a lot of storages, then makes a view (a copy of `Storage`) of each one
+// in a random order and reads its data pointer. With this many storages, they
+// don't fit in cache, so the number of cache lines touched per view shows up.
+template <typename PtrPolicy>
+void bench_policy() {
+  const size_t num_storages = 1'000'000;
+  const size_t num_rounds = 5;
+
+  size_t bytes_before = num_allocated_bytes;
+  size_t allocs_before = num_allocations;
+  std::vector<Storage<PtrPolicy>> storages(num_storages);
+  double bytes_per_storage = double(num_allocated_bytes - bytes_before) / num_storages
+    - sizeof(Storage<PtrPolicy>);
+  double allocs_per_storage = double(num_allocations - allocs_before) / num_storages;
+
+  std::vector<uint32_t> order(num_storages);
+  std::iota(order.begin(), order.end(), 0);
+  std::shuffle(order.begin(), order.end(), std::mt19937(0));
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t round = 0; round < num_rounds; round++) {
+    for (uint32_t idx : order) {
+      Storage<PtrPolicy> view(storages[idx]);
+      do_not_optimize(view.data());
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ns_per_view =
+    std::chrono::duration<double, std::nano>(end - start).count() / (num_storages * num_rounds);
+
+  std::cout << "  " << PtrPolicy::name
+    << "  heap bytes/storage: " << bytes_per_storage
+    << "  allocations/storage: " << allocs_per_storage
+    << "  ns/view: " << ns_per_view
+    << "  Mviews/s: " << 1e3 / ns_per_view << std::endl;
+}
+
+int main() {
+  examples();
+
+  std::cout << "view creation benchmark:" << std::endl;
+  bench_policy<MakeSharedPolicy>();
+  bench_policy<SharedNewPolicy>();
+  bench_policy<IntrusivePolicy>();
+  bench_policy<WeakIntrusivePolicy>();
+}
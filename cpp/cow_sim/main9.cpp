@@ -0,0 +1,838 @@
+// Same as main4.cpp, except that COW violations don't have to be written to
+// `std::cout` synchronously from inside the data accessors.
+//
+// In main3.cpp and main4.cpp, `COWChecker::maybe_warn_on_mismatch` writes
+// straight to `std::cout`. In a hot loop, every violation then turns into a
+// syscall (because of `std::endl`), and all the threads serialize on the
+// stream. That would make it hard to leave the simulation on in production.
+//
+// Here, in `WarnMode::Buffered`, a violation just pushes a small record onto a
+// ring buffer that belongs to the calling thread. A background flusher thread
+// drains all the ring buffers in batches, keeps only the first violation for
+// each (storage, access kind, source location), and writes the messages for
+// a whole batch with one write. Each thread also skips pushing a record if it
+// recently pushed one with the same key. If a ring buffer is full, the record
+// is dropped and counted, since blocking the accessor would defeat the
+// purpose.
+//
+// Storages are identified by an ID that every `StorageImpl` gets when it's
+// made and that is never reused, rather than by address, so a new storage at
+// the address of a dead one still gets its violations reported. The set of
+// reported keys is kept in two generations of at most `kMaxReported` keys
+// each. When the current one fills up, the older one is dropped, so memory
+// stays bounded, at the cost of reporting a key again if it comes back after
+// being aged out.
+//
+// The source location is the caller of `TensorImpl::const_data()` or
+// `TensorImpl::mutable_data()`, found with `__builtin_FILE()` and
+// `__builtin_LINE()` default arguments (GCC and Clang). With C++20, that would
+// be `std::source_location::current()` instead.
+//
+// Build with:
+//   g++ -std=c++17 -O2 -pthread main9.cpp -o main9
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_set>
+#include <vector>
+
+namespace COWSim {
+struct WarnCounter {
+  std::atomic<uint64_t> count{0};
+  void increment() { count.fetch_add(1, std::memory_order_relaxed); }
+  void reset() { count = 0; }
+};
+
+WarnCounter &get_warn_counter() {
+  static WarnCounter warn_counter;
+  return warn_counter;
+}
+
+void reset_warn_counter() {
+  get_warn_counter().reset();
+}
+
+void check_warn_counter(uint64_t expected_count) {
+  if (expected_count == get_warn_counter().count) {
+    std::cout << "yay.\n";
+  } else {
+    std::cout << "BOO.\n";
+  }
+}
+
+using TokenType = std::uintptr_t;
+static constexpr TokenType NullToken{0};
+static const char cow_read_msg[] = "WRITE THEN READ";
+static const char cow_write_msg[] = "WRITE THEN WRITE";
+
+inline bool token_set(TokenType t) { return t != NullToken;}
+
+struct SourceLocation {
+  const char* file;
+  uint32_t line;
+};
+
+enum class AccessKind : uint8_t { Read, Write };
+
+// Everything needed to build the warning message later, without any
+// allocation on the hot path. `file` always points to a string literal.
+struct ViolationRecord {
+  uint64_t storage_id;
+  TokenType creator;
+  TokenType first_writer;
+  TokenType accessor;
+  const char* file;
+  uint32_t line;
+  AccessKind kind;
+};
+
+// Single producer (the thread that owns it), single consumer (whoever holds
+// `ViolationLog::drain_mutex_`)
+class ViolationRing {
+ public:
+  static constexpr size_t kCapacity = 4096;
+  static_assert((kCapacity & (kCapacity - 1)) == 0, "capacity must be a power of 2");
+
+  bool try_push(const ViolationRecord& record) {
+    // Only the first violation for each key is ever reported, so there's no
+    // point pushing the same key over and over from a hot loop. This small
+    // direct mapped cache of recently pushed keys is only touched by the
+    // owning thread.
+    RecentKey key{record.storage_id, record.file, record.line, record.kind};
+    RecentKey& recent = recent_[key.hash() & (kNumRecent - 1)];
+    if (recent == key) {
+      return true;
+    }
+
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == kCapacity) {
+      num_dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    records_[head & (kCapacity - 1)] = record;
+    head_.store(head + 1, std::memory_order_release);
+    // Only once it's pushed, so a dropped record doesn't hide later ones
+    recent = key;
+    return true;
+  }
+
+  template <typename Func>
+  size_t drain(Func&& func) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t head = head_.load(std::memory_order_acquire);
+    for (size_t i = tail; i != head; i++) {
+      func(records_[i & (kCapacity - 1)]);
+    }
+    tail_.store(head, std::memory_order_release);
+    return head - tail;
+  }
+
+  uint64_t num_dropped() const {
+    return num_dropped_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct RecentKey {
+    // 0 is never a storage ID
+    uint64_t storage_id = 0;
+    const char* file = nullptr;
+    uint32_t line = 0;
+    AccessKind kind = AccessKind::Read;
+
+    bool operator==(const RecentKey& other) const {
+      return storage_id == other.storage_id && file == other.file
+        && line == other.line && kind == other.kind;
+    }
+
+    size_t hash() const {
+      return storage_id ^ (reinterpret_cast<uintptr_t>(file) >> 4)
+        ^ (line * 31) ^ static_cast<size_t>(kind);
+    }
+  };
+  static constexpr size_t kNumRecent = 64;
+
+  std::array<RecentKey, kNumRecent> recent_;
+  std::array<ViolationRecord, kCapacity> records_;
+  // Producer and consumer indices are on separate cache lines so that the
+  // flusher doesn't slow down the thread that is pushing records
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+  std::atomic<uint64_t> num_dropped_{0};
+};
+
+enum class WarnMode { Sync, Buffered };
+
+class ViolationLog {
+ public:
+  // Largest number of keys in each generation of reported keys
+  static constexpr size_t kMaxReported = size_t(1) << 16;
+
+  static ViolationLog& get() {
+    static ViolationLog log;
+    return log;
+  }
+
+  ~ViolationLog() {
+    stop_flusher();
+  }
+
+  void set_mode(WarnMode mode) {
+    mode_.store(mode, std::memory_order_relaxed);
+  }
+
+  WarnMode mode() const {
+    return mode_.load(std::memory_order_relaxed);
+  }
+
+  // Where messages go. Defaults to `std::cout`
+  void set_sink(std::ostream* sink) {
+    std::lock_guard<std::mutex> guard(drain_mutex_);
+    sink_ = sink;
+  }
+
+  void record(const ViolationRecord& record) {
+    if (mode() == WarnMode::Sync) {
+      std::lock_guard<std::mutex> guard(drain_mutex_);
+      *sink_ << "COW BEHAVIOR WARNING: " << message(record) << std::endl;
+    } else {
+      thread_ring().try_push(record);
+    }
+  }
+
+  void start_flusher(std::chrono::milliseconds interval = std::chrono::milliseconds(10)) {
+    std::lock_guard<std::mutex> guard(flusher_mutex_);
+    if (flusher_.joinable()) {
+      return;
+    }
+    stop_ = false;
+    flusher_ = std::thread([this, interval] {
+      std::unique_lock<std::mutex> lock(flusher_mutex_);
+      while (!stop_) {
+        flusher_cv_.wait_for(lock, interval, [this] { return stop_; });
+        lock.unlock();
+        flush();
+        lock.lock();
+      }
+    });
+  }
+
+  void stop_flusher() {
+    {
+      std::lock_guard<std::mutex> guard(flusher_mutex_);
+      stop_ = true;
+    }
+    flusher_cv_.notify_all();
+    if (flusher_.joinable()) {
+      flusher_.join();
+    }
+    flush();
+  }
+
+  // Drains every thread's ring buffer and writes out one message for each
+  // violation that hasn't been reported yet. Safe to call from any thread.
+  void flush() {
+    std::lock_guard<std::mutex> guard(drain_mutex_);
+    std::vector<std::shared_ptr<ViolationRing>> rings;
+    {
+      std::lock_guard<std::mutex> rings_guard(rings_mutex_);
+      rings = rings_;
+    }
+    std::string batch;
+    for (auto& ring : rings) {
+      num_drained_ += ring->drain([&](const ViolationRecord& record) {
+        if (mark_reported(std::make_tuple(record.storage_id, record.file, record.line, record.kind))) {
+          batch += "COW BEHAVIOR WARNING: ";
+          batch += message(record);
+          batch += '\n';
+        }
+      });
+    }
+    if (!batch.empty()) {
+      sink_->write(batch.data(), batch.size());
+      sink_->flush();
+    }
+  }
+
+  // Forget which violations have been reported, so the examples below can
+  // each be checked on their own. This doesn't clear each thread's cache of
+  // recently pushed keys, but every example uses new storages, whose IDs
+  // haven't been seen before.
+  void reset_reported() {
+    std::lock_guard<std::mutex> guard(drain_mutex_);
+    reported_.clear();
+    previously_reported_.clear();
+    num_reported_ = 0;
+  }
+
+  // Number of messages written since the last `reset_reported()`
+  size_t num_reported() {
+    std::lock_guard<std::mutex> guard(drain_mutex_);
+    return num_reported_;
+  }
+
+  // Number of keys currently remembered as reported
+  size_t num_remembered() {
+    std::lock_guard<std::mutex> guard(drain_mutex_);
+    return reported_.size() + previously_reported_.size();
+  }
+
+  uint64_t num_drained() {
+    std::lock_guard<std::mutex> guard(drain_mutex_);
+    return num_drained_;
+  }
+
+  size_t num_rings() {
+    std::lock_guard<std::mutex> guard(rings_mutex_);
+    return rings_.size();
+  }
+
+  uint64_t num_dropped() {
+    std::lock_guard<std::mutex> guard(rings_mutex_);
+    uint64_t dropped = 0;
+    for (auto& ring : rings_) {
+      dropped += ring->num_dropped();
+    }
+    return dropped;
+  }
+
+ private:
+  using Key = std::tuple<uint64_t, const char*, uint32_t, AccessKind>;
+
+  ViolationLog() = default;
+
+  // Returns true if `key` hasn't been reported yet. Must hold `drain_mutex_`.
+  bool mark_reported(const Key& key) {
+    if (previously_reported_.count(key) || !reported_.insert(key).second) {
+      return false;
+    }
+    num_reported_++;
+    if (reported_.size() == kMaxReported) {
+      previously_reported_ = std::move(reported_);
+      reported_.clear();
+    }
+    return true;
+  }
+
+  static std::string message(const ViolationRecord& record) {
+    std::ostringstream ss;
+    ss << (record.kind == AccessKind::Read ? cow_read_msg : cow_write_msg)
+      << " (storage " << record.storage_id
+      << ", created by " << record.creator
+      << ", first writer " << record.first_writer
+      << ", accessed by " << record.accessor
+      << ") at " << record.file << ":" << record.line;
+    return ss.str();
+  }
+
+  // Gives a thread a ring for as long as it runs. When the thread exits, its
+  // ring goes on `free_rings_` for the next new thread to use, so there are
+  // only ever as many rings as threads that were alive at once. The ring stays
+  // in `rings_`, so any records left in it still get flushed.
+  struct ThreadRingHandle {
+    explicit ThreadRingHandle(ViolationLog& log) : log(log) {
+      std::lock_guard<std::mutex> guard(log.rings_mutex_);
+      if (!log.free_rings_.empty()) {
+        ring = std::move(log.free_rings_.back());
+        log.free_rings_.pop_back();
+      } else {
+        ring = std::make_shared<ViolationRing>();
+        log.rings_.push_back(ring);
+      }
+    }
+
+    ~ThreadRingHandle() {
+      std::lock_guard<std::mutex> guard(log.rings_mutex_);
+      log.free_rings_.push_back(std::move(ring));
+    }
+
+    ViolationLog& log;
+    std::shared_ptr<ViolationRing> ring;
+  };
+
+  ViolationRing& thread_ring() {
+    thread_local ThreadRingHandle handle(*this);
+    return *handle.ring;
+  }
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      size_t h = std::hash<uint64_t>()(std::get<0>(key));
+      h = h * 31 + std::hash<const void*>()(std::get<1>(key));
+      h = h * 31 + std::get<2>(key);
+      h = h * 31 + static_cast<size_t>(std::get<3>(key));
+      return h;
+    }
+  };
+
+  std::atomic<WarnMode> mode_{WarnMode::Sync};
+
+  std::mutex rings_mutex_;
+  std::vector<std::shared_ptr<ViolationRing>> rings_;
+  // Rings of threads that exited, which aren't in use until a new thread
+  // takes one
+  std::vector<std::shared_ptr<ViolationRing>> free_rings_;
+
+  std::mutex drain_mutex_;
+  std::ostream* sink_ = &std::cout;
+  std::unordered_set<Key, KeyHash> reported_;
+  std::unordered_set<Key, KeyHash> previously_reported_;
+  size_t num_reported_ = 0;
+  uint64_t num_drained_ = 0;
+
+  std::mutex flusher_mutex_;
+  std::condition_variable flusher_cv_;
+  std::thread flusher_;
+  bool stop_ = false;
+};
+
+// Same as `ConcurrentCOWChecker` in main4.cpp, except warnings go through
+// `ViolationLog`
+struct COWChecker {
+  std::atomic<TokenType> creator_;
+  std::atomic<TokenType> first_writer_;
+  COWChecker() : creator_(NullToken), first_writer_(NullToken) {}
+
+  void check_on_write(uint64_t storage_id, TokenType writer, SourceLocation loc) {
+    TokenType first_writer = first_writer_.load(std::memory_order_acquire);
+    if (!token_set(first_writer)) {
+      if (!token_set(creator_.load(std::memory_order_acquire))) {
+        return;
+      }
+      first_writer = maybe_set_first_writer(writer);
+    }
+    maybe_warn_on_mismatch(storage_id, first_writer, writer, AccessKind::Write, loc);
+  }
+
+  void check_on_read(uint64_t storage_id, TokenType reader, SourceLocation loc) const {
+    TokenType first_writer = first_writer_.load(std::memory_order_acquire);
+    if (token_set(first_writer)) {
+      maybe_warn_on_mismatch(storage_id, first_writer, reader, AccessKind::Read, loc);
+    }
+  }
+
+  void maybe_warn_on_mismatch(uint64_t storage_id, TokenType first_writer, TokenType other, AccessKind kind, SourceLocation loc) const {
+    if (first_writer != other) {
+      get_warn_counter().increment();
+      TokenType creator = creator_.load(std::memory_order_relaxed);
+      ViolationLog::get().record({storage_id, creator, first_writer, other, loc.file, loc.line, kind});
+    }
+  }
+
+  TokenType maybe_set_first_writer(TokenType other) {
+    TokenType expected = NullToken;
+    if (first_writer_.compare_exchange_strong(
+          expected, other,
+          std::memory_order_acq_rel, std::memory_order_acquire)) {
+      return other;
+    }
+    return expected;
+  }
+
+  void maybe_init(TokenType creator) {
+    TokenType expected = NullToken;
+    creator_.compare_exchange_strong(
+      expected, creator,
+      std::memory_order_acq_rel, std::memory_order_acquire);
+  }
+
+};
+
+} // namespace COWSim
+
+static std::atomic<int64_t> next_data_ptr_value_{1};
+// Starts at 1, since 0 means no storage
+static std::atomic<uint64_t> next_storage_id_{1};
+
+class DataPtr {
+ public:
+  DataPtr() : ptr_(reinterpret_cast<void*>(next_data_ptr_value_++)) {}
+
+  void* get() const {
+    return ptr_;
+  }
+
+  void* mutable_get() {
+    return ptr_;
+  }
+
+ private:
+  void* ptr_;
+};
+
+class StorageImpl {
+ public:
+  StorageImpl() : id_(next_storage_id_.fetch_add(1, std::memory_order_relaxed)) {}
+
+  const void *data(COWSim::TokenType token, COWSim::SourceLocation loc) const {
+    cow_checker_.check_on_read(id_, token, loc);
+    return data_ptr_.get();
+  }
+
+  void *mutable_data(COWSim::TokenType token, COWSim::SourceLocation loc) {
+    cow_checker_.check_on_write(id_, token, loc);
+    return data_ptr_.mutable_get();
+  }
+
+  void maybe_enable_cow_sim(COWSim::TokenType token) {
+    cow_checker_.maybe_init(token);
+  }
+
+ private:
+  // Unique for the life of the process, unlike the address
+  uint64_t id_;
+  DataPtr data_ptr_;
+  COWSim::COWChecker cow_checker_;
+};
+
+
+class Storage {
+ public:
+  Storage() : storage_impl_(std::make_shared<StorageImpl>()), group_number_(1) {}
+  Storage(Storage& other) : storage_impl_(other.storage_impl_), group_number_(other.group_number_) {}
+
+  const void *data(COWSim::SourceLocation loc) const {
+    return storage_impl_->data(group_number_, loc);
+  }
+
+  void *mutable_data(COWSim::SourceLocation loc) const {
+    return storage_impl_->mutable_data(group_number_, loc);
+  }
+
+  void maybe_enable_cow_sim_() {
+    storage_impl_->maybe_enable_cow_sim(group_number_);
+  }
+
+  void increment_group_number_() {
+    group_number_++;
+  }
+
+ private:
+  std::shared_ptr<StorageImpl> storage_impl_;
+  COWSim::TokenType group_number_;
+};
+
+class TensorImpl {
+public:
+  TensorImpl() = default;
+  TensorImpl(Storage storage) : storage_(storage) {}
+  Storage& storage() {
+    return storage_;
+  }
+
+  inline const void* const_data(
+      const char* file = __builtin_FILE(), uint32_t line = __builtin_LINE()) const {
+    return data_impl<const void>(
+      [&] { return static_cast<const char*>(storage_.data({file, line})); });
+  }
+
+  inline void* mutable_data(
+      const char* file = __builtin_FILE(), uint32_t line = __builtin_LINE()) {
+    return data_impl<void>(
+      [&] { return static_cast<char*>(storage_.mutable_data({file, line})); });
+  }
+
+ private:
+  template <typename Void, typename Func>
+  Void* data_impl(const Func& get_data) const {
+    // Note: PyTorch does some checks in here
+    auto* data = get_data();
+    return data;
+  }
+
+  Storage storage_;
+};
+
+namespace torch {
+TensorImpl clone(TensorImpl self) { return TensorImpl(); }
+TensorImpl view(TensorImpl self) { return TensorImpl(self.storage());}
+
+enum ReshapeArgs { View, Copy };
+TensorImpl reshape(TensorImpl self, ReshapeArgs args) {
+  if (args == ReshapeArgs::View) {
+    self.storage().maybe_enable_cow_sim_();
+    TensorImpl res = view(self);
+    res.storage().increment_group_number_();
+    return res;
+  } else {
+    return clone(self);
+  }
+}
+}
+
+// for easy to read examples
+auto tensor() { return TensorImpl(); }
+using torch::view;
+using torch::reshape;
+// These pass their own caller's location down, like a real op would report
+// the user code that called it rather than the op itself
+auto mutates_input(TensorImpl& t,
+    const char* file = __builtin_FILE(), uint32_t line = __builtin_LINE()) {
+  return t.mutable_data(file, line);
+}
+auto reads_from_input(TensorImpl& t,
+    const char* file = __builtin_FILE(), uint32_t line = __builtin_LINE()) {
+  return t.const_data(file, line);
+}
+using torch::ReshapeArgs;
+
+auto example_1() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  mutates_input(a);
+  reads_from_input(b);
+}
+
+auto example_2() {
+  auto a = tensor();
+  auto c = tensor();
+  c.storage() = a.storage();
+  auto b = reshape(a, ReshapeArgs::View);
+  mutates_input(b);
+  reads_from_input(c);
+}
+
+auto example_3() {
+    TensorImpl a;
+    TensorImpl b = view(a);
+    mutates_input(a);
+    mutates_input(b);
+    reads_from_input(a);
+    reads_from_input(b);
+}
+
+auto example_4() {
+  auto a = tensor();
+  auto b = view(a);
+  auto c = reshape(b, ReshapeArgs::View);
+  mutates_input(b);
+  reads_from_input(a);
+}
+
+auto example_5() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  auto c = view(b);
+  mutates_input(b);
+  reads_from_input(c);
+}
+
+auto example_6() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  auto c = view(b);
+  mutates_input(c);
+  reads_from_input(b);
+}
+
+auto example_7() {
+  auto a = tensor();
+  auto b = view(a);
+  auto c = reshape(b, ReshapeArgs::View);
+  mutates_input(a);
+  reads_from_input(b);
+}
+
+// Reads the same violating tensor many times from one site. Should only be
+// reported once.
+auto example_8() {
+  auto a = tensor();
+  auto b = reshape(a, ReshapeArgs::View);
+  mutates_input(a);
+  for (int i = 0; i < 1000; i++) {
+    reads_from_input(b);
+  }
+}
+
+// Makes a violating storage, destroys it, and does the same again, so the
+// second `StorageImpl` likely reuses the first one's address. Both are
+// reported, since they have different storage IDs.
+auto example_9() {
+  for (int i = 0; i < 2; i++) {
+    auto a = tensor();
+    auto b = reshape(a, ReshapeArgs::View);
+    mutates_input(a);
+    reads_from_input(b);
+  }
+}
+
+using func_t = decltype(&example_1);
+// (function, expected warnings, expected reported messages)
+static std::tuple<func_t, uint64_t, size_t> test_cases[] = {
+    {&example_1, 1, 1},
+    {&example_2, 1, 1},
+    {&example_3, 0, 0},
+    {&example_4, 0, 0},
+    {&example_5, 0, 0},
+    {&example_6, 0, 0},
+    {&example_7, 0, 0},
+    {&example_8, 1000, 1},
+    {&example_9, 2, 2},
+};
+
+// Many threads hammer on reads that all violate COW semantics, and we time
+// each access. With synchronous warnings, every access writes to the sink. With
+// the buffered log, an access just pushes onto a ring buffer.
+void bench_mode(COWSim::WarnMode mode, const char* name) {
+  const size_t num_threads = 4;
+  const size_t accesses_per_thread = 100'000;
+
+  auto& log = COWSim::ViolationLog::get();
+  log.set_mode(mode);
+  log.reset_reported();
+  uint64_t dropped_before = log.num_dropped();
+
+  TensorImpl a;
+  TensorImpl b = reshape(a, ReshapeArgs::View);
+  a.mutable_data();
+
+  std::vector<std::vector<uint32_t>> latencies(num_threads);
+  std::atomic<bool> go{false};
+  std::vector<std::thread> threads;
+
+  for (size_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+    threads.emplace_back([&, thread_idx] {
+      TensorImpl t = view(b);
+      auto& thread_latencies = latencies[thread_idx];
+      thread_latencies.reserve(accesses_per_thread);
+      while (!go.load(std::memory_order_acquire)) {}
+      for (size_t i = 0; i < accesses_per_thread; i++) {
+        auto start = std::chrono::steady_clock::now();
+        t.const_data();
+        auto end = std::chrono::steady_clock::now();
+        thread_latencies.push_back(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+      }
+    });
+  }
+  auto start = std::chrono::steady_clock::now();
+  go = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+  log.flush();
+
+  std::vector<uint32_t> all;
+  for (auto& thread_latencies : latencies) {
+    all.insert(all.end(), thread_latencies.begin(), thread_latencies.end());
+  }
+  std::sort(all.begin(), all.end());
+  double total_ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+  std::cout << "  " << name
+    << "  total ms: " << total_ms
+    << "  p50 ns: " << all[all.size() / 2]
+    << "  p99 ns: " << all[all.size() * 99 / 100]
+    << "  p99.9 ns: " << all[all.size() * 999 / 1000]
+    << "  max ns: " << all.back()
+    << "  dropped: " << log.num_dropped() - dropped_before
+    << std::endl;
+}
+
+// A record that's dropped because the ring is full must not be remembered as
+// recently pushed, or the same violation would never be pushed again
+void ring_example() {
+  COWSim::ViolationRing ring;
+  for (size_t i = 0; i < COWSim::ViolationRing::kCapacity; i++) {
+    ring.try_push({i + 1, 1, 1, 2, __FILE__, __LINE__, COWSim::AccessKind::Read});
+  }
+  COWSim::ViolationRecord record{COWSim::ViolationRing::kCapacity + 1, 1, 1, 2, __FILE__, __LINE__, COWSim::AccessKind::Read};
+  bool dropped = !ring.try_push(record);
+  ring.drain([](const COWSim::ViolationRecord&) {});
+  bool pushed = ring.try_push(record);
+  size_t num_drained = ring.drain([](const COWSim::ViolationRecord&) {});
+  std::cout << ((dropped && pushed && num_drained == 1) ? "yay. " : "BOO. ")
+    << "record dropped from a full ring is pushed again later" << std::endl;
+}
+
+int main() {
+  ring_example();
+
+  auto& log = COWSim::ViolationLog::get();
+  log.set_mode(COWSim::WarnMode::Buffered);
+  log.start_flusher();
+
+  auto i = 0;
+  for (auto [func, expected_warns, expected_reports] : test_cases) {
+    ++i;
+    COWSim::get_warn_counter().reset();
+    log.reset_reported();
+    func();
+    log.flush();
+    std::cout << "Example " << i << "-->";
+    COWSim::check_warn_counter(expected_warns);
+    std::cout << "Example " << i << " reports-->"
+      << (log.num_reported() == expected_reports ? "yay.\n" : "BOO.\n");
+  }
+  log.stop_flusher();
+
+  // Threads that come and go one after another reuse the same ring
+  {
+    std::ofstream dev_null("/dev/null");
+    log.set_sink(&dev_null);
+    log.reset_reported();
+    size_t rings_before = log.num_rings();
+    const size_t num_threads = 100;
+    for (size_t j = 0; j < num_threads; j++) {
+      std::thread([] {
+        auto a = tensor();
+        auto b = reshape(a, ReshapeArgs::View);
+        mutates_input(a);
+        reads_from_input(b);
+      }).join();
+    }
+    log.flush();
+    log.set_sink(&std::cout);
+    std::cout << ((log.num_reported() == num_threads && log.num_rings() <= rings_before + 1) ? "yay. " : "BOO. ")
+      << "exited threads' rings are reused and their records flushed" << std::endl;
+  }
+
+  // Report violations for more storages than fit in two generations of the
+  // reported set, into /dev/null
+  {
+    std::ofstream dev_null("/dev/null");
+    log.set_sink(&dev_null);
+    log.reset_reported();
+    const size_t num_storages = 3 * COWSim::ViolationLog::kMaxReported;
+    for (size_t j = 0; j < num_storages; j++) {
+      auto a = tensor();
+      auto b = reshape(a, ReshapeArgs::View);
+      mutates_input(a);
+      reads_from_input(b);
+      if (j % 1024 == 0) {
+        // So the ring buffer doesn't fill up
+        log.flush();
+      }
+    }
+    log.flush();
+    log.set_sink(&std::cout);
+    std::cout << ((log.num_reported() == num_storages &&
+                   log.num_remembered() <= 2 * COWSim::ViolationLog::kMaxReported) ? "yay. " : "BOO. ")
+      << "every storage reported once, and the reported set stays bounded" << std::endl;
+  }
+
+  // Send messages to /dev/null for the benchmark, so we measure the cost of
+  // writing them without flooding the terminal
+  std::ofstream dev_null("/dev/null");
+  log.set_sink(&dev_null);
+  log.start_flusher();
+
+  std::cout << "\nviolating read latency:" << std::endl;
+  bench_mode(COWSim::WarnMode::Sync, "sync    ");
+  bench_mode(COWSim::WarnMode::Buffered, "buffered");
+
+  log.stop_flusher();
+  log.set_sink(&std::cout);
+}
@@ -0,0 +1,368 @@
+// In main.cpp, `PyObjectSlot` has an atomic interpreter pointer and a plain
+// `PyObject*`, and they're updated separately. The move constructor only
+// copies the interpreter and leaves `pyobj_` uninitialized, and `swap` does
+// two separate `exchange`s on the interpreters and a non-atomic swap of the
+// `pyobj_`s. So another thread can see an interpreter paired with the wrong
+// `PyObject`, or garbage.
+//
+// Here, the interpreter and the `PyObject*` are packed into one 64 bit word
+// that's always loaded, stored, and compare-exchanged as a whole:
+//
+//   bits 63-48: interpreter ID (0 means no interpreter)
+//   bits 47-0:  PyObject*
+//
+// A 16 byte double-width compare-exchange could hold two full pointers, but
+// `std::atomic` of 16 bytes isn't lock-free with GCC unless you build with
+// `-mcx16` and link libatomic, so this uses one tagged word instead.
+// Interpreters register themselves in a global table when they're created,
+// which gives each one a 16 bit ID. User space pointers on x86-64 and AArch64
+// fit in 48 bits (unless a program asks for 5-level paging addresses on
+// purpose), and `PyObjectSlot` checks this.
+//
+//  * The move constructor and move assignment take the whole word from the
+//    other slot with one `exchange`, and leave the other slot empty, since
+//    only one slot can own a `PyObject`. Copying is deleted for the same
+//    reason.
+//
+//  * `swap` exchanges the two words. Like swapping any other two objects, it
+//    isn't atomic with respect to other threads writing to either slot, but
+//    each slot only ever holds a whole (interpreter, `PyObject*`) pair, so
+//    concurrent readers never see a mismatched one.
+//
+//  * `compare_exchange` replaces the pair only if it's still the expected one.
+//    `set_pyobj_interpreter` uses it to change the interpreter without losing
+//    the `PyObject*`.
+//
+// The benchmark has some threads writing pairs and others reading them, and
+// checks that every pair read is one that was written, for this slot and for
+// a slot protected by a mutex.
+//
+// Build with:
+//   g++ -std=c++17 -O2 -pthread main1.cpp -o main1
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <iostream>
+
+namespace c10 {
+
+class PyInterpreter;
+
+// Gives each interpreter a 16 bit ID, so it fits in a tagged word
+class PyInterpreterRegistry {
+ public:
+  static constexpr size_t kMaxInterpreters = size_t(1) << 16;
+
+  static uint16_t add(PyInterpreter* interpreter) {
+    size_t id = next_id_.fetch_add(1, std::memory_order_relaxed);
+    if (id >= kMaxInterpreters) {
+      throw std::runtime_error("too many interpreters");
+    }
+    interpreters_[id].store(interpreter, std::memory_order_release);
+    return static_cast<uint16_t>(id);
+  }
+
+  static PyInterpreter* get(uint16_t id) {
+    return interpreters_[id].load(std::memory_order_acquire);
+  }
+
+ private:
+  // Starts at 1, since 0 means no interpreter. Interpreters are never removed,
+  // so an interpreter has to outlive every slot that refers to it.
+  static inline std::atomic<size_t> next_id_{1};
+  static inline std::atomic<PyInterpreter*> interpreters_[kMaxInterpreters] = {};
+};
+
+class PyInterpreter {
+ public:
+  PyInterpreter() : id_(PyInterpreterRegistry::add(this)) {}
+
+  PyInterpreter(const PyInterpreter&) = delete;
+  PyInterpreter& operator=(const PyInterpreter&) = delete;
+
+  uint16_t id() const {
+    return id_;
+  }
+
+ private:
+  uint16_t id_;
+};
+
+class PyObject {
+};
+
+class PyObjectSlot;
+inline void swap(PyObjectSlot& lhs, PyObjectSlot& rhs);
+
+class PyObjectSlot {
+ public:
+  struct State {
+    PyInterpreter* interpreter;
+    PyObject* pyobj;
+
+    bool operator==(const State& other) const {
+      return interpreter == other.interpreter && pyobj == other.pyobj;
+    }
+  };
+
+  PyObjectSlot()
+    : word_(0) {}
+
+  PyObjectSlot(PyObjectSlot&& other) noexcept
+    : word_(other.word_.exchange(0, std::memory_order_acq_rel)) {}
+
+  PyObjectSlot& operator=(PyObjectSlot&& other) noexcept {
+    if (this != &other) {
+      word_.store(other.word_.exchange(0, std::memory_order_acq_rel), std::memory_order_release);
+    }
+    return *this;
+  }
+
+  PyObjectSlot(const PyObjectSlot&) = delete;
+  PyObjectSlot& operator=(const PyObjectSlot&) = delete;
+
+  friend void swap(PyObjectSlot& lhs, PyObjectSlot& rhs);
+
+  State load() const {
+    return unpack(word_.load(std::memory_order_acquire));
+  }
+
+  void store(State state) {
+    word_.store(pack(state), std::memory_order_release);
+  }
+
+  void init_pyobj(PyInterpreter* pyobj_interpreter, PyObject* pyobj) {
+    store({pyobj_interpreter, pyobj});
+  }
+
+  // Replaces the pair with `desired` if it's still `expected`. Otherwise
+  // loads the current pair into `expected`.
+  bool compare_exchange(State& expected, State desired) {
+    uint64_t expected_word = pack(expected);
+    if (word_.compare_exchange_strong(expected_word, pack(desired),
+                                      std::memory_order_acq_rel, std::memory_order_acquire)) {
+      return true;
+    }
+    expected = unpack(expected_word);
+    return false;
+  }
+
+  // Keeps the current `PyObject*`
+  void set_pyobj_interpreter(PyInterpreter* pyobj_interpreter) {
+    State expected = load();
+    while (!compare_exchange(expected, {pyobj_interpreter, expected.pyobj})) {
+    }
+  }
+
+  PyInterpreter* pyobj_interpreter() const {
+    return load().interpreter;
+  }
+
+  PyObject* pyobj() const {
+    return load().pyobj;
+  }
+
+ private:
+  static constexpr int kPointerBits = 48;
+  static constexpr uint64_t kPointerMask = (uint64_t(1) << kPointerBits) - 1;
+
+  static uint64_t pack(State state) {
+    uint64_t ptr = reinterpret_cast<uint64_t>(state.pyobj);
+    if (ptr & ~kPointerMask) {
+      throw std::invalid_argument("PyObject pointer doesn't fit in 48 bits");
+    }
+    uint64_t id = state.interpreter ? state.interpreter->id() : 0;
+    return (id << kPointerBits) | ptr;
+  }
+
+  static State unpack(uint64_t word) {
+    uint16_t id = static_cast<uint16_t>(word >> kPointerBits);
+    return {
+      id ? PyInterpreterRegistry::get(id) : nullptr,
+      reinterpret_cast<PyObject*>(word & kPointerMask),
+    };
+  }
+
+  std::atomic<uint64_t> word_;
+};
+
+static_assert(sizeof(PyObjectSlot) == 8, "PyObjectSlot should be one word");
+
+inline void swap(PyObjectSlot& lhs, PyObjectSlot& rhs) {
+  if (&lhs == &rhs) {
+    return;
+  }
+  uint64_t lhs_word = lhs.word_.load(std::memory_order_acquire);
+  lhs.word_.store(rhs.word_.exchange(lhs_word, std::memory_order_acq_rel), std::memory_order_release);
+}
+
+class StorageImpl {
+ private:
+  PyObjectSlot pyobj_slot_;
+};
+
+} // namespace c10
+
+// For comparison, a slot where a mutex protects the pair
+class MutexPyObjectSlot {
+ public:
+  using State = c10::PyObjectSlot::State;
+
+  State load() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return state_;
+  }
+
+  void init_pyobj(c10::PyInterpreter* pyobj_interpreter, c10::PyObject* pyobj) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    state_ = {pyobj_interpreter, pyobj};
+  }
+
+  void set_pyobj_interpreter(c10::PyInterpreter* pyobj_interpreter) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    state_.interpreter = pyobj_interpreter;
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  State state_{nullptr, nullptr};
+};
+
+void check(bool cond, const char* msg) {
+  std::cout << (cond ? "yay. " : "BOO. ") << msg << std::endl;
+}
+
+void examples() {
+  c10::PyInterpreter interp_a;
+  c10::PyObject obj_a;
+
+  c10::PyObjectSlot a;
+  a.init_pyobj(&interp_a, &obj_a);
+  c10::PyObjectSlot b(std::move(a));
+  check(b.pyobj_interpreter() == &interp_a && b.pyobj() == &obj_a, "move constructor moves both");
+  check(a.pyobj_interpreter() == nullptr && a.pyobj() == nullptr, "moved-from slot is empty");
+
+  std::vector<std::pair<std::size_t, c10::PyObjectSlot>> v;
+  v.emplace_back(0, std::move(b));
+  for (size_t i = 1; i < 100; i++) {
+    v.emplace_back(i, c10::PyObjectSlot());
+  }
+  check(v[0].second.load() == c10::PyObjectSlot::State{&interp_a, &obj_a},
+    "slot survives being moved around by a growing vector");
+
+  c10::PyInterpreter interp_x;
+  c10::PyInterpreter interp_y;
+  c10::PyObject obj_x;
+  c10::PyObject obj_y;
+  c10::PyObjectSlot x;
+  c10::PyObjectSlot y;
+  x.init_pyobj(&interp_x, &obj_x);
+  y.init_pyobj(&interp_y, &obj_y);
+  swap(x, y);
+  check(x.load() == c10::PyObjectSlot::State{&interp_y, &obj_y} &&
+        y.load() == c10::PyObjectSlot::State{&interp_x, &obj_x},
+    "swap swaps both");
+
+  c10::PyObjectSlot::State expected{&interp_x, &obj_y};
+  check(!x.compare_exchange(expected, {nullptr, nullptr}) &&
+        expected == c10::PyObjectSlot::State{&interp_y, &obj_y},
+    "compare_exchange fails and loads the current pair");
+  check(x.compare_exchange(expected, {&interp_x, &obj_x}) && x.pyobj() == &obj_x,
+    "compare_exchange succeeds");
+
+  x.set_pyobj_interpreter(&interp_y);
+  check(x.load() == c10::PyObjectSlot::State{&interp_y, &obj_x},
+    "set_pyobj_interpreter keeps the PyObject");
+  std::cout << std::endl;
+}
+
+// Writer threads store random (interpreter, PyObject) pairs from a fixed set,
+// and reader threads check that every pair they load is one of them. If
+// `set_interpreter_only` is true, writers only change the interpreter with
+// `set_pyobj_interpreter`, and readers check that the PyObject never changes.
+template <typename Slot>
+void bench(const char* name, bool set_interpreter_only, size_t num_writers, size_t num_readers) {
+  constexpr size_t num_pairs = 8;
+  const auto duration = std::chrono::milliseconds(300);
+  // Interpreters are registered for good, so make them once
+  static c10::PyInterpreter interpreters[num_pairs];
+  std::vector<c10::PyObject> objects(num_pairs);
+  auto interpreter_at = [&](size_t i) {
+    return &interpreters[i];
+  };
+
+  Slot slot;
+  slot.init_pyobj(interpreter_at(0), &objects[0]);
+  std::atomic<bool> stop{false};
+  std::atomic<size_t> num_reads{0};
+  std::atomic<size_t> num_writes{0};
+  std::atomic<size_t> num_torn{0};
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_writers; i++) {
+    threads.emplace_back([&, i] {
+      size_t count = 0;
+      size_t k = i;
+      while (!stop.load(std::memory_order_relaxed)) {
+        k = (k * 5 + 1) % num_pairs;
+        if (set_interpreter_only) {
+          slot.set_pyobj_interpreter(interpreter_at(k));
+        } else {
+          slot.init_pyobj(interpreter_at(k), &objects[k]);
+        }
+        count++;
+      }
+      num_writes += count;
+    });
+  }
+  for (size_t i = 0; i < num_readers; i++) {
+    threads.emplace_back([&] {
+      size_t count = 0;
+      size_t torn = 0;
+      while (!stop.load(std::memory_order_relaxed)) {
+        auto state = slot.load();
+        if (set_interpreter_only) {
+          size_t k = state.interpreter - interpreter_at(0);
+          torn += k >= num_pairs || state.pyobj != &objects[0];
+        } else {
+          size_t k = state.pyobj - objects.data();
+          torn += k >= num_pairs || state.interpreter != interpreter_at(k);
+        }
+        count++;
+      }
+      num_reads += count;
+      num_torn += torn;
+    });
+  }
+  std::this_thread::sleep_for(duration);
+  stop = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  double secs = std::chrono::duration<double>(duration).count();
+  std::cout << "  " << name << (set_interpreter_only ? "  set_pyobj_interpreter" : "  init_pyobj           ")
+    << "  writers: " << num_writers << "  readers: " << num_readers
+    << "  M writes/sec: " << num_writes / secs / 1e6
+    << "  M reads/sec: " << num_reads / secs / 1e6
+    << "  mismatched pairs: " << num_torn
+    << std::endl;
+}
+
+int main() {
+  examples();
+
+  size_t num_threads = std::max(2u, std::thread::hardware_concurrency());
+  size_t num_writers = std::max<size_t>(1, num_threads / 4);
+  size_t num_readers = num_threads - num_writers;
+  for (bool set_interpreter_only : {false, true}) {
+    bench<c10::PyObjectSlot>("tagged word", set_interpreter_only, num_writers, num_readers);
+    bench<MutexPyObjectSlot>("mutex      ", set_interpreter_only, num_writers, num_readers);
+  }
+}
@@ -0,0 +1,388 @@
+// Same as main1.cpp, with a fast path that checks whether a `PyObjectSlot`
+// belongs to the calling thread's interpreter and gets its `PyObject*`.
+//
+// In main.cpp, `pyobj_interpreter()` is a `seq_cst` load of the interpreter,
+// and the `PyObject*` is a separate field. Wrapping a tensor for Python checks
+// the slot on every op, by loading the interpreter, comparing it to the
+// current interpreter, and then loading the `PyObject*`.
+//
+// Here, the current interpreter and its ID are cached in a `thread_local`,
+// which `InterpreterGuard` sets. `check_pyobj()` does one acquire load of the
+// slot's word and compares the ID bits to the cached ID, so it doesn't have to
+// look up the interpreter table like `load()` does.
+// `owned_by_current_interpreter()` does the same with a relaxed load, for
+// callers that don't need the `PyObject`.
+//
+// On x86, `seq_cst`, acquire, and relaxed loads all compile to a plain `mov`,
+// and only `seq_cst` stores are more expensive. So there, `check_pyobj()`
+// costs about the same as the `seq_cst` accessors, and what it saves is the
+// interpreter table lookup that `load()` needs to compare interpreters. On
+// ARM, a `seq_cst` load is an `ldar`, which can't be reordered with an
+// earlier `stlr`, while an acquire load can be an `ldapr`, so the weaker
+// ordering matters there.
+//
+// The benchmark checks a table of slots, owned by a mix of two interpreters,
+// on several threads, with the `seq_cst` accessors from main.cpp and with the
+// fast paths.
+//
+// Build with:
+//   g++ -std=c++17 -O2 -pthread main2.cpp -o main2
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <iostream>
+
+namespace c10 {
+
+class PyInterpreter;
+
+// Gives each interpreter a 16 bit ID, so it fits in a tagged word
+class PyInterpreterRegistry {
+ public:
+  static constexpr size_t kMaxInterpreters = size_t(1) << 16;
+
+  static uint16_t add(PyInterpreter* interpreter) {
+    size_t id = next_id_.fetch_add(1, std::memory_order_relaxed);
+    if (id >= kMaxInterpreters) {
+      throw std::runtime_error("too many interpreters");
+    }
+    interpreters_[id].store(interpreter, std::memory_order_release);
+    return static_cast<uint16_t>(id);
+  }
+
+  static PyInterpreter* get(uint16_t id) {
+    return interpreters_[id].load(std::memory_order_acquire);
+  }
+
+ private:
+  // Starts at 1, since 0 means no interpreter. Interpreters are never removed,
+  // so an interpreter has to outlive every slot that refers to it.
+  static inline std::atomic<size_t> next_id_{1};
+  static inline std::atomic<PyInterpreter*> interpreters_[kMaxInterpreters] = {};
+};
+
+class PyInterpreter {
+ public:
+  PyInterpreter() : id_(PyInterpreterRegistry::add(this)) {}
+
+  PyInterpreter(const PyInterpreter&) = delete;
+  PyInterpreter& operator=(const PyInterpreter&) = delete;
+
+  uint16_t id() const {
+    return id_;
+  }
+
+ private:
+  uint16_t id_;
+};
+
+class PyObject {
+};
+
+// The interpreter that the calling thread is running, cached in a
+// `thread_local` so looking it up doesn't touch any shared memory. In
+// torch::deploy, each thread runs one interpreter at a time, and sets it with
+// `InterpreterGuard` when it enters that interpreter.
+struct CurrentInterpreter {
+  PyInterpreter* interpreter = nullptr;
+  uint16_t id = 0;
+};
+
+inline CurrentInterpreter& current_interpreter_tls() {
+  thread_local CurrentInterpreter current;
+  return current;
+}
+
+inline PyInterpreter* current_interpreter() {
+  return current_interpreter_tls().interpreter;
+}
+
+class InterpreterGuard {
+ public:
+  explicit InterpreterGuard(PyInterpreter* interpreter)
+    : prev_(current_interpreter_tls()) {
+    current_interpreter_tls() = {interpreter, interpreter ? interpreter->id() : uint16_t(0)};
+  }
+
+  ~InterpreterGuard() {
+    current_interpreter_tls() = prev_;
+  }
+
+  InterpreterGuard(const InterpreterGuard&) = delete;
+  InterpreterGuard& operator=(const InterpreterGuard&) = delete;
+
+ private:
+  CurrentInterpreter prev_;
+};
+
+class PyObjectSlot;
+inline void swap(PyObjectSlot& lhs, PyObjectSlot& rhs);
+
+class PyObjectSlot {
+ public:
+  struct State {
+    PyInterpreter* interpreter;
+    PyObject* pyobj;
+
+    bool operator==(const State& other) const {
+      return interpreter == other.interpreter && pyobj == other.pyobj;
+    }
+  };
+
+  PyObjectSlot()
+    : word_(0) {}
+
+  PyObjectSlot(PyObjectSlot&& other) noexcept
+    : word_(other.word_.exchange(0, std::memory_order_acq_rel)) {}
+
+  PyObjectSlot& operator=(PyObjectSlot&& other) noexcept {
+    if (this != &other) {
+      word_.store(other.word_.exchange(0, std::memory_order_acq_rel), std::memory_order_release);
+    }
+    return *this;
+  }
+
+  PyObjectSlot(const PyObjectSlot&) = delete;
+  PyObjectSlot& operator=(const PyObjectSlot&) = delete;
+
+  friend void swap(PyObjectSlot& lhs, PyObjectSlot& rhs);
+
+  State load() const {
+    return unpack(word_.load(std::memory_order_acquire));
+  }
+
+  void store(State state) {
+    word_.store(pack(state), std::memory_order_release);
+  }
+
+  void init_pyobj(PyInterpreter* pyobj_interpreter, PyObject* pyobj) {
+    store({pyobj_interpreter, pyobj});
+  }
+
+  // Replaces the pair with `desired` if it's still `expected`. Otherwise
+  // loads the current pair into `expected`.
+  bool compare_exchange(State& expected, State desired) {
+    uint64_t expected_word = pack(expected);
+    if (word_.compare_exchange_strong(expected_word, pack(desired),
+                                      std::memory_order_acq_rel, std::memory_order_acquire)) {
+      return true;
+    }
+    expected = unpack(expected_word);
+    return false;
+  }
+
+  // Keeps the current `PyObject*`
+  void set_pyobj_interpreter(PyInterpreter* pyobj_interpreter) {
+    State expected = load();
+    while (!compare_exchange(expected, {pyobj_interpreter, expected.pyobj})) {
+    }
+  }
+
+  PyInterpreter* pyobj_interpreter() const {
+    return load().interpreter;
+  }
+
+  PyObject* pyobj() const {
+    return load().pyobj;
+  }
+
+  // The fast path for wrapping a tensor. Returns the `PyObject*` if this slot
+  // belongs to the calling thread's interpreter, otherwise `nullopt`. Only
+  // compares interpreter IDs, so it doesn't look up the interpreter table. An
+  // empty slot has ID 0, which is also the ID of no current interpreter, so
+  // that has to be checked for separately.
+  //
+  // This is an acquire load, which is enough to see everything the thread
+  // that stored the `PyObject*` did to it first. There's nothing else it has
+  // to be ordered with, so it doesn't need to be `seq_cst`.
+  std::optional<PyObject*> check_pyobj() const {
+    uint64_t word = word_.load(std::memory_order_acquire);
+    uint16_t id = static_cast<uint16_t>(word >> kPointerBits);
+    if (id == 0 || id != current_interpreter_tls().id) {
+      return std::nullopt;
+    }
+    return reinterpret_cast<PyObject*>(word & kPointerMask);
+  }
+
+  // Just whether this slot belongs to the calling thread's interpreter. This
+  // doesn't read the `PyObject` through the pointer, so relaxed is enough.
+  bool owned_by_current_interpreter() const {
+    uint64_t word = word_.load(std::memory_order_relaxed);
+    uint16_t id = static_cast<uint16_t>(word >> kPointerBits);
+    return id != 0 && id == current_interpreter_tls().id;
+  }
+
+ private:
+  static constexpr int kPointerBits = 48;
+  static constexpr uint64_t kPointerMask = (uint64_t(1) << kPointerBits) - 1;
+
+  static uint64_t pack(State state) {
+    uint64_t ptr = reinterpret_cast<uint64_t>(state.pyobj);
+    if (ptr & ~kPointerMask) {
+      throw std::invalid_argument("PyObject pointer doesn't fit in 48 bits");
+    }
+    uint64_t id = state.interpreter ? state.interpreter->id() : 0;
+    return (id << kPointerBits) | ptr;
+  }
+
+  static State unpack(uint64_t word) {
+    uint16_t id = static_cast<uint16_t>(word >> kPointerBits);
+    return {
+      id ? PyInterpreterRegistry::get(id) : nullptr,
+      reinterpret_cast<PyObject*>(word & kPointerMask),
+    };
+  }
+
+  std::atomic<uint64_t> word_;
+};
+
+static_assert(sizeof(PyObjectSlot) == 8, "PyObjectSlot should be one word");
+
+inline void swap(PyObjectSlot& lhs, PyObjectSlot& rhs) {
+  if (&lhs == &rhs) {
+    return;
+  }
+  uint64_t lhs_word = lhs.word_.load(std::memory_order_acquire);
+  lhs.word_.store(rhs.word_.exchange(lhs_word, std::memory_order_acq_rel), std::memory_order_release);
+}
+
+class StorageImpl {
+ private:
+  PyObjectSlot pyobj_slot_;
+};
+
+} // namespace c10
+
+// The accessors from main.cpp, for comparison. The interpreter is a `seq_cst`
+// atomic and the `PyObject*` is a separate field, which is only written
+// before the slot is shared, so reading it here isn't a race.
+class SeqCstPyObjectSlot {
+ public:
+  void init_pyobj(c10::PyInterpreter* pyobj_interpreter, c10::PyObject* pyobj) {
+    pyobj_ = pyobj;
+    pyobj_interpreter_ = pyobj_interpreter;
+  }
+
+  c10::PyInterpreter* pyobj_interpreter() const {
+    return pyobj_interpreter_;
+  }
+
+  c10::PyObject* pyobj() const {
+    return pyobj_;
+  }
+
+  std::optional<c10::PyObject*> check_pyobj() const {
+    if (pyobj_interpreter() != c10::current_interpreter()) {
+      return std::nullopt;
+    }
+    return pyobj();
+  }
+
+ private:
+  std::atomic<c10::PyInterpreter*> pyobj_interpreter_{nullptr};
+  c10::PyObject* pyobj_ = nullptr;
+};
+
+void check(bool cond, const char* msg) {
+  std::cout << (cond ? "yay. " : "BOO. ") << msg << std::endl;
+}
+
+void examples() {
+  c10::PyInterpreter interp_a;
+  c10::PyInterpreter interp_b;
+  c10::PyObject obj;
+  c10::PyObjectSlot slot;
+  slot.init_pyobj(&interp_a, &obj);
+
+  check(!slot.check_pyobj().has_value(), "no current interpreter, not owned");
+  c10::PyObjectSlot empty_slot;
+  check(!empty_slot.check_pyobj().has_value() && !empty_slot.owned_by_current_interpreter(),
+    "no current interpreter, empty slot not owned");
+  {
+    c10::InterpreterGuard guard(&interp_a);
+    check(slot.check_pyobj() == &obj, "owned by the current interpreter");
+    check(slot.owned_by_current_interpreter(), "owned_by_current_interpreter agrees");
+    {
+      c10::InterpreterGuard inner(&interp_b);
+      check(!slot.check_pyobj().has_value() && !slot.owned_by_current_interpreter(),
+        "not owned by a different interpreter");
+    }
+    check(slot.check_pyobj() == &obj, "guard restores the previous interpreter");
+  }
+  std::thread([&] {
+    check(!slot.check_pyobj().has_value(), "current interpreter is per thread");
+  }).join();
+  std::cout << std::endl;
+}
+
+template <typename T>
+inline void do_not_optimize(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Each thread enters one of two interpreters and checks every slot in a table
+// where the slots alternate between the two, many times over
+template <typename Slot, typename Func>
+void bench(const char* name, size_t num_threads, Func check_slot) {
+  const size_t num_slots = 4096;
+  const size_t rounds = 5000;
+  static c10::PyInterpreter interpreters[2];
+  std::vector<c10::PyObject> objects(num_slots);
+  std::vector<Slot> slots(num_slots);
+  for (size_t i = 0; i < num_slots; i++) {
+    slots[i].init_pyobj(&interpreters[i % 2], &objects[i]);
+  }
+
+  std::atomic<size_t> total_owned{0};
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+    threads.emplace_back([&, thread_idx] {
+      c10::InterpreterGuard guard(&interpreters[thread_idx % 2]);
+      size_t owned = 0;
+      for (size_t round = 0; round < rounds; round++) {
+        for (const Slot& slot : slots) {
+          owned += check_slot(slot);
+        }
+        do_not_optimize(owned);
+      }
+      total_owned += owned;
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+  double checks = double(num_threads) * rounds * num_slots;
+  std::cout << "  " << name << "  threads: " << num_threads
+    << "  ns/check: " << std::chrono::duration<double, std::nano>(end - start).count() * num_threads / checks
+    << "  owned: " << (total_owned == checks / 2 ? "half, as expected" : "WRONG")
+    << std::endl;
+}
+
+int main() {
+  examples();
+
+  size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+  bench<SeqCstPyObjectSlot>("seq_cst accessors          ", num_threads, [](const SeqCstPyObjectSlot& slot) {
+    auto pyobj = slot.check_pyobj();
+    return pyobj.has_value() && *pyobj != nullptr;
+  });
+  bench<c10::PyObjectSlot>("load() + table lookup      ", num_threads, [](const c10::PyObjectSlot& slot) {
+    auto state = slot.load();
+    return state.interpreter == c10::current_interpreter() && state.pyobj != nullptr;
+  });
+  bench<c10::PyObjectSlot>("check_pyobj(), acquire     ", num_threads, [](const c10::PyObjectSlot& slot) {
+    auto pyobj = slot.check_pyobj();
+    return pyobj.has_value() && *pyobj != nullptr;
+  });
+  bench<c10::PyObjectSlot>("owned_by_current, relaxed  ", num_threads, [](const c10::PyObjectSlot& slot) {
+    return slot.owned_by_current_interpreter();
+  });
+}
@@ -0,0 +1,575 @@
+// Same as main2.cpp, with a cache of Python wrappers for hermetic mode.
+//
+// When `HermeticPyObjectTLS` is enabled, which `EnableHermeticPyObject` does
+// while a Python kernel registered with `torch.library` runs, PyObjects are
+// never saved in a `PyObjectSlot` (see
+// pytorch/pyobj-preservation/HermeticPyObjectTLS.md). So every time the
+// kernel touches the same storage, it gets a brand new wrapper, which means
+// an allocation, and `a is a` style identity checks fail within one call.
+//
+// Here, wrapping a storage in hermetic mode looks in a thread-local
+// `HermeticPyObjectCache`, keyed by the address of the storage's
+// `PyObjectSlot`, before making a new wrapper. So within one hermetic region,
+// the same storage always gets the same wrapper.
+//
+//  * The cache holds a reference to each wrapper, and each hermetic wrapper
+//    holds a strong reference to its storage. So a storage in the cache can't
+//    be freed, and its slot address can't be reused by a different storage
+//    while the entry exists.
+//
+//  * The outermost `EnableHermeticPyObject` clears the cache when it's
+//    entered and when it exits, which drops the cache's references. A nested
+//    one shares the outer region's cache. Wrappers never outlive the region
+//    in the cache, so nothing from one hermetic call leaks into the next.
+//
+//  * It's thread-local like the hermetic flag itself, so there's no locking.
+//    A kernel only touches a few storages, so the first entries go in a flat
+//    array that's searched linearly, and only the rest go in a hash map.
+//
+// Outside hermetic mode, the wrapper is saved in the slot, like before.
+//
+// The benchmark runs a simulated hermetic kernel that wraps its three inputs
+// several times per call, and counts wrapper allocations per call with and
+// without the cache.
+//
+// Build with:
+//   g++ -std=c++17 -O2 -pthread main3.cpp -o main3
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <utility>
+#include <iostream>
+
+namespace c10 {
+
+class PyInterpreter;
+
+// Gives each interpreter a 16 bit ID, so it fits in a tagged word
+class PyInterpreterRegistry {
+ public:
+  static constexpr size_t kMaxInterpreters = size_t(1) << 16;
+
+  static uint16_t add(PyInterpreter* interpreter) {
+    size_t id = next_id_.fetch_add(1, std::memory_order_relaxed);
+    if (id >= kMaxInterpreters) {
+      throw std::runtime_error("too many interpreters");
+    }
+    interpreters_[id].store(interpreter, std::memory_order_release);
+    return static_cast<uint16_t>(id);
+  }
+
+  static PyInterpreter* get(uint16_t id) {
+    return interpreters_[id].load(std::memory_order_acquire);
+  }
+
+ private:
+  // Starts at 1, since 0 means no interpreter. Interpreters are never removed,
+  // so an interpreter has to outlive every slot that refers to it.
+  static inline std::atomic<size_t> next_id_{1};
+  static inline std::atomic<PyInterpreter*> interpreters_[kMaxInterpreters] = {};
+};
+
+class PyInterpreter {
+ public:
+  PyInterpreter() : id_(PyInterpreterRegistry::add(this)) {}
+
+  PyInterpreter(const PyInterpreter&) = delete;
+  PyInterpreter& operator=(const PyInterpreter&) = delete;
+
+  uint16_t id() const {
+    return id_;
+  }
+
+ private:
+  uint16_t id_;
+};
+
+class StorageImpl;
+
+// A Python wrapper for a storage, with a simulated Python refcount
+struct PyObject {
+  StorageImpl* storage;
+  // Hermetic wrappers keep their storage alive, like a real `THPStorage`
+  // holds a strong reference to its `StorageImpl`
+  std::shared_ptr<StorageImpl> keep_alive;
+  size_t refcount = 1;
+
+  static inline size_t num_allocated = 0;
+
+  PyObject(StorageImpl* storage, std::shared_ptr<StorageImpl> keep_alive)
+    : storage(storage), keep_alive(std::move(keep_alive)) {
+    num_allocated++;
+  }
+};
+
+inline void Py_INCREF(PyObject* obj) {
+  obj->refcount++;
+}
+
+inline void Py_DECREF(PyObject* obj) {
+  if (--obj->refcount == 0) {
+    delete obj;
+  }
+}
+
+// The interpreter that the calling thread is running, cached in a
+// `thread_local` so looking it up doesn't touch any shared memory. In
+// torch::deploy, each thread runs one interpreter at a time, and sets it with
+// `InterpreterGuard` when it enters that interpreter.
+struct CurrentInterpreter {
+  PyInterpreter* interpreter = nullptr;
+  uint16_t id = 0;
+};
+
+inline CurrentInterpreter& current_interpreter_tls() {
+  thread_local CurrentInterpreter current;
+  return current;
+}
+
+inline PyInterpreter* current_interpreter() {
+  return current_interpreter_tls().interpreter;
+}
+
+class InterpreterGuard {
+ public:
+  explicit InterpreterGuard(PyInterpreter* interpreter)
+    : prev_(current_interpreter_tls()) {
+    current_interpreter_tls() = {interpreter, interpreter ? interpreter->id() : uint16_t(0)};
+  }
+
+  ~InterpreterGuard() {
+    current_interpreter_tls() = prev_;
+  }
+
+  InterpreterGuard(const InterpreterGuard&) = delete;
+  InterpreterGuard& operator=(const InterpreterGuard&) = delete;
+
+ private:
+  CurrentInterpreter prev_;
+};
+
+class PyObjectSlot;
+inline void swap(PyObjectSlot& lhs, PyObjectSlot& rhs);
+
+class PyObjectSlot {
+ public:
+  struct State {
+    PyInterpreter* interpreter;
+    PyObject* pyobj;
+
+    bool operator==(const State& other) const {
+      return interpreter == other.interpreter && pyobj == other.pyobj;
+    }
+  };
+
+  PyObjectSlot()
+    : word_(0) {}
+
+  PyObjectSlot(PyObjectSlot&& other) noexcept
+    : word_(other.word_.exchange(0, std::memory_order_acq_rel)) {}
+
+  PyObjectSlot& operator=(PyObjectSlot&& other) noexcept {
+    if (this != &other) {
+      word_.store(other.word_.exchange(0, std::memory_order_acq_rel), std::memory_order_release);
+    }
+    return *this;
+  }
+
+  PyObjectSlot(const PyObjectSlot&) = delete;
+  PyObjectSlot& operator=(const PyObjectSlot&) = delete;
+
+  friend void swap(PyObjectSlot& lhs, PyObjectSlot& rhs);
+
+  State load() const {
+    return unpack(word_.load(std::memory_order_acquire));
+  }
+
+  void store(State state) {
+    word_.store(pack(state), std::memory_order_release);
+  }
+
+  void init_pyobj(PyInterpreter* pyobj_interpreter, PyObject* pyobj) {
+    store({pyobj_interpreter, pyobj});
+  }
+
+  // Replaces the pair with `desired` if it's still `expected`. Otherwise
+  // loads the current pair into `expected`.
+  bool compare_exchange(State& expected, State desired) {
+    uint64_t expected_word = pack(expected);
+    if (word_.compare_exchange_strong(expected_word, pack(desired),
+                                      std::memory_order_acq_rel, std::memory_order_acquire)) {
+      return true;
+    }
+    expected = unpack(expected_word);
+    return false;
+  }
+
+  // Keeps the current `PyObject*`
+  void set_pyobj_interpreter(PyInterpreter* pyobj_interpreter) {
+    State expected = load();
+    while (!compare_exchange(expected, {pyobj_interpreter, expected.pyobj})) {
+    }
+  }
+
+  PyInterpreter* pyobj_interpreter() const {
+    return load().interpreter;
+  }
+
+  PyObject* pyobj() const {
+    return load().pyobj;
+  }
+
+  // The fast path for wrapping a tensor. Returns the `PyObject*` if this slot
+  // belongs to the calling thread's interpreter, otherwise `nullopt`. Only
+  // compares interpreter IDs, so it doesn't look up the interpreter table. An
+  // empty slot has ID 0, which is also the ID of no current interpreter, so
+  // that has to be checked for separately.
+  //
+  // This is an acquire load, which is enough to see everything the thread
+  // that stored the `PyObject*` did to it first. There's nothing else it has
+  // to be ordered with, so it doesn't need to be `seq_cst`.
+  std::optional<PyObject*> check_pyobj() const {
+    uint64_t word = word_.load(std::memory_order_acquire);
+    uint16_t id = static_cast<uint16_t>(word >> kPointerBits);
+    if (id == 0 || id != current_interpreter_tls().id) {
+      return std::nullopt;
+    }
+    return reinterpret_cast<PyObject*>(word & kPointerMask);
+  }
+
+  // Just whether this slot belongs to the calling thread's interpreter. This
+  // doesn't read the `PyObject` through the pointer, so relaxed is enough.
+  bool owned_by_current_interpreter() const {
+    uint64_t word = word_.load(std::memory_order_relaxed);
+    uint16_t id = static_cast<uint16_t>(word >> kPointerBits);
+    return id != 0 && id == current_interpreter_tls().id;
+  }
+
+ private:
+  static constexpr int kPointerBits = 48;
+  static constexpr uint64_t kPointerMask = (uint64_t(1) << kPointerBits) - 1;
+
+  static uint64_t pack(State state) {
+    uint64_t ptr = reinterpret_cast<uint64_t>(state.pyobj);
+    if (ptr & ~kPointerMask) {
+      throw std::invalid_argument("PyObject pointer doesn't fit in 48 bits");
+    }
+    uint64_t id = state.interpreter ? state.interpreter->id() : 0;
+    return (id << kPointerBits) | ptr;
+  }
+
+  static State unpack(uint64_t word) {
+    uint16_t id = static_cast<uint16_t>(word >> kPointerBits);
+    return {
+      id ? PyInterpreterRegistry::get(id) : nullptr,
+      reinterpret_cast<PyObject*>(word & kPointerMask),
+    };
+  }
+
+  std::atomic<uint64_t> word_;
+};
+
+static_assert(sizeof(PyObjectSlot) == 8, "PyObjectSlot should be one word");
+
+inline void swap(PyObjectSlot& lhs, PyObjectSlot& rhs) {
+  if (&lhs == &rhs) {
+    return;
+  }
+  uint64_t lhs_word = lhs.word_.load(std::memory_order_acquire);
+  lhs.word_.store(rhs.word_.exchange(lhs_word, std::memory_order_acq_rel), std::memory_order_release);
+}
+
+
+class StorageImpl {
+ public:
+  ~StorageImpl() {
+    // A wrapper saved outside hermetic mode belongs to the slot
+    if (PyObject* obj = pyobj_slot_.pyobj()) {
+      Py_DECREF(obj);
+    }
+  }
+
+  PyObjectSlot& pyobj_slot() {
+    return pyobj_slot_;
+  }
+
+ private:
+  PyObjectSlot pyobj_slot_;
+};
+
+namespace impl {
+struct HermeticPyObjectTLS {
+  static bool get_state() {
+    return state();
+  }
+
+  static void set_state(bool new_state) {
+    state() = new_state;
+  }
+
+ private:
+  static bool& state() {
+    thread_local bool hermetic = false;
+    return hermetic;
+  }
+};
+
+// Wrappers made in the current hermetic region on this thread. The flat array
+// keeps its capacity between regions, so a region that only wraps a few
+// storages doesn't allocate anything for the cache.
+class HermeticPyObjectCache {
+ public:
+  static constexpr size_t kSmallSize = 16;
+
+  static HermeticPyObjectCache& get() {
+    thread_local HermeticPyObjectCache cache;
+    return cache;
+  }
+
+  // Returns a new reference, or nullptr
+  PyObject* lookup(const PyObjectSlot* slot) {
+    PyObject* obj = nullptr;
+    for (const Entry& entry : small_) {
+      if (entry.slot == slot) {
+        obj = entry.obj;
+        break;
+      }
+    }
+    if (!obj && !overflow_.empty()) {
+      auto it = overflow_.find(slot);
+      if (it != overflow_.end()) {
+        obj = it->second;
+      }
+    }
+    if (obj) {
+      Py_INCREF(obj);
+    }
+    return obj;
+  }
+
+  void insert(const PyObjectSlot* slot, PyObject* obj) {
+    Py_INCREF(obj);
+    if (small_.size() < kSmallSize) {
+      small_.push_back({slot, obj});
+    } else {
+      overflow_.emplace(slot, obj);
+    }
+  }
+
+  // Dropping a wrapper can free its storage, but freeing a storage never
+  // looks at this cache, so it's fine to do while iterating
+  void clear() {
+    for (const Entry& entry : small_) {
+      Py_DECREF(entry.obj);
+    }
+    small_.clear();
+    for (auto& [slot, obj] : overflow_) {
+      Py_DECREF(obj);
+    }
+    overflow_.clear();
+  }
+
+  size_t size() const {
+    return small_.size() + overflow_.size();
+  }
+
+  ~HermeticPyObjectCache() {
+    clear();
+  }
+
+ private:
+  struct Entry {
+    const PyObjectSlot* slot;
+    PyObject* obj;
+  };
+
+  std::vector<Entry> small_;
+  std::unordered_map<const PyObjectSlot*, PyObject*> overflow_;
+};
+} // namespace impl
+
+} // namespace c10
+
+namespace torch {
+// Like `torch::impl::dispatch::EnableHermeticPyObject`. Only the outermost
+// one clears the cache.
+class EnableHermeticPyObject {
+ public:
+  EnableHermeticPyObject()
+    : old_(c10::impl::HermeticPyObjectTLS::get_state()) {
+    if (!old_) {
+      c10::impl::HermeticPyObjectCache::get().clear();
+    }
+    c10::impl::HermeticPyObjectTLS::set_state(true);
+  }
+
+  ~EnableHermeticPyObject() {
+    c10::impl::HermeticPyObjectTLS::set_state(old_);
+    if (!old_) {
+      c10::impl::HermeticPyObjectCache::get().clear();
+    }
+  }
+
+  EnableHermeticPyObject(const EnableHermeticPyObject&) = delete;
+  EnableHermeticPyObject& operator=(const EnableHermeticPyObject&) = delete;
+
+ private:
+  bool old_;
+};
+
+// Like `THPStorage_Wrap`. Returns a new reference.
+template <bool kUseHermeticCache = true>
+c10::PyObject* wrap(const std::shared_ptr<c10::StorageImpl>& storage) {
+  c10::PyObjectSlot& slot = storage->pyobj_slot();
+  if (c10::impl::HermeticPyObjectTLS::get_state()) {
+    if constexpr (kUseHermeticCache) {
+      auto& cache = c10::impl::HermeticPyObjectCache::get();
+      if (c10::PyObject* obj = cache.lookup(&slot)) {
+        return obj;
+      }
+      auto* obj = new c10::PyObject(storage.get(), storage);
+      cache.insert(&slot, obj);
+      return obj;
+    } else {
+      return new c10::PyObject(storage.get(), storage);
+    }
+  }
+  if (auto obj = slot.check_pyobj(); obj && *obj) {
+    c10::Py_INCREF(*obj);
+    return *obj;
+  }
+  auto* obj = new c10::PyObject(storage.get(), nullptr);
+  slot.init_pyobj(c10::current_interpreter(), obj);
+  c10::Py_INCREF(obj);
+  return obj;
+}
+} // namespace torch
+
+void check(bool cond, const char* msg) {
+  std::cout << (cond ? "yay. " : "BOO. ") << msg << std::endl;
+}
+
+void examples() {
+  c10::PyObjectSlot empty_slot;
+  check(!empty_slot.check_pyobj().has_value() && !empty_slot.owned_by_current_interpreter(),
+    "no current interpreter, empty slot not owned");
+
+  c10::PyInterpreter interpreter;
+  c10::InterpreterGuard interpreter_guard(&interpreter);
+  auto storage = std::make_shared<c10::StorageImpl>();
+  auto& cache = c10::impl::HermeticPyObjectCache::get();
+
+  {
+    torch::EnableHermeticPyObject hermetic;
+    c10::PyObject* a = torch::wrap(storage);
+    c10::PyObject* b = torch::wrap(storage);
+    check(a == b, "same wrapper within a hermetic region");
+    check(storage->pyobj_slot().pyobj() == nullptr, "hermetic wrapper isn't saved in the slot");
+    {
+      torch::EnableHermeticPyObject nested;
+      c10::PyObject* c = torch::wrap(storage);
+      check(c == a, "nested region shares the cache");
+      c10::Py_DECREF(c);
+    }
+    check(cache.size() == 1, "nested region doesn't clear the cache");
+    c10::Py_DECREF(a);
+    c10::Py_DECREF(b);
+  }
+  check(cache.size() == 0, "leaving the region clears the cache");
+
+  {
+    torch::EnableHermeticPyObject hermetic;
+    std::vector<std::shared_ptr<c10::StorageImpl>> many;
+    std::vector<c10::PyObject*> wrappers;
+    for (size_t i = 0; i < 40; i++) {
+      many.push_back(std::make_shared<c10::StorageImpl>());
+      c10::PyObject* obj = torch::wrap(many.back());
+      wrappers.push_back(obj);
+      c10::Py_DECREF(obj);
+    }
+    bool all_same = true;
+    for (size_t i = 0; i < many.size(); i++) {
+      c10::PyObject* obj = torch::wrap(many[i]);
+      all_same &= obj == wrappers[i];
+      c10::Py_DECREF(obj);
+    }
+    check(all_same && cache.size() == 40, "cache works past the flat array");
+  }
+
+  c10::PyObject* first;
+  {
+    torch::EnableHermeticPyObject hermetic;
+    first = torch::wrap(storage);
+  }
+  {
+    torch::EnableHermeticPyObject hermetic;
+    c10::PyObject* second = torch::wrap(storage);
+    check(second != first, "new region gets a new wrapper");
+    c10::Py_DECREF(second);
+  }
+  c10::Py_DECREF(first);
+
+  // A storage that only the hermetic wrapper keeps alive
+  std::weak_ptr<c10::StorageImpl> weak;
+  {
+    torch::EnableHermeticPyObject hermetic;
+    auto temp = std::make_shared<c10::StorageImpl>();
+    weak = temp;
+    c10::Py_DECREF(torch::wrap(temp));
+    temp.reset();
+    check(!weak.expired(), "cached wrapper keeps its storage alive in the region");
+  }
+  check(weak.expired(), "storage is freed when the region ends");
+
+  c10::PyObject* saved = torch::wrap(storage);
+  check(storage->pyobj_slot().pyobj() == saved, "outside hermetic mode, wrapper is saved in the slot");
+  c10::Py_DECREF(saved);
+  std::cout << std::endl;
+}
+
+// A Python kernel that reads its three inputs `accesses_per_input` times each,
+// wrapping them every time, like it would when it indexes or passes them to
+// other Python functions
+template <bool kUseHermeticCache>
+void bench(const char* name, size_t accesses_per_input) {
+  const size_t calls = 200'000;
+  c10::PyInterpreter interpreter;
+  c10::InterpreterGuard interpreter_guard(&interpreter);
+  std::vector<std::shared_ptr<c10::StorageImpl>> inputs;
+  for (size_t i = 0; i < 3; i++) {
+    inputs.push_back(std::make_shared<c10::StorageImpl>());
+  }
+
+  size_t allocated_before = c10::PyObject::num_allocated;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t call = 0; call < calls; call++) {
+    torch::EnableHermeticPyObject hermetic;
+    for (size_t access = 0; access < accesses_per_input; access++) {
+      for (auto& input : inputs) {
+        c10::Py_DECREF(torch::wrap<kUseHermeticCache>(input));
+      }
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  std::cout << "  " << name << "  accesses per input: " << accesses_per_input
+    << "  wrappers allocated per call: "
+    << double(c10::PyObject::num_allocated - allocated_before) / calls
+    << "  ns/call: " << std::chrono::duration<double, std::nano>(end - start).count() / calls
+    << std::endl;
+}
+
+int main() {
+  examples();
+
+  for (size_t accesses_per_input : {1, 4, 16}) {
+    bench<false>("no cache", accesses_per_input);
+    bench<true>("cache   ", accesses_per_input);
+  }
+}
@@ -0,0 +1,439 @@
+// Same slot as main1.cpp, plus a trait that says a type can be relocated with
+// `memcpy`, and a vector that uses it when it grows.
+//
+// In main.cpp, `std::vector<std::pair<size_t, PyObjectSlot>>` can only grow
+// because `PyObjectSlot` has a move constructor. Moving a `std::atomic` isn't
+// trivial, so growing the vector moves each element one at a time, and for
+// the slot in main1.cpp, each move is an atomic `exchange` on the old
+// element, which is a locked instruction on x86.
+//
+// But when a vector grows, nothing else can be looking at its elements, and
+// the old elements are destroyed right after they're moved. Moving the bytes
+// to the new buffer and never running the old element's destructor, which is
+// what "relocating" means, gives the same result for any type that doesn't
+// point into itself. `PyObjectSlot` is just a tagged word, so it qualifies.
+//
+// `is_trivially_relocatable<T>` is true for trivially copyable types, and
+// types opt in by specializing it, like `folly::IsRelocatable` and the
+// proposed `std::is_trivially_relocatable` (P1144). `std::pair` is
+// relocatable when both of its members are. `RelocatableVector<T>` grows with
+// `realloc` when `T` is trivially relocatable, which often doesn't even copy
+// for big buffers, and otherwise moves and destroys each element, which is
+// why it needs `T`'s move constructor to be `noexcept`.
+//
+// The benchmark grows a vector of (index, `StorageImpl`) pairs to 1M elements
+// without reserving, for the `StorageImpl` from main.cpp in a `std::vector`,
+// for a `StorageImpl` with the slot from main1.cpp in a `std::vector`, and for
+// the same in a `RelocatableVector`.
+//
+// Build with:
+//   g++ -std=c++17 -O2 -pthread main4.cpp -o main4
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include <utility>
+#include <iostream>
+
+template <typename T>
+struct is_trivially_relocatable : std::is_trivially_copyable<T> {};
+
+template <typename A, typename B>
+struct is_trivially_relocatable<std::pair<A, B>>
+  : std::conjunction<is_trivially_relocatable<A>, is_trivially_relocatable<B>> {};
+
+template <typename T>
+inline constexpr bool is_trivially_relocatable_v = is_trivially_relocatable<T>::value;
+
+namespace c10 {
+
+class PyInterpreter;
+
+// Gives each interpreter a 16 bit ID, so it fits in a tagged word
+class PyInterpreterRegistry {
+ public:
+  static constexpr size_t kMaxInterpreters = size_t(1) << 16;
+
+  static uint16_t add(PyInterpreter* interpreter) {
+    size_t id = next_id_.fetch_add(1, std::memory_order_relaxed);
+    if (id >= kMaxInterpreters) {
+      throw std::runtime_error("too many interpreters");
+    }
+    interpreters_[id].store(interpreter, std::memory_order_release);
+    return static_cast<uint16_t>(id);
+  }
+
+  static PyInterpreter* get(uint16_t id) {
+    return interpreters_[id].load(std::memory_order_acquire);
+  }
+
+ private:
+  // Starts at 1, since 0 means no interpreter. Interpreters are never removed,
+  // so an interpreter has to outlive every slot that refers to it.
+  static inline std::atomic<size_t> next_id_{1};
+  static inline std::atomic<PyInterpreter*> interpreters_[kMaxInterpreters] = {};
+};
+
+class PyInterpreter {
+ public:
+  PyInterpreter() : id_(PyInterpreterRegistry::add(this)) {}
+
+  PyInterpreter(const PyInterpreter&) = delete;
+  PyInterpreter& operator=(const PyInterpreter&) = delete;
+
+  uint16_t id() const {
+    return id_;
+  }
+
+ private:
+  uint16_t id_;
+};
+
+class PyObject {
+};
+
+class PyObjectSlot;
+inline void swap(PyObjectSlot& lhs, PyObjectSlot& rhs);
+
+class PyObjectSlot {
+ public:
+  struct State {
+    PyInterpreter* interpreter;
+    PyObject* pyobj;
+
+    bool operator==(const State& other) const {
+      return interpreter == other.interpreter && pyobj == other.pyobj;
+    }
+  };
+
+  PyObjectSlot()
+    : word_(0) {}
+
+  PyObjectSlot(PyObjectSlot&& other) noexcept
+    : word_(other.word_.exchange(0, std::memory_order_acq_rel)) {}
+
+  PyObjectSlot& operator=(PyObjectSlot&& other) noexcept {
+    if (this != &other) {
+      word_.store(other.word_.exchange(0, std::memory_order_acq_rel), std::memory_order_release);
+    }
+    return *this;
+  }
+
+  PyObjectSlot(const PyObjectSlot&) = delete;
+  PyObjectSlot& operator=(const PyObjectSlot&) = delete;
+
+  friend void swap(PyObjectSlot& lhs, PyObjectSlot& rhs);
+
+  State load() const {
+    return unpack(word_.load(std::memory_order_acquire));
+  }
+
+  void store(State state) {
+    word_.store(pack(state), std::memory_order_release);
+  }
+
+  void init_pyobj(PyInterpreter* pyobj_interpreter, PyObject* pyobj) {
+    store({pyobj_interpreter, pyobj});
+  }
+
+  // Replaces the pair with `desired` if it's still `expected`. Otherwise
+  // loads the current pair into `expected`.
+  bool compare_exchange(State& expected, State desired) {
+    uint64_t expected_word = pack(expected);
+    if (word_.compare_exchange_strong(expected_word, pack(desired),
+                                      std::memory_order_acq_rel, std::memory_order_acquire)) {
+      return true;
+    }
+    expected = unpack(expected_word);
+    return false;
+  }
+
+  // Keeps the current `PyObject*`
+  void set_pyobj_interpreter(PyInterpreter* pyobj_interpreter) {
+    State expected = load();
+    while (!compare_exchange(expected, {pyobj_interpreter, expected.pyobj})) {
+    }
+  }
+
+  PyInterpreter* pyobj_interpreter() const {
+    return load().interpreter;
+  }
+
+  PyObject* pyobj() const {
+    return load().pyobj;
+  }
+
+ private:
+  static constexpr int kPointerBits = 48;
+  static constexpr uint64_t kPointerMask = (uint64_t(1) << kPointerBits) - 1;
+
+  static uint64_t pack(State state) {
+    uint64_t ptr = reinterpret_cast<uint64_t>(state.pyobj);
+    if (ptr & ~kPointerMask) {
+      throw std::invalid_argument("PyObject pointer doesn't fit in 48 bits");
+    }
+    uint64_t id = state.interpreter ? state.interpreter->id() : 0;
+    return (id << kPointerBits) | ptr;
+  }
+
+  static State unpack(uint64_t word) {
+    uint16_t id = static_cast<uint16_t>(word >> kPointerBits);
+    return {
+      id ? PyInterpreterRegistry::get(id) : nullptr,
+      reinterpret_cast<PyObject*>(word & kPointerMask),
+    };
+  }
+
+  std::atomic<uint64_t> word_;
+};
+
+static_assert(sizeof(PyObjectSlot) == 8, "PyObjectSlot should be one word");
+
+inline void swap(PyObjectSlot& lhs, PyObjectSlot& rhs) {
+  if (&lhs == &rhs) {
+    return;
+  }
+  uint64_t lhs_word = lhs.word_.load(std::memory_order_acquire);
+  lhs.word_.store(rhs.word_.exchange(lhs_word, std::memory_order_acq_rel), std::memory_order_release);
+}
+
+class StorageImpl {
+ public:
+  StorageImpl() = default;
+  explicit StorageImpl(size_t nbytes) : nbytes_(nbytes) {}
+
+  size_t nbytes() const {
+    return nbytes_;
+  }
+
+  PyObjectSlot& pyobj_slot() {
+    return pyobj_slot_;
+  }
+
+ private:
+  PyObjectSlot pyobj_slot_;
+  size_t nbytes_ = 0;
+};
+
+} // namespace c10
+
+// Nothing points into a slot, and it has no destructor, so relocating its word
+// is the same as moving it and destroying the old one
+template <>
+struct is_trivially_relocatable<c10::PyObjectSlot> : std::true_type {};
+
+template <>
+struct is_trivially_relocatable<c10::StorageImpl>
+  : std::conjunction<is_trivially_relocatable<c10::PyObjectSlot>, is_trivially_relocatable<size_t>> {};
+
+// The slot and `StorageImpl` from main.cpp, for comparison. Its move
+// constructor still only copies the interpreter.
+namespace legacy {
+class PyObjectSlot {
+ public:
+  PyObjectSlot()
+    : pyobj_interpreter_(nullptr) {}
+
+  PyObjectSlot(PyObjectSlot&& other)
+    : pyobj_interpreter_(other.pyobj_interpreter_.load()) {}
+
+  c10::PyInterpreter* pyobj_interpreter() {
+    return pyobj_interpreter_;
+  }
+
+  void set_pyobj_interpreter(c10::PyInterpreter* pyobj_interpreter) {
+    pyobj_interpreter_ = pyobj_interpreter;
+  }
+
+ private:
+  std::atomic<c10::PyInterpreter*> pyobj_interpreter_;
+  c10::PyObject* pyobj_;
+};
+
+class StorageImpl {
+ public:
+  StorageImpl() = default;
+  explicit StorageImpl(size_t nbytes) : nbytes_(nbytes) {}
+  StorageImpl(StorageImpl&&) = default;
+
+  size_t nbytes() const {
+    return nbytes_;
+  }
+
+ private:
+  PyObjectSlot pyobj_slot_;
+  size_t nbytes_ = 0;
+};
+} // namespace legacy
+
+// A minimal vector that relocates its elements with `realloc` when it grows,
+// if they're trivially relocatable
+template <typename T>
+class RelocatableVector {
+ public:
+  static_assert(alignof(T) <= alignof(std::max_align_t),
+    "RelocatableVector uses malloc, which only guarantees max_align_t alignment");
+
+  RelocatableVector() = default;
+  RelocatableVector(const RelocatableVector&) = delete;
+  RelocatableVector& operator=(const RelocatableVector&) = delete;
+
+  ~RelocatableVector() {
+    for (size_t i = 0; i < size_; i++) {
+      data_[i].~T();
+    }
+    std::free(data_);
+  }
+
+  template <typename... Args>
+  T& emplace_back(Args&&... args) {
+    if (size_ == capacity_) {
+      return grow_and_emplace_back(std::forward<Args>(args)...);
+    }
+    T* elem = new (&data_[size_]) T(std::forward<Args>(args)...);
+    size_++;
+    return *elem;
+  }
+
+  T& operator[](size_t i) {
+    return data_[i];
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+ private:
+  // The new element is made before the old buffer is freed, since `args`
+  // might refer to an element, like in `v.emplace_back(v[0])`
+  template <typename... Args>
+  T& grow_and_emplace_back(Args&&... args) {
+    size_t new_capacity = capacity_ ? capacity_ * 2 : 16;
+    if constexpr (is_trivially_relocatable_v<T>) {
+      // `realloc` may free the old buffer, so the element is made on the
+      // stack first, then relocated into place
+      alignas(T) unsigned char storage[sizeof(T)];
+      T* temp = new (storage) T(std::forward<Args>(args)...);
+      void* new_data = std::realloc(static_cast<void*>(data_), new_capacity * sizeof(T));
+      if (!new_data) {
+        temp->~T();
+        throw std::bad_alloc();
+      }
+      data_ = static_cast<T*>(new_data);
+      std::memcpy(static_cast<void*>(&data_[size_]), storage, sizeof(T));
+    } else {
+      static_assert(std::is_nothrow_move_constructible_v<T>,
+        "RelocatableVector can't recover from a move that throws while it grows");
+      T* new_data = static_cast<T*>(std::malloc(new_capacity * sizeof(T)));
+      if (!new_data) {
+        throw std::bad_alloc();
+      }
+      try {
+        new (&new_data[size_]) T(std::forward<Args>(args)...);
+      } catch (...) {
+        std::free(new_data);
+        throw;
+      }
+      for (size_t i = 0; i < size_; i++) {
+        new (&new_data[i]) T(std::move(data_[i]));
+        data_[i].~T();
+      }
+      std::free(data_);
+      data_ = new_data;
+    }
+    capacity_ = new_capacity;
+    return data_[size_++];
+  }
+
+  T* data_ = nullptr;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+};
+
+static_assert(is_trivially_relocatable_v<std::pair<size_t, c10::StorageImpl>>);
+static_assert(!is_trivially_relocatable_v<std::pair<size_t, legacy::StorageImpl>>);
+
+void check(bool cond, const char* msg) {
+  std::cout << (cond ? "yay. " : "BOO. ") << msg << std::endl;
+}
+
+void examples() {
+  c10::PyInterpreter interpreter;
+  std::vector<c10::PyObject> objects(1000);
+  RelocatableVector<std::pair<size_t, c10::StorageImpl>> v;
+  for (size_t i = 0; i < objects.size(); i++) {
+    auto& elem = v.emplace_back(i, c10::StorageImpl(i * 8));
+    elem.second.pyobj_slot().init_pyobj(&interpreter, &objects[i]);
+  }
+  bool all_kept = true;
+  for (size_t i = 0; i < v.size(); i++) {
+    auto state = v[i].second.pyobj_slot().load();
+    all_kept &= v[i].first == i && v[i].second.nbytes() == i * 8 &&
+      state.interpreter == &interpreter && state.pyobj == &objects[i];
+  }
+  check(all_kept, "slots keep their interpreter and PyObject through relocation");
+
+  RelocatableVector<std::pair<size_t, size_t>> full;
+  while (full.size() < 16) {
+    full.emplace_back(full.size(), full.size() * 8);
+  }
+  full.emplace_back(full[1]);
+  check(full.size() == 17 && full[16].first == 1 && full[16].second == 8,
+    "emplace_back of an element when full, relocated with realloc");
+
+  RelocatableVector<std::pair<size_t, std::string>> strings;
+  while (strings.size() < 16) {
+    strings.emplace_back(strings.size(), "a string that is too long to be stored inline");
+  }
+  strings.emplace_back(strings[1]);
+  check(strings.size() == 17 && strings[16].first == 1 && strings[16].second == strings[0].second,
+    "emplace_back of an element when full, moved");
+  std::cout << std::endl;
+}
+
+template <typename Func>
+double time_ms(Func func) {
+  auto start = std::chrono::steady_clock::now();
+  func();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+template <typename Vector>
+double bench_growth(size_t num_elements) {
+  double best = 1e100;
+  for (size_t rep = 0; rep < 5; rep++) {
+    best = std::min(best, time_ms([&] {
+      Vector v;
+      for (size_t i = 0; i < num_elements; i++) {
+        v.emplace_back(std::piecewise_construct, std::forward_as_tuple(i), std::forward_as_tuple(i));
+      }
+      if (v.size() != num_elements) {
+        std::abort();
+      }
+    }));
+  }
+  return best;
+}
+
+int main() {
+  examples();
+
+  const size_t num_elements = 1'000'000;
+  std::cout << "grow to " << num_elements << " elements, best of 5, ms:" << std::endl;
+  std::cout << "  std::vector, main.cpp StorageImpl:     "
+    << bench_growth<std::vector<std::pair<size_t, legacy::StorageImpl>>>(num_elements) << std::endl;
+  std::cout << "  std::vector, tagged slot StorageImpl:  "
+    << bench_growth<std::vector<std::pair<size_t, c10::StorageImpl>>>(num_elements) << std::endl;
+  std::cout << "  RelocatableVector, tagged slot:        "
+    << bench_growth<RelocatableVector<std::pair<size_t, c10::StorageImpl>>>(num_elements) << std::endl;
+}
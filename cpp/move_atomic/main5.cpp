@@ -0,0 +1,500 @@
+// Same slot as main1.cpp, plus an optional central table that holds the
+// PyObject slots of all storages as a structure of arrays.
+//
+// In main.cpp, every `StorageImpl` has its own `PyObjectSlot`. So a sweep over
+// all storages, like clearing every slot that belongs to an interpreter that's
+// being torn down, touches a different cache line for every storage, most of
+// which is the rest of the `StorageImpl` that the sweep doesn't care about.
+//
+// Here, `PyObjectSlotTable` keeps the interpreter IDs of all slots in one
+// array and the `PyObject*`s in another, and a `StorageImpl` that uses it
+// just stores a `StorageHandle`, which is an index into both arrays. A sweep
+// reads the interpreter ID array in order, 32 slots per cache line, and only
+// looks at the `PyObject*` array for slots that match. It checks the IDs a
+// block at a time with a loop the compiler can vectorize, and skips blocks
+// with no matches.
+//
+// The two arrays can't be updated together atomically, so the table follows
+// the same rules as `PyObjectSlot` in PyTorch:
+//
+//  * An interpreter claims an empty slot by compare-exchanging its ID into the
+//    ID array, and only the interpreter that won the compare-exchange writes
+//    the slot's `PyObject*`, with release, after that. So a slot that's owned
+//    can briefly have a null `PyObject*`, which readers treat as not set yet.
+//    Readers load the ID first, then the `PyObject*` with acquire.
+//
+//  * Sweeps happen while the table isn't being used by any other thread,
+//    like a stop-the-world GC, so they can use plain loads and stores, which
+//    is what lets them be vectorized. Per-slot accesses use the `__atomic`
+//    builtins on the same plain arrays, which is what C++20's
+//    `std::atomic_ref` does.
+//
+// The benchmark sweeps 10M storages for one interpreter, when it owns a
+// quarter of the slots and when it owns almost none, with the slots embedded
+// in heap allocated `StorageImpl`s and with the table.
+//
+// Build with:
+//   g++ -std=c++17 -O2 -pthread main5.cpp -o main5
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <iostream>
+
+namespace c10 {
+
+class PyInterpreter;
+
+// Gives each interpreter a 16 bit ID, so it fits in a tagged word
+class PyInterpreterRegistry {
+ public:
+  static constexpr size_t kMaxInterpreters = size_t(1) << 16;
+
+  static uint16_t add(PyInterpreter* interpreter) {
+    size_t id = next_id_.fetch_add(1, std::memory_order_relaxed);
+    if (id >= kMaxInterpreters) {
+      throw std::runtime_error("too many interpreters");
+    }
+    interpreters_[id].store(interpreter, std::memory_order_release);
+    return static_cast<uint16_t>(id);
+  }
+
+  static PyInterpreter* get(uint16_t id) {
+    return interpreters_[id].load(std::memory_order_acquire);
+  }
+
+ private:
+  // Starts at 1, since 0 means no interpreter. Interpreters are never removed,
+  // so an interpreter has to outlive every slot that refers to it.
+  static inline std::atomic<size_t> next_id_{1};
+  static inline std::atomic<PyInterpreter*> interpreters_[kMaxInterpreters] = {};
+};
+
+class PyInterpreter {
+ public:
+  PyInterpreter() : id_(PyInterpreterRegistry::add(this)) {}
+
+  PyInterpreter(const PyInterpreter&) = delete;
+  PyInterpreter& operator=(const PyInterpreter&) = delete;
+
+  uint16_t id() const {
+    return id_;
+  }
+
+ private:
+  uint16_t id_;
+};
+
+class PyObject {
+};
+
+class PyObjectSlot;
+inline void swap(PyObjectSlot& lhs, PyObjectSlot& rhs);
+
+class PyObjectSlot {
+ public:
+  struct State {
+    PyInterpreter* interpreter;
+    PyObject* pyobj;
+
+    bool operator==(const State& other) const {
+      return interpreter == other.interpreter && pyobj == other.pyobj;
+    }
+  };
+
+  PyObjectSlot()
+    : word_(0) {}
+
+  PyObjectSlot(PyObjectSlot&& other) noexcept
+    : word_(other.word_.exchange(0, std::memory_order_acq_rel)) {}
+
+  PyObjectSlot& operator=(PyObjectSlot&& other) noexcept {
+    if (this != &other) {
+      word_.store(other.word_.exchange(0, std::memory_order_acq_rel), std::memory_order_release);
+    }
+    return *this;
+  }
+
+  PyObjectSlot(const PyObjectSlot&) = delete;
+  PyObjectSlot& operator=(const PyObjectSlot&) = delete;
+
+  friend void swap(PyObjectSlot& lhs, PyObjectSlot& rhs);
+
+  State load() const {
+    return unpack(word_.load(std::memory_order_acquire));
+  }
+
+  void store(State state) {
+    word_.store(pack(state), std::memory_order_release);
+  }
+
+  void init_pyobj(PyInterpreter* pyobj_interpreter, PyObject* pyobj) {
+    store({pyobj_interpreter, pyobj});
+  }
+
+  // Replaces the pair with `desired` if it's still `expected`. Otherwise
+  // loads the current pair into `expected`.
+  bool compare_exchange(State& expected, State desired) {
+    uint64_t expected_word = pack(expected);
+    if (word_.compare_exchange_strong(expected_word, pack(desired),
+                                      std::memory_order_acq_rel, std::memory_order_acquire)) {
+      return true;
+    }
+    expected = unpack(expected_word);
+    return false;
+  }
+
+  // Keeps the current `PyObject*`
+  void set_pyobj_interpreter(PyInterpreter* pyobj_interpreter) {
+    State expected = load();
+    while (!compare_exchange(expected, {pyobj_interpreter, expected.pyobj})) {
+    }
+  }
+
+  PyInterpreter* pyobj_interpreter() const {
+    return load().interpreter;
+  }
+
+  PyObject* pyobj() const {
+    return load().pyobj;
+  }
+
+ private:
+  static constexpr int kPointerBits = 48;
+  static constexpr uint64_t kPointerMask = (uint64_t(1) << kPointerBits) - 1;
+
+  static uint64_t pack(State state) {
+    uint64_t ptr = reinterpret_cast<uint64_t>(state.pyobj);
+    if (ptr & ~kPointerMask) {
+      throw std::invalid_argument("PyObject pointer doesn't fit in 48 bits");
+    }
+    uint64_t id = state.interpreter ? state.interpreter->id() : 0;
+    return (id << kPointerBits) | ptr;
+  }
+
+  static State unpack(uint64_t word) {
+    uint16_t id = static_cast<uint16_t>(word >> kPointerBits);
+    return {
+      id ? PyInterpreterRegistry::get(id) : nullptr,
+      reinterpret_cast<PyObject*>(word & kPointerMask),
+    };
+  }
+
+  std::atomic<uint64_t> word_;
+};
+
+static_assert(sizeof(PyObjectSlot) == 8, "PyObjectSlot should be one word");
+
+inline void swap(PyObjectSlot& lhs, PyObjectSlot& rhs) {
+  if (&lhs == &rhs) {
+    return;
+  }
+  uint64_t lhs_word = lhs.word_.load(std::memory_order_acquire);
+  lhs.word_.store(rhs.word_.exchange(lhs_word, std::memory_order_acq_rel), std::memory_order_release);
+}
+
+// A `StorageImpl` with its own slot, like main.cpp. The other members are
+// stand-ins for the rest of a real `StorageImpl`.
+class StorageImpl {
+ public:
+  PyObjectSlot& pyobj_slot() {
+    return pyobj_slot_;
+  }
+
+ private:
+  std::atomic<size_t> refcount_{1};
+  std::atomic<size_t> weakcount_{1};
+  void* data_ = nullptr;
+  void* ctx_ = nullptr;
+  void* deleter_ = nullptr;
+  size_t nbytes_ = 0;
+  void* allocator_ = nullptr;
+  PyObjectSlot pyobj_slot_;
+};
+
+using StorageHandle = uint32_t;
+
+class PyObjectSlotTable {
+ public:
+  // How many slots a sweep checks at a time
+  static constexpr size_t kBlockSize = 64;
+
+  explicit PyObjectSlotTable(size_t capacity)
+    : capacity_((capacity + kBlockSize - 1) / kBlockSize * kBlockSize),
+      interpreter_ids_(new uint16_t[capacity_]()),
+      pyobjs_(new PyObject*[capacity_]()) {}
+
+  StorageHandle allocate() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!free_handles_.empty()) {
+      StorageHandle handle = free_handles_.back();
+      free_handles_.pop_back();
+      return handle;
+    }
+    if (next_handle_ == capacity_) {
+      throw std::runtime_error("PyObjectSlotTable is full");
+    }
+    return static_cast<StorageHandle>(next_handle_++);
+  }
+
+  // The storage must not be in use by anything else
+  void release(StorageHandle handle) {
+    interpreter_ids_[handle] = 0;
+    pyobjs_[handle] = nullptr;
+    std::lock_guard<std::mutex> guard(mutex_);
+    free_handles_.push_back(handle);
+  }
+
+  // Sets the interpreter and `PyObject*` if the slot is empty, or if it
+  // already belongs to `interpreter`. Returns false if it belongs to another
+  // interpreter.
+  bool init_pyobj(StorageHandle handle, PyInterpreter* interpreter, PyObject* pyobj) {
+    uint16_t expected = 0;
+    // Claim the slot before touching the `PyObject*`, so an interpreter that
+    // loses the race never writes it
+    if (!__atomic_compare_exchange_n(&interpreter_ids_[handle], &expected, interpreter->id(),
+                                     false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+        expected != interpreter->id()) {
+      return false;
+    }
+    __atomic_store_n(&pyobjs_[handle], pyobj, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  PyInterpreter* pyobj_interpreter(StorageHandle handle) const {
+    uint16_t id = __atomic_load_n(&interpreter_ids_[handle], __ATOMIC_ACQUIRE);
+    return id ? PyInterpreterRegistry::get(id) : nullptr;
+  }
+
+  // Returns nullptr unless the slot belongs to `interpreter` and its owner
+  // has set the `PyObject*`
+  PyObject* pyobj(StorageHandle handle, const PyInterpreter* interpreter) const {
+    if (__atomic_load_n(&interpreter_ids_[handle], __ATOMIC_ACQUIRE) != interpreter->id()) {
+      return nullptr;
+    }
+    return __atomic_load_n(&pyobjs_[handle], __ATOMIC_ACQUIRE);
+  }
+
+  // Clears every slot that belongs to `interpreter`, and returns how many
+  // there were. Nothing else may use the table while this runs.
+  size_t clear_interpreter(const PyInterpreter* interpreter) {
+    const uint16_t id = interpreter->id();
+    uint16_t* ids = interpreter_ids_.get();
+    PyObject** pyobjs = pyobjs_.get();
+    size_t num_cleared = 0;
+    for (size_t base = 0; base < capacity_; base += kBlockSize) {
+      // GCC vectorizes this loop at -O2
+      uint16_t any = 0;
+      for (size_t i = 0; i < kBlockSize; i++) {
+        any |= ids[base + i] == id;
+      }
+      if (!any) {
+        continue;
+      }
+      for (size_t i = base; i < base + kBlockSize; i++) {
+        if (ids[i] == id) {
+          ids[i] = 0;
+          pyobjs[i] = nullptr;
+          num_cleared++;
+        }
+      }
+    }
+    return num_cleared;
+  }
+
+  // The same sweep one slot at a time, for comparison
+  size_t clear_interpreter_scalar(const PyInterpreter* interpreter) {
+    const uint16_t id = interpreter->id();
+    size_t num_cleared = 0;
+    for (size_t i = 0; i < capacity_; i++) {
+      if (__atomic_load_n(&interpreter_ids_[i], __ATOMIC_RELAXED) == id) {
+        __atomic_store_n(&interpreter_ids_[i], uint16_t(0), __ATOMIC_RELAXED);
+        __atomic_store_n(&pyobjs_[i], nullptr, __ATOMIC_RELAXED);
+        num_cleared++;
+      }
+    }
+    return num_cleared;
+  }
+
+ private:
+  size_t capacity_;
+  std::unique_ptr<uint16_t[]> interpreter_ids_;
+  std::unique_ptr<PyObject*[]> pyobjs_;
+
+  std::mutex mutex_;
+  size_t next_handle_ = 0;
+  std::vector<StorageHandle> free_handles_;
+};
+
+// A `StorageImpl` whose slot lives in a `PyObjectSlotTable`
+class TableStorageImpl {
+ public:
+  explicit TableStorageImpl(PyObjectSlotTable& table)
+    : table_(table), pyobj_handle_(table.allocate()) {}
+
+  ~TableStorageImpl() {
+    table_.release(pyobj_handle_);
+  }
+
+  TableStorageImpl(const TableStorageImpl&) = delete;
+  TableStorageImpl& operator=(const TableStorageImpl&) = delete;
+
+  StorageHandle pyobj_handle() const {
+    return pyobj_handle_;
+  }
+
+ private:
+  std::atomic<size_t> refcount_{1};
+  std::atomic<size_t> weakcount_{1};
+  void* data_ = nullptr;
+  void* ctx_ = nullptr;
+  void* deleter_ = nullptr;
+  size_t nbytes_ = 0;
+  void* allocator_ = nullptr;
+  PyObjectSlotTable& table_;
+  StorageHandle pyobj_handle_;
+};
+
+} // namespace c10
+
+void check(bool cond, const char* msg) {
+  std::cout << (cond ? "yay. " : "BOO. ") << msg << std::endl;
+}
+
+void examples() {
+  c10::PyInterpreter interp_a;
+  c10::PyInterpreter interp_b;
+  c10::PyObject obj_a;
+  c10::PyObject obj_b;
+  c10::PyObjectSlotTable table(1000);
+
+  c10::TableStorageImpl s0(table);
+  c10::TableStorageImpl s1(table);
+  check(table.init_pyobj(s0.pyobj_handle(), &interp_a, &obj_a), "claim empty slot");
+  check(!table.init_pyobj(s0.pyobj_handle(), &interp_b, &obj_b), "can't claim a slot owned by another interpreter");
+  check(table.init_pyobj(s1.pyobj_handle(), &interp_b, &obj_b), "claim another slot");
+  check(table.pyobj(s0.pyobj_handle(), &interp_a) == &obj_a && table.pyobj(s0.pyobj_handle(), &interp_b) == nullptr,
+    "pyobj only for the owning interpreter");
+  check(table.clear_interpreter(&interp_a) == 1, "sweep clears one slot");
+  check(table.pyobj_interpreter(s0.pyobj_handle()) == nullptr &&
+        table.pyobj_interpreter(s1.pyobj_handle()) == &interp_b,
+    "sweep only clears the given interpreter");
+
+  c10::StorageHandle released;
+  {
+    c10::TableStorageImpl temp(table);
+    table.init_pyobj(temp.pyobj_handle(), &interp_a, &obj_a);
+    released = temp.pyobj_handle();
+  }
+  c10::TableStorageImpl reused(table);
+  check(reused.pyobj_handle() == released && table.pyobj_interpreter(released) == nullptr,
+    "released handle is reused and empty");
+
+  // Two interpreters race to claim the same empty slots. Every slot must end
+  // up with the `PyObject*` of the interpreter that owns it.
+  const size_t num_slots = 100'000;
+  c10::PyObjectSlotTable race_table(num_slots);
+  std::vector<std::unique_ptr<c10::TableStorageImpl>> storages;
+  for (size_t i = 0; i < num_slots; i++) {
+    storages.push_back(std::make_unique<c10::TableStorageImpl>(race_table));
+  }
+  std::vector<char> won_a(num_slots);
+  std::vector<char> won_b(num_slots);
+  std::atomic<bool> go{false};
+  auto race = [&](c10::PyInterpreter* interpreter, c10::PyObject* obj, std::vector<char>& won) {
+    while (!go.load(std::memory_order_acquire)) {}
+    for (size_t i = 0; i < num_slots; i++) {
+      won[i] = race_table.init_pyobj(storages[i]->pyobj_handle(), interpreter, obj);
+    }
+  };
+  std::thread thread_a(race, &interp_a, &obj_a, std::ref(won_a));
+  std::thread thread_b(race, &interp_b, &obj_b, std::ref(won_b));
+  go.store(true, std::memory_order_release);
+  thread_a.join();
+  thread_b.join();
+  size_t num_mismatched = 0;
+  for (size_t i = 0; i < num_slots; i++) {
+    c10::StorageHandle handle = storages[i]->pyobj_handle();
+    c10::PyInterpreter* owner = race_table.pyobj_interpreter(handle);
+    bool ok = (owner == &interp_a && won_a[i] && !won_b[i] && race_table.pyobj(handle, owner) == &obj_a) ||
+              (owner == &interp_b && won_b[i] && !won_a[i] && race_table.pyobj(handle, owner) == &obj_b);
+    num_mismatched += !ok;
+  }
+  check(num_mismatched == 0, "racing init_pyobj leaves every slot with its owner's PyObject*");
+  std::cout << std::endl;
+}
+
+template <typename Func>
+double time_ms(Func func) {
+  auto start = std::chrono::steady_clock::now();
+  func();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Gives each of `num_storages` storages to interpreter `target` with
+// probability `fraction`, and to another interpreter otherwise, then times
+// clearing the slots of `target`
+void bench(size_t num_storages, double fraction) {
+  static c10::PyInterpreter target;
+  static c10::PyInterpreter other;
+  static c10::PyObject obj;
+  std::mt19937 rng(0);
+  std::bernoulli_distribution is_target(fraction);
+  std::vector<bool> owners(num_storages);
+  for (size_t i = 0; i < num_storages; i++) {
+    owners[i] = is_target(rng);
+  }
+
+  std::cout << "  " << fraction * 100 << "% of slots owned by the swept interpreter:" << std::endl;
+  {
+    std::vector<std::unique_ptr<c10::StorageImpl>> storages;
+    storages.reserve(num_storages);
+    for (size_t i = 0; i < num_storages; i++) {
+      storages.push_back(std::make_unique<c10::StorageImpl>());
+      storages.back()->pyobj_slot().init_pyobj(owners[i] ? &target : &other, &obj);
+    }
+    size_t num_cleared = 0;
+    double ms = time_ms([&] {
+      for (auto& storage : storages) {
+        c10::PyObjectSlot& slot = storage->pyobj_slot();
+        if (slot.pyobj_interpreter() == &target) {
+          slot.store({nullptr, nullptr});
+          num_cleared++;
+        }
+      }
+    });
+    std::cout << "    embedded slots:  " << ms << " ms  cleared: " << num_cleared << std::endl;
+  }
+  for (bool vectorized : {false, true}) {
+    c10::PyObjectSlotTable table(num_storages);
+    std::vector<std::unique_ptr<c10::TableStorageImpl>> storages;
+    storages.reserve(num_storages);
+    for (size_t i = 0; i < num_storages; i++) {
+      storages.push_back(std::make_unique<c10::TableStorageImpl>(table));
+      table.init_pyobj(storages.back()->pyobj_handle(), owners[i] ? &target : &other, &obj);
+    }
+    size_t num_cleared = 0;
+    double ms = time_ms([&] {
+      num_cleared = vectorized ? table.clear_interpreter(&target) : table.clear_interpreter_scalar(&target);
+    });
+    std::cout << (vectorized ? "    table, blocked:  " : "    table, scalar:   ")
+      << ms << " ms  cleared: " << num_cleared << std::endl;
+  }
+}
+
+int main() {
+  examples();
+
+  const size_t num_storages = 10'000'000;
+  std::cout << "sweep " << num_storages << " storages:" << std::endl;
+  bench(num_storages, 0.25);
+  bench(num_storages, 0.0001);
+}
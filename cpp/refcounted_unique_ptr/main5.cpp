@@ -0,0 +1,390 @@
+// Same as main4.cpp, except `RefcountedDeleterContext`s come from a pool
+// instead of `new` and `delete`.
+//
+// In main4.cpp, every shared buffer does `new RefcountedDeleterContext`, and
+// the last `refcounted_deleter` call does `delete`. For lots of small shared
+// buffers, that's two extra trips to the heap per buffer.
+//
+// Here, `ContextPool` gives each thread its own `ThreadCache`, which carves
+// contexts out of slabs of `kSlabSize` contexts and keeps freed contexts on a
+// free list. Every context remembers which cache it came from:
+//
+//  * If it's freed on the thread that owns that cache, it goes right back on
+//    the cache's free list, with no synchronization.
+//
+//  * If it's freed on some other thread, it's pushed onto the owning cache's
+//    return stack, which is a lock-free stack that any thread can push onto.
+//    When the owning thread's free list is empty, it takes the whole return
+//    stack with one `exchange`, so there's no ABA problem.
+//
+// A context can be returned to a cache after the thread that owns the cache
+// has exited, so caches and slabs are never freed. When a thread exits, its
+// cache goes on a list of orphaned caches, and the next new thread adopts it
+// instead of making a new one.
+//
+// The benchmark makes and frees shared contexts on one thread, and also makes
+// them on one thread and frees them on another, and compares the pool with
+// `new` and `delete`. Each benchmark runs in a forked child process so the
+// peak RSS it reports doesn't include the other benchmarks.
+//
+// Build with:
+//   g++ -std=c++17 -O2 -pthread main5.cpp -o main5
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+using DeleterFnPtr = void (*)(void*);
+
+void example_cpu_deleter(void* ctx) {
+  std::cout << "in example_cpu_dealloc" << std::endl;
+  void* ptr = ctx;
+  std::cout << "  ptr: " << ptr << std::endl;
+}
+
+struct RefcountedDeleterContext {
+  RefcountedDeleterContext(void* ptr, DeleterFnPtr concrete_deleter)
+    : concrete_deleter(concrete_deleter), refcount(1), ptr(ptr) {}
+
+  // Only call this while holding a reference
+  void incref() {
+    refcount.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Returns true if this was the last reference
+  bool decref() {
+    return refcount.fetch_sub(1, std::memory_order_acq_rel) == 1;
+  }
+
+  DeleterFnPtr concrete_deleter;
+  std::atomic<size_t> refcount;
+  void* ptr;
+};
+
+class ContextPool {
+ public:
+  static constexpr size_t kSlabSize = 256;
+
+  static RefcountedDeleterContext* allocate(void* ptr, DeleterFnPtr concrete_deleter) {
+    ThreadCache& cache = thread_cache();
+    PooledContext* pooled = cache.free_list;
+    if (!pooled) {
+      pooled = cache.take_returned();
+    }
+    if (!pooled) {
+      pooled = cache.new_slab();
+    }
+    cache.free_list = pooled->next_free;
+    return new (&pooled->ctx) RefcountedDeleterContext(ptr, concrete_deleter);
+  }
+
+  static void free(RefcountedDeleterContext* ctx) {
+    auto* pooled = reinterpret_cast<PooledContext*>(ctx);
+    ctx->~RefcountedDeleterContext();
+    ThreadCache* owner = pooled->owner;
+    if (owner == &thread_cache()) {
+      pooled->next_free = owner->free_list;
+      owner->free_list = pooled;
+    } else {
+      owner->give_back(pooled);
+    }
+  }
+
+  // Number of slabs allocated by all threads so far
+  static size_t num_slabs() {
+    return num_slabs_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct ThreadCache;
+
+  // `ctx` has to be the first member, so a context pointer can be cast back
+  // to the `PooledContext` that holds it
+  struct PooledContext {
+    union {
+      RefcountedDeleterContext ctx;
+    };
+    ThreadCache* owner;
+    PooledContext* next_free;
+
+    PooledContext() {}
+    ~PooledContext() {}
+  };
+
+  struct ThreadCache {
+    // Only touched by the thread that owns this cache
+    PooledContext* free_list = nullptr;
+    // Contexts freed by other threads
+    std::atomic<PooledContext*> returned{nullptr};
+
+    PooledContext* take_returned() {
+      if (!returned.load(std::memory_order_relaxed)) {
+        return nullptr;
+      }
+      return returned.exchange(nullptr, std::memory_order_acquire);
+    }
+
+    void give_back(PooledContext* pooled) {
+      PooledContext* head = returned.load(std::memory_order_relaxed);
+      do {
+        pooled->next_free = head;
+      } while (!returned.compare_exchange_weak(
+        head, pooled, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    PooledContext* new_slab() {
+      auto* slab = new PooledContext[kSlabSize];
+      for (size_t i = 0; i < kSlabSize; i++) {
+        slab[i].owner = this;
+        slab[i].next_free = i + 1 < kSlabSize ? &slab[i + 1] : nullptr;
+      }
+      num_slabs_.fetch_add(1, std::memory_order_relaxed);
+      return slab;
+    }
+  };
+
+  // Adopts an orphaned cache when the thread starts, and orphans it when the
+  // thread exits
+  struct ThreadCacheHandle {
+    ThreadCache* cache;
+
+    ThreadCacheHandle() {
+      std::lock_guard<std::mutex> guard(orphans_mutex());
+      auto& orphans = orphaned_caches();
+      if (orphans.empty()) {
+        cache = new ThreadCache();
+      } else {
+        cache = orphans.back();
+        orphans.pop_back();
+      }
+    }
+
+    ~ThreadCacheHandle() {
+      std::lock_guard<std::mutex> guard(orphans_mutex());
+      orphaned_caches().push_back(cache);
+    }
+  };
+
+  static ThreadCache& thread_cache() {
+    thread_local ThreadCacheHandle handle;
+    return *handle.cache;
+  }
+
+  // Leaked, since threads can exit after static destructors run
+  static std::mutex& orphans_mutex() {
+    static auto* mutex = new std::mutex();
+    return *mutex;
+  }
+
+  static std::vector<ThreadCache*>& orphaned_caches() {
+    static auto* caches = new std::vector<ThreadCache*>();
+    return *caches;
+  }
+
+  static inline std::atomic<size_t> num_slabs_{0};
+};
+
+void refcounted_deleter(void* ctx) {
+  RefcountedDeleterContext& ctx_ = *reinterpret_cast<RefcountedDeleterContext*>(ctx);
+  if (ctx_.decref()) {
+    ctx_.concrete_deleter(ctx_.ptr);
+    ContextPool::free(&ctx_);
+  }
+}
+
+// The version from main4.cpp, for comparison
+void refcounted_deleter_new(void* ctx) {
+  RefcountedDeleterContext& ctx_ = *reinterpret_cast<RefcountedDeleterContext*>(ctx);
+  if (ctx_.decref()) {
+    ctx_.concrete_deleter(ctx_.ptr);
+    delete &ctx_;
+  }
+}
+
+// This is a shortened version of `UniqueVoidPtr` taken from `c10/util/UniqueVoidPtr.h`
+class UniqueVoidPtr {
+ private:
+  void* data_;
+  std::unique_ptr<void, DeleterFnPtr> ctx_;
+ public:
+  UniqueVoidPtr() : data_(nullptr), ctx_(nullptr, &refcounted_deleter) {}
+
+  UniqueVoidPtr(void* data, void* ctx, DeleterFnPtr ctx_deleter)
+    : data_(data), ctx_(ctx, ctx_deleter) {}
+
+  void clear() {
+    ctx_ = nullptr;
+    data_ = nullptr;
+  }
+
+  void* get() const {
+    return data_;
+  }
+
+  void* get_context() const {
+    return ctx_.get();
+  }
+
+  DeleterFnPtr get_deleter() const {
+    return ctx_.get_deleter();
+  }
+};
+
+// Makes a `UniqueVoidPtr` that owns `data` through a new refcounted context
+UniqueVoidPtr make_refcounted(void* data, DeleterFnPtr concrete_deleter) {
+  auto* ctx = ContextPool::allocate(data, concrete_deleter);
+  return UniqueVoidPtr(data, ctx, &refcounted_deleter);
+}
+
+UniqueVoidPtr make_refcounted_new(void* data, DeleterFnPtr concrete_deleter) {
+  auto* ctx = new RefcountedDeleterContext(data, concrete_deleter);
+  return UniqueVoidPtr(data, ctx, &refcounted_deleter_new);
+}
+
+// Makes another `UniqueVoidPtr` that shares the buffer of `ptr`, which must
+// have been made by `make_refcounted` or `make_refcounted_new`
+UniqueVoidPtr share(const UniqueVoidPtr& ptr) {
+  auto* ctx = static_cast<RefcountedDeleterContext*>(ptr.get_context());
+  ctx->incref();
+  return UniqueVoidPtr(ptr.get(), ctx, ptr.get_deleter());
+}
+
+void check(bool cond, const char* msg) {
+  std::cout << (cond ? "yay. " : "BOO. ") << msg << std::endl;
+}
+
+void example() {
+  void* buffer = (void*)2;
+  UniqueVoidPtr ptr1 = make_refcounted(buffer, &example_cpu_deleter);
+  UniqueVoidPtr ptr2 = share(ptr1);
+  void* first_ctx = ptr1.get_context();
+  std::cout << "clearing first ptr" << std::endl;
+  ptr1.clear();
+  std::cout << "clearing second ptr" << std::endl;
+  ptr2.clear();
+  std::cout << "----------------------" << std::endl;
+
+  UniqueVoidPtr ptr3 = make_refcounted(buffer, &example_cpu_deleter);
+  check(ptr3.get_context() == first_ctx, "freed context is reused on the same thread");
+  // Free it on another thread, so it goes on this thread's return stack
+  std::thread([&] { ptr3.clear(); }).join();
+  UniqueVoidPtr ptr4 = make_refcounted(buffer, &example_cpu_deleter);
+  check(ptr4.get_context() != first_ctx, "context freed on another thread isn't on the free list");
+  std::vector<UniqueVoidPtr> drain;
+  for (size_t i = 0; i < ContextPool::kSlabSize; i++) {
+    drain.push_back(make_refcounted(nullptr, [](void*) {}));
+  }
+  bool reused = false;
+  for (auto& ptr : drain) {
+    reused |= ptr.get_context() == first_ctx;
+  }
+  check(reused, "context freed on another thread is reused after the free list runs out");
+  check(ContextPool::num_slabs() == 2, "only two slabs were needed");
+  drain.clear();
+  ptr4.clear();
+  std::cout << "----------------------" << std::endl;
+}
+
+size_t peak_rss_kb() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.rfind("VmHWM:", 0) == 0) {
+      return std::strtoull(line.c_str() + 6, nullptr, 10);
+    }
+  }
+  return 0;
+}
+
+// Runs `func` in a child process so its peak RSS is measured on its own
+template <typename Func>
+void in_child_process(Func func) {
+  std::cout.flush();
+  pid_t pid = fork();
+  if (pid == 0) {
+    func();
+    std::cout.flush();
+    std::_Exit(0);
+  }
+  waitpid(pid, nullptr, 0);
+}
+
+void noop_deleter(void*) {}
+
+using MakeFn = UniqueVoidPtr (*)(void*, DeleterFnPtr);
+
+// Keeps a window of live shared buffers, each with two references, and
+// replaces the oldest one each iteration
+void bench_same_thread(MakeFn make, const char* name) {
+  const size_t iters = 20'000'000;
+  const size_t window = 4096;
+  std::vector<UniqueVoidPtr> live(window * 2);
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iters; i++) {
+    size_t idx = (i % window) * 2;
+    live[idx] = make(nullptr, &noop_deleter);
+    live[idx + 1] = share(live[idx]);
+  }
+  auto end = std::chrono::steady_clock::now();
+  live.clear();
+  double secs = std::chrono::duration<double>(end - start).count();
+  std::cout << "  " << name << "  same thread      M contexts/sec: " << iters / secs / 1e6
+    << "  peak RSS MiB: " << peak_rss_kb() / 1024 << std::endl;
+}
+
+// One thread makes batches of shared buffers, and another thread clears them
+void bench_cross_thread(MakeFn make, const char* name) {
+  const size_t num_batches = 2000;
+  const size_t batch_size = 4096;
+  std::vector<UniqueVoidPtr> batches[2];
+  std::atomic<size_t> ready{0};
+  std::atomic<size_t> done{0};
+
+  auto start = std::chrono::steady_clock::now();
+  std::thread consumer([&] {
+    for (size_t batch = 1; batch <= num_batches; batch++) {
+      while (ready.load(std::memory_order_acquire) < batch) {
+        std::this_thread::yield();
+      }
+      batches[batch % 2].clear();
+      done.store(batch, std::memory_order_release);
+    }
+  });
+  for (size_t batch = 1; batch <= num_batches; batch++) {
+    // Wait until the consumer is done with the batch from two rounds ago
+    while (batch > 2 && done.load(std::memory_order_acquire) < batch - 2) {
+      std::this_thread::yield();
+    }
+    auto& ptrs = batches[batch % 2];
+    for (size_t i = 0; i < batch_size; i++) {
+      ptrs.push_back(make(nullptr, &noop_deleter));
+    }
+    ready.store(batch, std::memory_order_release);
+  }
+  consumer.join();
+  auto end = std::chrono::steady_clock::now();
+  double secs = std::chrono::duration<double>(end - start).count();
+  std::cout << "  " << name << "  cross thread     M contexts/sec: "
+    << num_batches * batch_size / secs / 1e6
+    << "  peak RSS MiB: " << peak_rss_kb() / 1024 << std::endl;
+}
+
+int main() {
+  example();
+
+  std::cout << std::endl;
+  in_child_process([] { bench_same_thread(&make_refcounted_new, "new/delete"); });
+  in_child_process([] { bench_same_thread(&make_refcounted, "pool      "); });
+  in_child_process([] { bench_cross_thread(&make_refcounted_new, "new/delete"); });
+  in_child_process([] { bench_cross_thread(&make_refcounted, "pool      "); });
+}
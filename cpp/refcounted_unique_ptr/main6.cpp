@@ -0,0 +1,247 @@
+// Same idea as main0.cpp, but `RefcountedDeleter` is built on a plain
+// `DeleterFnPtr = void (*)(void*)` and a context pointer, like main3.cpp,
+// instead of `std::function`.
+//
+// In main0.cpp, `RefcountedDeleter` holds a `std::function` member whose
+// lambda captures `this`, and hands out pointers to that member. So calling a
+// deleter goes through a pointer to a `std::function`, which goes through
+// type erasure to the lambda, which calls `decref`, which calls the unique
+// deleter through another `std::function`. And if the `RefcountedDeleter` is
+// ever moved, like when a vector of them grows, the lambda still points at
+// the old object and every deleter handed out so far is dangling.
+//
+// Here, the refcount, the data pointer, and the unique deleter live in a
+// `RefcountedDeleterContext` on the heap, and a deleter is just the pair
+// `(&refcounted_deleter, ctx)`, which is what `UniqueVoidPtr` already stores.
+// `RefcountedDeleter` only holds the context pointer, so nothing points into
+// it, and it's trivially copyable. It can be moved, copied, or relocated with
+// `memcpy` without invalidating any deleter it has handed out.
+//
+// The benchmark compares the cost of calling a deleter that doesn't drop the
+// last reference, and one that does, for both versions.
+//
+// Build with:
+//   g++ -std=c++17 -O2 main6.cpp -o main6
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <type_traits>
+#include <vector>
+
+using DeleterFnPtr = void (*)(void*);
+
+static size_t num_cpu_deleter_calls = 0;
+
+void cpu_deleter(void* ptr) {
+  num_cpu_deleter_calls++;
+}
+
+struct RefcountedDeleterContext {
+  RefcountedDeleterContext(void* data, DeleterFnPtr unique_deleter)
+    : data(data), unique_deleter(unique_deleter), refcount(1) {}
+
+  void* data;
+  DeleterFnPtr unique_deleter;
+  size_t refcount;
+};
+
+// Drops one reference. Frees the data with the unique deleter if it was the
+// last one.
+void refcounted_deleter(void* ctx) {
+  auto* ctx_ = static_cast<RefcountedDeleterContext*>(ctx);
+  if (--ctx_->refcount == 0) {
+    ctx_->unique_deleter(ctx_->data);
+    delete ctx_;
+  }
+}
+
+// A deleter that can be stored in a `UniqueVoidPtr`
+struct BoundDeleter {
+  DeleterFnPtr fn;
+  void* ctx;
+
+  void operator()() const {
+    fn(ctx);
+  }
+};
+
+class RefcountedDeleter {
+ public:
+  // Starts with one reference, which belongs to the first deleter returned by
+  // `deleter()`
+  RefcountedDeleter(void* data, DeleterFnPtr unique_deleter)
+    : ctx_(new RefcountedDeleterContext(data, unique_deleter)) {}
+
+  BoundDeleter deleter() const {
+    return {&refcounted_deleter, ctx_};
+  }
+
+  // Returns a deleter that owns a new reference
+  BoundDeleter incref() const {
+    ctx_->refcount++;
+    return deleter();
+  }
+
+  size_t refcount() const {
+    return ctx_->refcount;
+  }
+
+ private:
+  RefcountedDeleterContext* ctx_;
+};
+
+static_assert(std::is_trivially_copyable_v<RefcountedDeleter>,
+  "RefcountedDeleter must be safe to relocate with memcpy");
+
+// The version from main0.cpp, without the printing
+namespace function_version {
+using DeleterFn = std::function<void(void*)>;
+using DeleterFnPtr = DeleterFn*;
+
+class RefcountedDeleter {
+ public:
+  RefcountedDeleter(DeleterFnPtr unique_deleter)
+    : unique_deleter_ptr(unique_deleter),
+      refcount_(1),
+      shared_deleter_fn([&](void* ptr) {
+        return decref(ptr);
+      })
+  {}
+
+  void decref(void* ptr) {
+    refcount_--;
+    if (refcount_ <= 0) {
+      (*unique_deleter_ptr)(ptr);
+    }
+  }
+
+  DeleterFnPtr ptr() {
+    return &shared_deleter_fn;
+  }
+
+  DeleterFnPtr incref() {
+    refcount_++;
+    return ptr();
+  }
+
+ private:
+  DeleterFnPtr unique_deleter_ptr;
+  size_t refcount_;
+  DeleterFn shared_deleter_fn;
+};
+} // namespace function_version
+
+void check(bool cond, const char* msg) {
+  std::cout << (cond ? "yay. " : "BOO. ") << msg << std::endl;
+}
+
+void example() {
+  void* data = (void*)1;
+  num_cpu_deleter_calls = 0;
+
+  // Keep the handles in a vector that reallocates as it grows, so they get
+  // moved after their deleters were handed out
+  std::vector<RefcountedDeleter> handles;
+  std::vector<BoundDeleter> deleters;
+  for (size_t i = 0; i < 100; i++) {
+    handles.emplace_back(data, &cpu_deleter);
+    deleters.push_back(handles.back().deleter());
+    deleters.push_back(handles.back().incref());
+  }
+
+  // Relocate one with memcpy too
+  alignas(RefcountedDeleter) unsigned char relocated[sizeof(RefcountedDeleter)];
+  std::memcpy(relocated, &handles[0], sizeof(RefcountedDeleter));
+  check(reinterpret_cast<RefcountedDeleter*>(relocated)->refcount() == 2,
+    "relocated handle sees the same refcount");
+
+  for (size_t i = 0; i < deleters.size(); i += 2) {
+    deleters[i]();
+  }
+  check(num_cpu_deleter_calls == 0, "unique deleter not called while a reference is left");
+  for (size_t i = 1; i < deleters.size(); i += 2) {
+    deleters[i]();
+  }
+  check(num_cpu_deleter_calls == 100, "unique deleter called once per buffer after handles moved");
+  std::cout << std::endl;
+}
+
+template <typename T>
+inline void do_not_optimize(T& value) {
+  asm volatile("" : "+r"(value) : : "memory");
+}
+
+// Average time of one call to `func`
+template <typename Func>
+double bench_ns(size_t iters, Func func) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iters; i++) {
+    func();
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / iters;
+}
+
+int main() {
+  example();
+
+  const size_t iters = 50'000'000;
+  void* data = (void*)1;
+
+  std::cout << "sizeof handle:  std::function: " << sizeof(function_version::RefcountedDeleter)
+    << "  function pointer: " << sizeof(RefcountedDeleter) << std::endl;
+
+  std::cout << "incref + call deleter, ns:" << std::endl;
+  {
+    function_version::DeleterFn cpu_deleter_fn = &cpu_deleter;
+    function_version::RefcountedDeleter refcounted(&cpu_deleter_fn);
+    double ns = bench_ns(iters, [&] {
+      function_version::DeleterFnPtr deleter = refcounted.incref();
+      // Hide where the deleter came from, like when it's stored in a
+      // `UniqueVoidPtr` and called later
+      do_not_optimize(deleter);
+      (*deleter)(data);
+    });
+    std::cout << "  std::function:    " << ns << std::endl;
+  }
+  {
+    RefcountedDeleter refcounted(data, &cpu_deleter);
+    BoundDeleter last = refcounted.deleter();
+    double ns = bench_ns(iters, [&] {
+      BoundDeleter deleter = refcounted.incref();
+      do_not_optimize(deleter.fn);
+      do_not_optimize(deleter.ctx);
+      deleter();
+    });
+    std::cout << "  function pointer: " << ns << std::endl;
+    last();
+  }
+
+  std::cout << "make + call last deleter, ns:" << std::endl;
+  {
+    function_version::DeleterFn cpu_deleter_fn = &cpu_deleter;
+    double ns = bench_ns(iters / 10, [&] {
+      auto* refcounted = new function_version::RefcountedDeleter(&cpu_deleter_fn);
+      function_version::DeleterFnPtr deleter = refcounted->ptr();
+      do_not_optimize(deleter);
+      (*deleter)(data);
+      // The `std::function` version can't free itself, since its `decref`
+      // only calls the unique deleter, so the owner has to delete it after
+      // the last call
+      delete refcounted;
+    });
+    std::cout << "  std::function:    " << ns << std::endl;
+  }
+  {
+    double ns = bench_ns(iters / 10, [&] {
+      RefcountedDeleter refcounted(data, &cpu_deleter);
+      BoundDeleter deleter = refcounted.deleter();
+      do_not_optimize(deleter.fn);
+      do_not_optimize(deleter.ctx);
+      deleter();
+    });
+    std::cout << "  function pointer: " << ns << std::endl;
+  }
+}
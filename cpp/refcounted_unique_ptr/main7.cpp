@@ -0,0 +1,200 @@
+// In main3.cpp and main4.cpp, a `UniqueVoidPtr` can only share its buffer if
+// whoever makes it builds a `RefcountedDeleterContext` first. But buffers are
+// normally allocated with a plain unique deleter, and we only find out later,
+// like when a lazy clone happens, that the buffer needs to be shared.
+//
+// Here, `maybe_apply_refcounted_deleter` takes an existing `UniqueVoidPtr`
+// and swaps its context and deleter for a refcounted context that wraps them:
+//
+//  * The original context and deleter are kept in the refcounted context, and
+//    the original deleter is called with the original context once the last
+//    reference is cleared. The original context doesn't have to be the data
+//    pointer, which main3.cpp assumed.
+//
+//  * The data pointer doesn't change, and the buffer is never copied. The
+//    only allocation is the refcounted context itself.
+//
+//  * It's idempotent. If the deleter is already `refcounted_deleter`, nothing
+//    changes, so calling it on every lazy clone is fine.
+//
+//  * If allocating the refcounted context throws, the `UniqueVoidPtr` is left
+//    exactly as it was. Otherwise, the swap is done with no window where the
+//    `UniqueVoidPtr` owns nothing or would free the buffer twice. The caller
+//    has to be the only one using the `UniqueVoidPtr` while it's upgraded, the
+//    same as for any other non-const method, but once it's upgraded, copies
+//    made by `share` can be used and cleared from any thread.
+//
+// Build with:
+//   g++ -std=c++17 -O2 main7.cpp -o main7
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <iostream>
+
+using DeleterFnPtr = void (*)(void*);
+
+struct RefcountedDeleterContext {
+  RefcountedDeleterContext(void* other_ctx, DeleterFnPtr other_deleter)
+    : other_ctx(other_ctx), other_deleter(other_deleter), refcount(1) {}
+
+  // Only call this while holding a reference
+  void incref() {
+    refcount.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Returns true if this was the last reference
+  bool decref() {
+    return refcount.fetch_sub(1, std::memory_order_acq_rel) == 1;
+  }
+
+  // The context and deleter that the `UniqueVoidPtr` had before it was shared
+  void* other_ctx;
+  DeleterFnPtr other_deleter;
+  std::atomic<size_t> refcount;
+};
+
+void refcounted_deleter(void* ctx) {
+  RefcountedDeleterContext& ctx_ = *reinterpret_cast<RefcountedDeleterContext*>(ctx);
+  if (ctx_.decref()) {
+    ctx_.other_deleter(ctx_.other_ctx);
+    delete &ctx_;
+  }
+}
+
+// This is a shortened version of `UniqueVoidPtr` taken from `c10/util/UniqueVoidPtr.h`
+class UniqueVoidPtr {
+ private:
+  void* data_;
+  std::unique_ptr<void, DeleterFnPtr> ctx_;
+ public:
+  UniqueVoidPtr(void* data, void* ctx, DeleterFnPtr ctx_deleter)
+    : data_(data), ctx_(ctx, ctx_deleter) {}
+
+  void clear() {
+    ctx_ = nullptr;
+    data_ = nullptr;
+  }
+
+  void* get() const {
+    return data_;
+  }
+
+  void* get_context() const {
+    return ctx_.get();
+  }
+
+  DeleterFnPtr get_deleter() const {
+    return ctx_.get_deleter();
+  }
+
+  // Replaces the context and deleter together, without calling the old
+  // deleter. Only does it if the current deleter is `expected_deleter`.
+  // This is the same as `c10::UniqueVoidPtr::compare_exchange_deleter`.
+  bool compare_exchange_deleter(DeleterFnPtr expected_deleter, void* new_ctx, DeleterFnPtr new_deleter) {
+    if (get_deleter() != expected_deleter) {
+      return false;
+    }
+    ctx_.release();
+    ctx_ = std::unique_ptr<void, DeleterFnPtr>(new_ctx, new_deleter);
+    return true;
+  }
+};
+
+// Makes `ptr` use a refcounted context that wraps its current context and
+// deleter. No-op if it already does.
+void maybe_apply_refcounted_deleter(UniqueVoidPtr& ptr) {
+  DeleterFnPtr deleter = ptr.get_deleter();
+  if (deleter == &refcounted_deleter) {
+    return;
+  }
+  // If this throws, `ptr` hasn't been changed
+  auto refcounted_ctx = std::make_unique<RefcountedDeleterContext>(ptr.get_context(), deleter);
+  if (ptr.compare_exchange_deleter(deleter, refcounted_ctx.get(), &refcounted_deleter)) {
+    refcounted_ctx.release();
+  }
+}
+
+// Makes another `UniqueVoidPtr` that shares the buffer of `ptr`, upgrading
+// `ptr` to a refcounted context first if needed
+UniqueVoidPtr share(UniqueVoidPtr& ptr) {
+  maybe_apply_refcounted_deleter(ptr);
+  auto* ctx = static_cast<RefcountedDeleterContext*>(ptr.get_context());
+  ctx->incref();
+  return UniqueVoidPtr(ptr.get(), ctx, &refcounted_deleter);
+}
+
+void check(bool cond, const char* msg) {
+  std::cout << (cond ? "yay. " : "BOO. ") << msg << std::endl;
+}
+
+static size_t num_frees = 0;
+
+void counting_free(void* ctx) {
+  num_frees++;
+  std::free(ctx);
+}
+
+// Like a device allocator, where the context isn't the data pointer
+struct AllocationRecord {
+  void* data;
+  size_t nbytes;
+};
+
+void record_deleter(void* ctx) {
+  auto* record = static_cast<AllocationRecord*>(ctx);
+  num_frees++;
+  std::free(record->data);
+  delete record;
+}
+
+// The buffer is allocated with a unique deleter, then a lazy clone shares it
+void example_lazy_clone() {
+  num_frees = 0;
+  void* buffer = std::malloc(64);
+  std::memset(buffer, 7, 64);
+  UniqueVoidPtr original(buffer, buffer, &counting_free);
+
+  maybe_apply_refcounted_deleter(original);
+  void* ctx = original.get_context();
+  check(original.get_deleter() == &refcounted_deleter, "deleter is now refcounted");
+  check(original.get() == buffer, "data pointer is unchanged");
+
+  maybe_apply_refcounted_deleter(original);
+  check(original.get_context() == ctx, "applying it again is a no-op");
+
+  UniqueVoidPtr clone = share(original);
+  check(clone.get() == buffer && static_cast<char*>(clone.get())[63] == 7,
+    "clone shares the buffer without a copy");
+  check(static_cast<RefcountedDeleterContext*>(ctx)->other_deleter == &counting_free,
+    "original deleter is kept");
+
+  original.clear();
+  check(num_frees == 0, "buffer isn't freed while the clone holds it");
+  clone.clear();
+  check(num_frees == 1, "buffer is freed once by the original deleter");
+  std::cout << "----------------------" << std::endl;
+}
+
+void example_separate_context() {
+  num_frees = 0;
+  auto* record = new AllocationRecord{std::malloc(64), 64};
+  UniqueVoidPtr original(record->data, record, &record_deleter);
+  UniqueVoidPtr clone1 = share(original);
+  UniqueVoidPtr clone2 = share(clone1);
+  check(clone2.get() == record->data, "all share the data pointer");
+  check(static_cast<RefcountedDeleterContext*>(clone2.get_context())->other_ctx == record,
+    "original context is kept, not the data pointer");
+  clone1.clear();
+  original.clear();
+  check(num_frees == 0, "buffer isn't freed while a clone holds it");
+  clone2.clear();
+  check(num_frees == 1, "buffer is freed once with the original context");
+  std::cout << "----------------------" << std::endl;
+}
+
+int main() {
+  example_lazy_clone();
+  example_separate_context();
+}
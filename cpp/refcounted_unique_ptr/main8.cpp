@@ -0,0 +1,363 @@
+// Same as main4.cpp, except the concrete deleter can be run later on a
+// background thread instead of on the thread that clears the last reference.
+//
+// In main4.cpp, when the last reference is cleared, `refcounted_deleter` calls
+// the concrete deleter right there. Freeing a big buffer can take a while
+// (for a `malloc`ed buffer that's big enough to be `mmap`ed, it's a `munmap`
+// and a TLB shootdown), and that time is spent on whatever thread happened to
+// drop the last reference, which might be one we care about the latency of.
+//
+// Here, `Reclaimer::set_mode(ReleaseMode::Deferred)` turns on deferred
+// release. Then the last `refcounted_deleter` call just pushes the context
+// onto a lock-free stack. The context is about to be deleted anyway, so it's
+// used as the stack node, and pushing doesn't allocate. A reclaimer thread
+// takes the whole stack with one `exchange`, and runs the concrete deleters
+// in the order they were pushed, then deletes the contexts.
+//
+// The reclaimer thread wakes up when `batch_size` releases are pending, or
+// after `max_delay` passes, whichever comes first. If `max_pending` releases
+// are already waiting, the reclaimer isn't keeping up, so `refcounted_deleter`
+// runs the concrete deleter itself, which puts a limit on how much memory can
+// be waiting to be freed. `flush()` runs everything that's pending on the
+// calling thread.
+//
+// The benchmark times each `clear()` of the last reference to a 1 MiB buffer,
+// with and without deferred release, and prints a latency histogram.
+//
+// Build with:
+//   g++ -std=c++17 -O2 -pthread main8.cpp -o main8
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <malloc.h>
+
+using DeleterFnPtr = void (*)(void*);
+
+struct RefcountedDeleterContext {
+  RefcountedDeleterContext(void* ptr, DeleterFnPtr concrete_deleter)
+    : concrete_deleter(concrete_deleter), refcount(1), ptr(ptr) {}
+
+  // Only call this while holding a reference
+  void incref() {
+    refcount.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Returns true if this was the last reference
+  bool decref() {
+    return refcount.fetch_sub(1, std::memory_order_acq_rel) == 1;
+  }
+
+  DeleterFnPtr concrete_deleter;
+  std::atomic<size_t> refcount;
+  void* ptr;
+  // Next context waiting to be released, if this one is deferred
+  RefcountedDeleterContext* next_pending = nullptr;
+};
+
+enum class ReleaseMode { Immediate, Deferred };
+
+struct ReclaimerConfig {
+  size_t batch_size = 64;
+  size_t max_pending = 4096;
+  std::chrono::microseconds max_delay{1000};
+};
+
+class Reclaimer {
+ public:
+  static Reclaimer& get() {
+    static Reclaimer reclaimer;
+    return reclaimer;
+  }
+
+  // Switching back to `Immediate` doesn't flush what's already pending
+  void set_mode(ReleaseMode mode, ReclaimerConfig config = ReclaimerConfig()) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    config_ = config;
+    batch_size_.store(config.batch_size, std::memory_order_relaxed);
+    max_pending_.store(config.max_pending, std::memory_order_relaxed);
+    mode_.store(mode, std::memory_order_relaxed);
+    if (mode == ReleaseMode::Deferred && !thread_.joinable()) {
+      thread_ = std::thread([this] { run(); });
+    }
+  }
+
+  ReleaseMode mode() const {
+    return mode_.load(std::memory_order_relaxed);
+  }
+
+  // Called when the last reference to `ctx` is dropped
+  void release(RefcountedDeleterContext* ctx) {
+    if (mode() == ReleaseMode::Immediate ||
+        pending_count_.load(std::memory_order_relaxed) >= max_pending_.load(std::memory_order_relaxed)) {
+      run_deleter(ctx);
+      return;
+    }
+    // Count it before pushing it, so the reclaimer never takes more off the
+    // stack than has been counted
+    size_t count = pending_count_.fetch_add(1, std::memory_order_relaxed) + 1;
+    RefcountedDeleterContext* head = pending_.load(std::memory_order_relaxed);
+    do {
+      ctx->next_pending = head;
+    } while (!pending_.compare_exchange_weak(
+      head, ctx, std::memory_order_release, std::memory_order_relaxed));
+    // Only wake the reclaimer once each time the count reaches the batch
+    // size, so most releases don't touch the condition variable at all. The
+    // mutex is taken before notifying, so the wakeup can't land between the
+    // reclaimer checking the count and going to sleep.
+    if (count >= batch_size_.load(std::memory_order_relaxed) &&
+        !wakeup_pending_.exchange(true, std::memory_order_relaxed)) {
+      { std::lock_guard<std::mutex> guard(mutex_); }
+      wakeup_.notify_one();
+    }
+  }
+
+  // Runs every pending release on this thread
+  void flush() {
+    run_pending();
+  }
+
+  size_t num_pending() const {
+    return pending_count_.load(std::memory_order_relaxed);
+  }
+
+  ~Reclaimer() {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      stop_ = true;
+    }
+    wakeup_.notify_one();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    run_pending();
+  }
+
+ private:
+  Reclaimer() = default;
+
+  static void run_deleter(RefcountedDeleterContext* ctx) {
+    ctx->concrete_deleter(ctx->ptr);
+    delete ctx;
+  }
+
+  void run_pending() {
+    RefcountedDeleterContext* ctx = pending_.exchange(nullptr, std::memory_order_acquire);
+    // The stack is newest first, so reverse it to release in order
+    RefcountedDeleterContext* reversed = nullptr;
+    size_t count = 0;
+    while (ctx) {
+      RefcountedDeleterContext* next = ctx->next_pending;
+      ctx->next_pending = reversed;
+      reversed = ctx;
+      ctx = next;
+      count++;
+    }
+    pending_count_.fetch_sub(count, std::memory_order_relaxed);
+    while (reversed) {
+      RefcountedDeleterContext* next = reversed->next_pending;
+      run_deleter(reversed);
+      reversed = next;
+    }
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+      // Cleared under the mutex before checking the count, so a release that
+      // sets it again after this either is seen by the check or wakes us up
+      wakeup_pending_.store(false, std::memory_order_relaxed);
+      wakeup_.wait_for(lock, config_.max_delay, [this] {
+        return stop_ || pending_count_.load(std::memory_order_relaxed) >= config_.batch_size;
+      });
+      lock.unlock();
+      run_pending();
+      lock.lock();
+    }
+  }
+
+  std::atomic<RefcountedDeleterContext*> pending_{nullptr};
+  std::atomic<size_t> pending_count_{0};
+  // Whether a release has notified the reclaimer since it last went to sleep
+  std::atomic<bool> wakeup_pending_{false};
+  std::atomic<ReleaseMode> mode_{ReleaseMode::Immediate};
+  std::atomic<size_t> batch_size_{ReclaimerConfig().batch_size};
+  std::atomic<size_t> max_pending_{ReclaimerConfig().max_pending};
+
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  ReclaimerConfig config_;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+void refcounted_deleter(void* ctx) {
+  RefcountedDeleterContext& ctx_ = *reinterpret_cast<RefcountedDeleterContext*>(ctx);
+  if (ctx_.decref()) {
+    Reclaimer::get().release(&ctx_);
+  }
+}
+
+// This is a shortened version of `UniqueVoidPtr` taken from `c10/util/UniqueVoidPtr.h`
+class UniqueVoidPtr {
+ private:
+  void* data_;
+  std::unique_ptr<void, DeleterFnPtr> ctx_;
+ public:
+  UniqueVoidPtr(void* data, void* ctx, DeleterFnPtr ctx_deleter)
+    : data_(data), ctx_(ctx, ctx_deleter) {}
+
+  void clear() {
+    ctx_ = nullptr;
+    data_ = nullptr;
+  }
+
+  void* get() const {
+    return data_;
+  }
+
+  void* get_context() const {
+    return ctx_.get();
+  }
+};
+
+// Makes a `UniqueVoidPtr` that owns `data` through a new refcounted context
+UniqueVoidPtr make_refcounted(void* data, DeleterFnPtr concrete_deleter) {
+  auto* ctx = new RefcountedDeleterContext(data, concrete_deleter);
+  return UniqueVoidPtr(data, ctx, &refcounted_deleter);
+}
+
+// Makes another `UniqueVoidPtr` that shares the buffer of `ptr`, which must
+// have been made by `make_refcounted`
+UniqueVoidPtr share(const UniqueVoidPtr& ptr) {
+  auto* ctx = static_cast<RefcountedDeleterContext*>(ptr.get_context());
+  ctx->incref();
+  return UniqueVoidPtr(ptr.get(), ctx, &refcounted_deleter);
+}
+
+void check(bool cond, const char* msg) {
+  std::cout << (cond ? "yay. " : "BOO. ") << msg << std::endl;
+}
+
+static std::atomic<size_t> num_frees{0};
+static std::atomic<std::thread::id> last_free_thread;
+
+void counting_free(void* ptr) {
+  last_free_thread.store(std::this_thread::get_id());
+  num_frees.fetch_add(1, std::memory_order_relaxed);
+  std::free(ptr);
+}
+
+void example() {
+  auto& reclaimer = Reclaimer::get();
+
+  UniqueVoidPtr a = make_refcounted(std::malloc(16), &counting_free);
+  UniqueVoidPtr b = share(a);
+  a.clear();
+  b.clear();
+  check(num_frees == 1 && last_free_thread == std::this_thread::get_id(),
+    "immediate mode frees on the clearing thread");
+
+  // Long delay and big batches, so nothing is freed until we flush
+  ReclaimerConfig config;
+  config.batch_size = 1000;
+  config.max_delay = std::chrono::seconds(10);
+  reclaimer.set_mode(ReleaseMode::Deferred, config);
+  num_frees = 0;
+  for (size_t i = 0; i < 10; i++) {
+    make_refcounted(std::malloc(16), &counting_free).clear();
+  }
+  check(num_frees == 0 && reclaimer.num_pending() == 10, "deferred mode doesn't free on the clearing thread");
+  reclaimer.flush();
+  check(num_frees == 10 && reclaimer.num_pending() == 0, "flush frees everything pending");
+
+  // A small batch wakes up the reclaimer thread
+  config.batch_size = 4;
+  reclaimer.set_mode(ReleaseMode::Deferred, config);
+  num_frees = 0;
+  for (size_t i = 0; i < 4; i++) {
+    make_refcounted(std::malloc(16), &counting_free).clear();
+  }
+  for (size_t i = 0; i < 1000 && num_frees < 4; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  check(num_frees == 4 && last_free_thread != std::this_thread::get_id(),
+    "reclaimer thread frees a full batch");
+
+  reclaimer.set_mode(ReleaseMode::Immediate);
+  std::cout << "----------------------" << std::endl;
+}
+
+// Times each clear of the last reference to a big buffer
+std::vector<uint32_t> bench_clear(size_t iters, size_t nbytes) {
+  std::vector<uint32_t> latencies;
+  latencies.reserve(iters);
+  for (size_t i = 0; i < iters; i++) {
+    void* buffer = std::malloc(nbytes);
+    // Touch every page, so freeing it has real work to do
+    std::memset(buffer, 1, nbytes);
+    UniqueVoidPtr ptr = make_refcounted(buffer, &std::free);
+    auto start = std::chrono::steady_clock::now();
+    ptr.clear();
+    auto end = std::chrono::steady_clock::now();
+    latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+  }
+  return latencies;
+}
+
+void print_latencies(const char* name, std::vector<uint32_t> latencies) {
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) {
+    return latencies[std::min(latencies.size() - 1, size_t(p * latencies.size()))];
+  };
+  std::cout << name << "  p50 ns: " << percentile(0.5)
+    << "  p99 ns: " << percentile(0.99)
+    << "  p99.9 ns: " << percentile(0.999)
+    << "  max ns: " << latencies.back() << std::endl;
+
+  // Power of 2 buckets
+  std::vector<size_t> buckets(32);
+  for (uint32_t ns : latencies) {
+    size_t bucket = 0;
+    while ((uint64_t(1) << (bucket + 1)) <= ns) {
+      bucket++;
+    }
+    buckets[bucket]++;
+  }
+  for (size_t bucket = 0; bucket < buckets.size(); bucket++) {
+    if (buckets[bucket]) {
+      size_t bar = (buckets[bucket] * 50 + latencies.size() - 1) / latencies.size();
+      std::cout << "    >= " << (uint64_t(1) << bucket) << " ns\t" << buckets[bucket]
+        << "\t" << std::string(bar, '#') << std::endl;
+    }
+  }
+}
+
+int main() {
+  example();
+
+  const size_t iters = 5000;
+  const size_t nbytes = size_t(1) << 20;
+  // glibc raises its mmap threshold after big buffers are freed, so they end
+  // up being reused from the heap and freeing them gets cheap. Setting the
+  // threshold explicitly turns that off, so every buffer is `mmap`ed and
+  // freeing it is a `munmap`, like a real big tensor.
+  mallopt(M_MMAP_THRESHOLD, nbytes / 2);
+
+  print_latencies("immediate", bench_clear(iters, nbytes));
+
+  ReclaimerConfig config;
+  config.batch_size = 32;
+  Reclaimer::get().set_mode(ReleaseMode::Deferred, config);
+  print_latencies("deferred ", bench_clear(iters, nbytes));
+  Reclaimer::get().flush();
+}
@@ -0,0 +1,409 @@
+// Same as main4.cpp, except `RefcountedDeleterContext` can record every
+// create, incref, decref, and free into a per-thread binary ring buffer, so
+// buffer leaks can be tracked down after the fact.
+//
+// main3.cpp prints every incref and decref with `std::cout`, which is far too
+// slow to leave on. Here, the context takes a `Trace` policy:
+//
+//  * `NoTrace` does nothing, and compiles away completely.
+//
+//  * `RingTrace` appends a 24 byte `refcount_trace::Event` to a ring buffer
+//    that belongs to the calling thread, so recording an event doesn't need
+//    any synchronization. When a ring is full, its oldest events are
+//    overwritten, and the number overwritten is recorded, so the ring size
+//    can be set with `RingTrace::set_ring_size` to fit the workload.
+//    `RingTrace::dump` writes every thread's ring to a file in the format
+//    described in trace_format.h. It has to be called when no other thread is
+//    recording.
+//
+// Events are timestamped with the TSC on x86, which is cheaper to read than
+// `steady_clock`, and `dump` converts the timestamps to nanoseconds. Tracing
+// is still far from free: on a 1 core VM, incref + clear took about 16 ns
+// without tracing, about 118 ns with one `steady_clock::now()` per event, and
+// 70 to 90 ns with the TSC, since every incref + clear records two events. So
+// it's meant for tracking down a leak, not to be left on everywhere.
+//
+// The default is `NoTrace`, unless `-DREFCOUNT_TRACE` is given. The
+// trace_dump.cpp tool reads a trace file, prints histograms of how long
+// contexts lived and how many increfs they had, and lists the contexts that
+// were created but never freed.
+//
+// The example shares buffers between threads, deliberately leaks a few of
+// them, dumps the trace, and checks that the trace shows exactly those leaks.
+// The benchmark compares the cost of incref + clear with and without tracing.
+//
+// Build and run with:
+//   g++ -std=c++17 -O2 -pthread -DREFCOUNT_TRACE main9.cpp -o main9
+//   g++ -std=c++17 -O2 trace_dump.cpp -o trace_dump
+//   ./main9 refcount_trace.bin && ./trace_dump refcount_trace.bin
+
+#include "trace_format.h"
+
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using DeleterFnPtr = void (*)(void*);
+
+using refcount_trace::Event;
+using refcount_trace::EventKind;
+
+struct NoTrace {
+  static void record(EventKind, const void*, size_t) {}
+};
+
+class RingTrace {
+ public:
+  static constexpr size_t kDefaultRingSize = size_t(1) << 16;
+
+  // Number of events each thread's ring holds. Only affects rings of threads
+  // that haven't recorded anything yet, so call it before tracing starts.
+  static void set_ring_size(size_t ring_size) {
+    ring_size_.store(std::max<size_t>(ring_size, 1), std::memory_order_relaxed);
+  }
+
+  static void record(EventKind kind, const void* ctx, size_t refcount) {
+    ThreadRing& ring = thread_ring();
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    Event& event = ring.events[head % ring.size];
+    // In ticks until `dump` converts it
+    event.timestamp_ns = now_ticks();
+    event.ctx = reinterpret_cast<uint64_t>(ctx);
+    event.refcount = static_cast<uint32_t>(refcount);
+    event.kind = kind;
+    ring.head.store(head + 1, std::memory_order_release);
+  }
+
+  // Writes every thread's events to `path`. No thread may be recording
+  // events while this runs.
+  static bool dump(const char* path) {
+    std::lock_guard<std::mutex> guard(rings_mutex());
+    auto& rings = all_rings();
+    FILE* file = std::fopen(path, "wb");
+    if (!file) {
+      return false;
+    }
+    refcount_trace::FileHeader file_header{};
+    std::copy(std::begin(refcount_trace::kMagic), std::end(refcount_trace::kMagic), file_header.magic);
+    file_header.version = refcount_trace::kVersion;
+    file_header.num_threads = static_cast<uint32_t>(rings.size());
+    bool ok = std::fwrite(&file_header, sizeof(file_header), 1, file) == 1;
+
+    // Maps ticks to nanoseconds, by comparing how far both clocks have moved
+    // since the first ring was made
+    const ClockStart& start = clock_start();
+    uint64_t end_ticks = now_ticks();
+    uint64_t end_ns = steady_ns();
+    double ns_per_tick = end_ticks > start.ticks
+      ? double(end_ns - start.ns) / double(end_ticks - start.ticks) : 1.0;
+
+    for (size_t thread_index = 0; thread_index < rings.size(); thread_index++) {
+      ThreadRing& ring = *rings[thread_index];
+      uint64_t head = ring.head.load(std::memory_order_acquire);
+      uint64_t num_events = std::min<uint64_t>(head, ring.size);
+      refcount_trace::ThreadHeader thread_header{};
+      thread_header.thread_index = static_cast<uint32_t>(thread_index);
+      thread_header.num_events = num_events;
+      thread_header.num_dropped = head - num_events;
+      ok &= std::fwrite(&thread_header, sizeof(thread_header), 1, file) == 1;
+      // Oldest first, which might wrap around the end of the ring
+      for (uint64_t i = head - num_events; i < head; i++) {
+        Event event = ring.events[i % ring.size];
+        event.timestamp_ns = start.ns + static_cast<uint64_t>(
+          static_cast<double>(event.timestamp_ns - start.ticks) * ns_per_tick);
+        ok &= std::fwrite(&event, sizeof(Event), 1, file) == 1;
+      }
+    }
+    ok &= std::fclose(file) == 0;
+    return ok;
+  }
+
+  // Forgets every event recorded so far
+  static void reset() {
+    std::lock_guard<std::mutex> guard(rings_mutex());
+    for (ThreadRing* ring : all_rings()) {
+      ring->head.store(0, std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  struct ThreadRing {
+    size_t size = ring_size_.load(std::memory_order_relaxed);
+    std::unique_ptr<Event[]> events{new Event[size]};
+    // Total number of events ever recorded. Only the owning thread writes it.
+    std::atomic<uint64_t> head{0};
+  };
+
+  struct ClockStart {
+    uint64_t ticks = now_ticks();
+    uint64_t ns = steady_ns();
+  };
+
+  static uint64_t steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  static uint64_t now_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return steady_ns();
+#endif
+  }
+
+  static const ClockStart& clock_start() {
+    static ClockStart start;
+    return start;
+  }
+
+  // Rings are never freed, so a thread's events can still be dumped after it
+  // exits
+  static ThreadRing& thread_ring() {
+    thread_local ThreadRing* ring = [] {
+      clock_start();
+      auto* new_ring = new ThreadRing();
+      std::lock_guard<std::mutex> guard(rings_mutex());
+      all_rings().push_back(new_ring);
+      return new_ring;
+    }();
+    return *ring;
+  }
+
+  static std::mutex& rings_mutex() {
+    static auto* mutex = new std::mutex();
+    return *mutex;
+  }
+
+  static std::vector<ThreadRing*>& all_rings() {
+    static auto* rings = new std::vector<ThreadRing*>();
+    return *rings;
+  }
+
+  static inline std::atomic<size_t> ring_size_{kDefaultRingSize};
+};
+
+#ifdef REFCOUNT_TRACE
+using DefaultTrace = RingTrace;
+#else
+using DefaultTrace = NoTrace;
+#endif
+
+template <typename Trace>
+struct RefcountedDeleterContext {
+  RefcountedDeleterContext(void* ptr, DeleterFnPtr concrete_deleter)
+    : concrete_deleter(concrete_deleter), refcount(1), ptr(ptr) {
+    Trace::record(EventKind::Create, this, 1);
+  }
+
+  // Only call this while holding a reference
+  void incref() {
+    size_t after = refcount.fetch_add(1, std::memory_order_relaxed) + 1;
+    Trace::record(EventKind::Incref, this, after);
+  }
+
+  // Returns true if this was the last reference
+  bool decref() {
+    size_t after = refcount.fetch_sub(1, std::memory_order_acq_rel) - 1;
+    Trace::record(EventKind::Decref, this, after);
+    return after == 0;
+  }
+
+  DeleterFnPtr concrete_deleter;
+  std::atomic<size_t> refcount;
+  void* ptr;
+};
+
+template <typename Trace>
+void refcounted_deleter(void* ctx) {
+  auto& ctx_ = *reinterpret_cast<RefcountedDeleterContext<Trace>*>(ctx);
+  if (ctx_.decref()) {
+    // Recorded before the context is deleted, so its address can't be reused
+    // by another context with an earlier timestamp
+    Trace::record(EventKind::Free, &ctx_, 0);
+    ctx_.concrete_deleter(ctx_.ptr);
+    delete &ctx_;
+  }
+}
+
+// This is a shortened version of `UniqueVoidPtr` taken from `c10/util/UniqueVoidPtr.h`
+class UniqueVoidPtr {
+ private:
+  void* data_;
+  std::unique_ptr<void, DeleterFnPtr> ctx_;
+ public:
+  UniqueVoidPtr(void* data, void* ctx, DeleterFnPtr ctx_deleter)
+    : data_(data), ctx_(ctx, ctx_deleter) {}
+
+  void clear() {
+    ctx_ = nullptr;
+    data_ = nullptr;
+  }
+
+  void* get() const {
+    return data_;
+  }
+
+  void* get_context() const {
+    return ctx_.get();
+  }
+};
+
+// Makes a `UniqueVoidPtr` that owns `data` through a new refcounted context
+template <typename Trace = DefaultTrace>
+UniqueVoidPtr make_refcounted(void* data, DeleterFnPtr concrete_deleter) {
+  auto* ctx = new RefcountedDeleterContext<Trace>(data, concrete_deleter);
+  return UniqueVoidPtr(data, ctx, &refcounted_deleter<Trace>);
+}
+
+// Makes another `UniqueVoidPtr` that shares the buffer of `ptr`, which must
+// have been made by `make_refcounted<Trace>`
+template <typename Trace = DefaultTrace>
+UniqueVoidPtr share(const UniqueVoidPtr& ptr) {
+  auto* ctx = static_cast<RefcountedDeleterContext<Trace>*>(ptr.get_context());
+  ctx->incref();
+  return UniqueVoidPtr(ptr.get(), ctx, &refcounted_deleter<Trace>);
+}
+
+const size_t kLeakEvery = 1000;
+
+// Shares `num_buffers` buffers between threads, which clear them at random
+// times. Every `kLeakEvery`th buffer, one of the threads leaks a reference.
+// Returns the number of buffers leaked.
+size_t example(size_t num_threads, size_t num_buffers) {
+  std::vector<std::vector<UniqueVoidPtr>> refs(num_threads);
+  for (size_t id = 0; id < num_buffers; id++) {
+    UniqueVoidPtr ptr = make_refcounted(std::malloc(16), &std::free);
+    for (auto& thread_refs : refs) {
+      thread_refs.push_back(share(ptr));
+    }
+  }
+
+  std::vector<std::thread> threads;
+  for (size_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+    threads.emplace_back([&, thread_idx] {
+      std::mt19937 rng(thread_idx);
+      auto& thread_refs = refs[thread_idx];
+      for (size_t id = 0; id < num_buffers; id++) {
+        UniqueVoidPtr& ptr = thread_refs[id];
+        if (id % kLeakEvery == 0 && id / kLeakEvery % num_threads == thread_idx) {
+          new UniqueVoidPtr(share(ptr));
+        }
+        UniqueVoidPtr extra = share(ptr);
+        if (rng() % 2) {
+          ptr.clear();
+        }
+        extra.clear();
+        ptr.clear();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return num_buffers / kLeakEvery;
+}
+
+void noop_deleter(void*) {}
+
+template <typename Trace>
+double bench_incref_clear_ns(size_t iters) {
+  UniqueVoidPtr base = make_refcounted<Trace>(nullptr, &noop_deleter);
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iters; i++) {
+    UniqueVoidPtr ptr = share<Trace>(base);
+    ptr.clear();
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / iters;
+}
+
+// Reads back a trace written by `RingTrace::dump`, and returns the number of
+// contexts that were created but never freed. Returns -1 if the trace can't
+// be read or events were dropped, since then leaks can't be counted exactly.
+long count_leaks_in_trace(const char* path) {
+  FILE* file = std::fopen(path, "rb");
+  if (!file) {
+    return -1;
+  }
+  std::vector<Event> events;
+  bool ok = true;
+  refcount_trace::FileHeader file_header;
+  ok &= std::fread(&file_header, sizeof(file_header), 1, file) == 1 &&
+    std::memcmp(file_header.magic, refcount_trace::kMagic, sizeof(file_header.magic)) == 0;
+  for (uint32_t i = 0; ok && i < file_header.num_threads; i++) {
+    refcount_trace::ThreadHeader thread_header;
+    ok &= std::fread(&thread_header, sizeof(thread_header), 1, file) == 1 &&
+      thread_header.num_dropped == 0;
+    for (uint64_t j = 0; ok && j < thread_header.num_events; j++) {
+      Event event;
+      ok &= std::fread(&event, sizeof(event), 1, file) == 1;
+      events.push_back(event);
+    }
+  }
+  std::fclose(file);
+  if (!ok) {
+    return -1;
+  }
+  std::stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) {
+    return a.timestamp_ns < b.timestamp_ns;
+  });
+  std::unordered_set<uint64_t> live;
+  for (const Event& event : events) {
+    if (event.kind == EventKind::Create) {
+      live.insert(event.ctx);
+    } else if (event.kind == EventKind::Free) {
+      live.erase(event.ctx);
+    }
+  }
+  return static_cast<long>(live.size());
+}
+
+int main([[maybe_unused]] int argc, [[maybe_unused]] char** argv) {
+  size_t num_threads = std::max(2u, std::thread::hardware_concurrency());
+  const size_t num_buffers = 10'000;
+  // The main thread records a create, an incref for each thread, and a
+  // decref for every buffer. Each other thread records at most 5 events per
+  // buffer.
+  RingTrace::set_ring_size(std::max<size_t>(num_threads + 2, 5) * num_buffers);
+
+  size_t num_leaked = example(num_threads, num_buffers);
+  std::cout << "leaked " << num_leaked << " buffers on purpose" << std::endl;
+#ifdef REFCOUNT_TRACE
+  const char* trace_path = argc > 1 ? argv[1] : "refcount_trace.bin";
+  if (RingTrace::dump(trace_path)) {
+    std::cout << "wrote trace to " << trace_path << std::endl;
+  } else {
+    std::cout << "failed to write trace to " << trace_path << std::endl;
+    return 1;
+  }
+  long num_found = count_leaks_in_trace(trace_path);
+  if (num_found != static_cast<long>(num_leaked)) {
+    std::cout << "BOO. trace shows " << num_found << " leaks" << std::endl;
+    return 1;
+  }
+  std::cout << "yay. trace shows all " << num_found << " leaks" << std::endl;
+#else
+  std::cout << "build with -DREFCOUNT_TRACE to record a trace" << std::endl;
+#endif
+
+  const size_t iters = 20'000'000;
+  std::cout << std::endl << "incref + clear, ns:" << std::endl;
+  std::cout << "  no trace:   " << bench_incref_clear_ns<NoTrace>(iters) << std::endl;
+  std::cout << "  ring trace: " << bench_incref_clear_ns<RingTrace>(iters) << std::endl;
+  RingTrace::reset();
+}
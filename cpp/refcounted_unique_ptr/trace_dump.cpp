@@ -0,0 +1,237 @@
+// Reads a refcount trace written by main9.cpp, and prints:
+//
+//  * How many events of each kind each thread recorded, and how many were
+//    dropped because the thread's ring buffer was full.
+//
+//  * A histogram of how long contexts lived, from create to free, and a
+//    histogram of how many increfs each context had.
+//
+//  * The contexts that were created but never freed by the end of the trace,
+//    oldest first. These are either leaks or buffers that were still in use
+//    when the trace was dumped.
+//
+// Events from all threads are merged by timestamp. If a thread dropped
+// events, contexts whose create was dropped are ignored, and a context whose
+// free was dropped shows up as a leak, so the leak list is only exact when
+// nothing was dropped.
+//
+// Exits with 1 if any contexts were leaked, so it can be used in a test.
+//
+// Build with:
+//   g++ -std=c++17 -O2 trace_dump.cpp -o trace_dump
+//
+// Usage:
+//   ./trace_dump <trace_file> [max_leaks_to_list]
+
+#include "trace_format.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using refcount_trace::Event;
+using refcount_trace::EventKind;
+
+struct ThreadEvent {
+  Event event;
+  uint32_t thread_index;
+};
+
+struct LiveContext {
+  uint64_t create_ns;
+  uint32_t create_thread;
+  uint32_t refcount;
+  uint32_t max_refcount;
+  uint64_t num_increfs;
+};
+
+// Histogram with power of 2 buckets
+class Histogram {
+ public:
+  void add(uint64_t value) {
+    size_t bucket = 0;
+    while (bucket + 1 < buckets_.size() && (uint64_t(1) << (bucket + 1)) <= value) {
+      bucket++;
+    }
+    buckets_[bucket]++;
+    total_++;
+  }
+
+  void print(const char* unit) const {
+    if (total_ == 0) {
+      std::cout << "    (empty)" << std::endl;
+      return;
+    }
+    for (size_t bucket = 0; bucket < buckets_.size(); bucket++) {
+      if (buckets_[bucket]) {
+        size_t bar = (buckets_[bucket] * 50 + total_ - 1) / total_;
+        std::cout << "    >= " << (bucket ? uint64_t(1) << bucket : 0) << " " << unit
+          << "\t" << buckets_[bucket] << "\t" << std::string(bar, '#') << std::endl;
+      }
+    }
+  }
+
+ private:
+  std::vector<uint64_t> buckets_ = std::vector<uint64_t>(64);
+  uint64_t total_ = 0;
+};
+
+bool read_trace(const char* path, std::vector<ThreadEvent>& events, uint64_t& num_dropped) {
+  FILE* file = std::fopen(path, "rb");
+  if (!file) {
+    std::cerr << "can't open " << path << std::endl;
+    return false;
+  }
+  refcount_trace::FileHeader file_header;
+  if (std::fread(&file_header, sizeof(file_header), 1, file) != 1 ||
+      std::memcmp(file_header.magic, refcount_trace::kMagic, sizeof(file_header.magic)) != 0) {
+    std::cerr << path << " is not a refcount trace" << std::endl;
+    std::fclose(file);
+    return false;
+  }
+  if (file_header.version != refcount_trace::kVersion) {
+    std::cerr << path << " has version " << file_header.version
+      << ", expected " << refcount_trace::kVersion << std::endl;
+    std::fclose(file);
+    return false;
+  }
+
+  std::cout << "threads: " << file_header.num_threads << std::endl;
+  num_dropped = 0;
+  for (uint32_t i = 0; i < file_header.num_threads; i++) {
+    refcount_trace::ThreadHeader thread_header;
+    if (std::fread(&thread_header, sizeof(thread_header), 1, file) != 1) {
+      std::cerr << path << " is truncated" << std::endl;
+      std::fclose(file);
+      return false;
+    }
+    uint64_t counts[4] = {};
+    for (uint64_t j = 0; j < thread_header.num_events; j++) {
+      ThreadEvent thread_event;
+      if (std::fread(&thread_event.event, sizeof(Event), 1, file) != 1) {
+        std::cerr << path << " is truncated" << std::endl;
+        std::fclose(file);
+        return false;
+      }
+      thread_event.thread_index = thread_header.thread_index;
+      counts[static_cast<size_t>(thread_event.event.kind) & 3]++;
+      events.push_back(thread_event);
+    }
+    num_dropped += thread_header.num_dropped;
+    std::cout << "  thread " << thread_header.thread_index
+      << "  events: " << thread_header.num_events
+      << "  dropped: " << thread_header.num_dropped;
+    for (size_t kind = 0; kind < 4; kind++) {
+      std::cout << "  " << refcount_trace::event_kind_name(static_cast<EventKind>(kind))
+        << ": " << counts[kind];
+    }
+    std::cout << std::endl;
+  }
+  std::fclose(file);
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " <trace_file> [max_leaks_to_list]" << std::endl;
+    return 2;
+  }
+  size_t max_leaks_to_list = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 20;
+
+  std::vector<ThreadEvent> events;
+  uint64_t num_dropped;
+  if (!read_trace(argv[1], events, num_dropped)) {
+    return 2;
+  }
+  std::stable_sort(events.begin(), events.end(), [](const ThreadEvent& a, const ThreadEvent& b) {
+    return a.event.timestamp_ns < b.event.timestamp_ns;
+  });
+
+  std::unordered_map<uint64_t, LiveContext> live;
+  Histogram lifetimes;
+  Histogram increfs;
+  uint64_t num_unknown = 0;
+  uint64_t num_recreated = 0;
+  uint64_t num_freed = 0;
+
+  for (const ThreadEvent& thread_event : events) {
+    const Event& event = thread_event.event;
+    if (event.kind == EventKind::Create) {
+      if (live.count(event.ctx)) {
+        num_recreated++;
+      }
+      live[event.ctx] = {event.timestamp_ns, thread_event.thread_index, 1, 1, 0};
+      continue;
+    }
+    auto it = live.find(event.ctx);
+    if (it == live.end()) {
+      // Its create was dropped, or happened before tracing started
+      num_unknown++;
+      continue;
+    }
+    LiveContext& ctx = it->second;
+    switch (event.kind) {
+      case EventKind::Incref:
+        ctx.num_increfs++;
+        ctx.refcount = event.refcount;
+        ctx.max_refcount = std::max(ctx.max_refcount, event.refcount);
+        break;
+      case EventKind::Decref:
+        ctx.refcount = event.refcount;
+        break;
+      case EventKind::Free:
+        lifetimes.add(event.timestamp_ns - ctx.create_ns);
+        increfs.add(ctx.num_increfs);
+        num_freed++;
+        live.erase(it);
+        break;
+      case EventKind::Create:
+        break;
+    }
+  }
+
+  std::cout << std::endl << "contexts freed: " << num_freed << std::endl;
+  std::cout << "  lifetime:" << std::endl;
+  lifetimes.print("ns");
+  std::cout << "  increfs per context:" << std::endl;
+  increfs.print("increfs");
+
+  if (num_dropped) {
+    std::cout << std::endl << "WARNING: " << num_dropped
+      << " events were dropped, so leaks below may include contexts whose free was dropped"
+      << std::endl;
+  }
+  if (num_unknown) {
+    std::cout << "ignored " << num_unknown << " events for contexts created before the trace" << std::endl;
+  }
+  if (num_recreated) {
+    std::cout << "WARNING: " << num_recreated
+      << " contexts were created again without being freed, so events are missing" << std::endl;
+  }
+
+  uint64_t end_ns = events.empty() ? 0 : events.back().event.timestamp_ns;
+  std::vector<std::pair<uint64_t, LiveContext>> leaks(live.begin(), live.end());
+  std::sort(leaks.begin(), leaks.end(), [](const auto& a, const auto& b) {
+    return a.second.create_ns < b.second.create_ns;
+  });
+  std::cout << std::endl << "contexts never freed: " << leaks.size() << std::endl;
+  for (size_t i = 0; i < std::min(leaks.size(), max_leaks_to_list); i++) {
+    const auto& [ctx, info] = leaks[i];
+    std::cout << "  ctx 0x" << std::hex << ctx << std::dec
+      << "  created by thread " << info.create_thread
+      << "  age ns: " << end_ns - info.create_ns
+      << "  refcount: " << info.refcount
+      << "  max refcount: " << info.max_refcount
+      << "  increfs: " << info.num_increfs
+      << std::endl;
+  }
+  if (leaks.size() > max_leaks_to_list) {
+    std::cout << "  ..." << std::endl;
+  }
+  return leaks.empty() ? 0 : 1;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+// Binary format of the refcount traces written by main9.cpp and read by
+// trace_dump.cpp.
+//
+// A trace file is a `FileHeader`, then for each thread that recorded events,
+// a `ThreadHeader` followed by `num_events` `Event`s in the order that thread
+// recorded them. Everything is in the native byte order of the machine that
+// wrote it.
+
+#include <cstdint>
+
+namespace refcount_trace {
+
+enum class EventKind : uint8_t {
+  // A context was made, with a refcount of 1
+  Create,
+  Incref,
+  Decref,
+  // The refcount reached 0 and the concrete deleter is about to run
+  Free,
+};
+
+struct Event {
+  uint64_t timestamp_ns;
+  uint64_t ctx;
+  // Refcount after the event
+  uint32_t refcount;
+  EventKind kind;
+  uint8_t padding[3];
+};
+
+static_assert(sizeof(Event) == 24, "Event must be 24 bytes");
+
+constexpr char kMagic[8] = {'R', 'C', 'T', 'R', 'A', 'C', 'E', '\0'};
+constexpr uint32_t kVersion = 1;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_threads;
+};
+
+struct ThreadHeader {
+  uint32_t thread_index;
+  uint32_t padding;
+  uint64_t num_events;
+  // Number of the thread's oldest events that were overwritten because its
+  // ring buffer was full
+  uint64_t num_dropped;
+};
+
+inline const char* event_kind_name(EventKind kind) {
+  switch (kind) {
+    case EventKind::Create: return "create";
+    case EventKind::Incref: return "incref";
+    case EventKind::Decref: return "decref";
+    case EventKind::Free: return "free";
+  }
+  return "unknown";
+}
+
+} // namespace refcount_trace